@@ -0,0 +1,778 @@
+// JPEG decoder for thumbnails, which can scale down by 2, 4 or 8 in the inverse DCT, so the full image never has to
+// be built. Handles 8-bit Huffman-coded sequential files with one or three components; everything else
+// (progressive, arithmetic coding, 12 bits, CMYK, ...) is left to stb_image.
+// https://www.w3.org/Graphics/JPEG/itu-t81.pdf
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#define JPEG_FAST_BITS 9
+
+typedef struct
+{
+  // Indexed by the next JPEG_FAST_BITS input bits.
+  // Holds the code length in the high byte and the symbol in the low one, or 0 for longer codes.
+  u16 fast[1 << JPEG_FAST_BITS];
+  // For AC tables, whole coefficients whose code and magnitude fit into JPEG_FAST_BITS, or 0:
+  // The value in the high byte, then the run of zeros before it and the bits taken up in a nibble each.
+  i16 fast_ac[1 << JPEG_FAST_BITS];
+
+  // Canonical decoding of the longer codes.
+  u16 first_code[17];
+  u16 first_symbol[17];
+  u16 code_count[17];
+  u8 symbols[256];
+} jpeg_huffman_t;
+
+typedef struct
+{
+  i32 id;
+  i32 h;  // Sampling factors.
+  i32 v;
+  i32 quant_idx;
+  i32 dc_table;
+  i32 ac_table;
+  i32 dc_prediction;
+
+  // Decoded samples at the output scale, a whole number of blocks in each direction.
+  u8* plane;
+  i32 plane_w;
+  i32 plane_h;
+} jpeg_component_t;
+
+typedef struct
+{
+  i32 w;
+  i32 h;
+  i32 component_count;
+  b32 rgb;  // The three components aren't YCbCr, going by Adobe's APP14 segment or the component ids.
+  b32 failed;
+
+  u8* at;  // Where the parsing goes on.
+  u8* end;
+
+  u16 quant[4][64];  // In zigzag order, like in the file.
+  jpeg_huffman_t dc_tables[4];
+  jpeg_huffman_t ac_tables[4];
+  jpeg_component_t components[3];
+  i32 h_max;
+  i32 v_max;
+  i32 restart_interval;
+
+  // Entropy-coded data, aligned to the top bit. Stops being refilled at markers, and reads zeros from there on.
+  u64 bits;
+  i32 bit_count;
+
+  i32 block_size;  // Samples per block side at the output scale: 8, 4, 2 or 1.
+  r32 idct[8][8];  // Basis functions, indexed by output sample and frequency.
+} jpeg_decoder_t;
+
+static u8 jpeg_zigzag[64] = {
+   0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+  12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+  35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+  58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+internal u32 jpeg_read_u16(u8* p)
+{
+  return ((u32)p[0] << 8) | (u32)p[1];
+}
+
+internal b32 jpeg_build_huffman(jpeg_huffman_t* huff, u8* counts, u8* symbols, i32 symbol_count)
+{
+  b32 result = true;
+  zero_struct(*huff);
+  memcpy(huff->symbols, symbols, symbol_count);
+
+  u32 code = 0;
+  i32 symbol_idx = 0;
+  for(i32 length = 1;
+      length <= 16;
+      ++length)
+  {
+    huff->first_code[length] = (u16)code;
+    huff->first_symbol[length] = (u16)symbol_idx;
+    huff->code_count[length] = counts[length - 1];
+    // Codes must not run out of bits, which would also fill the fast tables past their end.
+    if(code + counts[length - 1] > (1u << length))
+    {
+      result = false;
+      break;
+    }
+    for_count(i, counts[length - 1])
+    {
+      if(length <= JPEG_FAST_BITS)
+      {
+        u32 fill_count = 1 << (JPEG_FAST_BITS - length);
+        u32 first = code << (JPEG_FAST_BITS - length);
+        for_count(fill_idx, fill_count)
+        {
+          huff->fast[first + fill_idx] = (u16)((length << 8) | symbols[symbol_idx]);
+
+          i32 run = symbols[symbol_idx] >> 4;
+          i32 magnitude_bit_count = symbols[symbol_idx] & 15;
+          if(magnitude_bit_count && length + magnitude_bit_count <= JPEG_FAST_BITS)
+          {
+            i32 value = (i32)(fill_idx >> (JPEG_FAST_BITS - length - magnitude_bit_count));
+            if(value < (1 << (magnitude_bit_count - 1)))
+            {
+              value += 1 - (1 << magnitude_bit_count);
+            }
+            if(value >= -128 && value <= 127)
+            {
+              huff->fast_ac[first + fill_idx] = (i16)((value * 256) | (run << 4) | (length + magnitude_bit_count));
+            }
+          }
+        }
+      }
+      ++code;
+      ++symbol_idx;
+    }
+    code <<= 1;
+  }
+
+  return result;
+}
+
+internal inline void jpeg_refill(jpeg_decoder_t* jpeg)
+{
+  while(jpeg->bit_count <= 56)
+  {
+    u32 byte = 0;
+    if(jpeg->at < jpeg->end && jpeg->at[0] != 0xff)
+    {
+      byte = *jpeg->at++;
+    }
+    else if(jpeg->at + 1 < jpeg->end && jpeg->at[0] == 0xff && jpeg->at[1] == 0)
+    {
+      // Stuffed byte.
+      byte = 0xff;
+      jpeg->at += 2;
+    }
+    jpeg->bits |= (u64)byte << (56 - jpeg->bit_count);
+    jpeg->bit_count += 8;
+  }
+}
+
+// Returns -1 for codes that aren't in the table.
+internal inline i32 jpeg_decode_symbol(jpeg_decoder_t* jpeg, jpeg_huffman_t* huff)
+{
+  if(jpeg->bit_count < 16)
+  {
+    jpeg_refill(jpeg);
+  }
+
+  i32 symbol = -1;
+  i32 length = 0;
+  u32 entry = huff->fast[jpeg->bits >> (64 - JPEG_FAST_BITS)];
+  if(entry)
+  {
+    symbol = entry & 0xff;
+    length = entry >> 8;
+  }
+  else
+  {
+    for(length = JPEG_FAST_BITS + 1; length <= 16; ++length)
+    {
+      u32 code_offset = (u32)(jpeg->bits >> (64 - length)) - huff->first_code[length];
+      if(code_offset < huff->code_count[length])
+      {
+        symbol = huff->symbols[huff->first_symbol[length] + code_offset];
+        break;
+      }
+    }
+    if(symbol < 0)
+    {
+      length = 0;
+    }
+  }
+
+  jpeg->bits <<= length;
+  jpeg->bit_count -= length;
+  return symbol;
+}
+
+// Reads a bit_count-bit magnitude, where the ones starting with a zero bit stand for negative values.
+internal inline i32 jpeg_receive_extend(jpeg_decoder_t* jpeg, i32 bit_count)
+{
+  i32 result = 0;
+  if(bit_count)
+  {
+    if(jpeg->bit_count < bit_count)
+    {
+      jpeg_refill(jpeg);
+    }
+    result = (i32)(jpeg->bits >> (64 - bit_count));
+    jpeg->bits <<= bit_count;
+    jpeg->bit_count -= bit_count;
+    if(result < (1 << (bit_count - 1)))
+    {
+      result += 1 - (1 << bit_count);
+    }
+  }
+  return result;
+}
+
+// Returns the next marker, skipping fill bytes and whatever else comes before it, or 0 at the end of the data.
+internal i32 jpeg_next_marker(jpeg_decoder_t* jpeg)
+{
+  i32 result = 0;
+  while(jpeg->at + 1 < jpeg->end)
+  {
+    if(jpeg->at[0] == 0xff && jpeg->at[1] != 0 && jpeg->at[1] != 0xff)
+    {
+      result = jpeg->at[1];
+      jpeg->at += 2;
+      break;
+    }
+    ++jpeg->at;
+  }
+  return result;
+}
+
+// Reads the segment after a marker, except for scans. Sets failed for what isn't handled here.
+internal void jpeg_read_segment(jpeg_decoder_t* jpeg, i32 marker)
+{
+  if(marker == 0xd8 || (marker >= 0xd0 && marker <= 0xd7) || marker == 0x01)
+  {
+    // No segment after SOI, restart markers and TEM.
+    return;
+  }
+
+  if(jpeg->end - jpeg->at < 2 || jpeg_read_u16(jpeg->at) < 2 || jpeg_read_u16(jpeg->at) > jpeg->end - jpeg->at)
+  {
+    jpeg->failed = true;
+    return;
+  }
+  u8* p = jpeg->at + 2;
+  u8* segment_end = jpeg->at + jpeg_read_u16(jpeg->at);
+  jpeg->at = segment_end;
+
+  if(marker == 0xdb)
+  {
+    // DQT.
+    while(!jpeg->failed && p < segment_end)
+    {
+      i32 precision = p[0] >> 4;
+      i32 table_idx = p[0] & 15;
+      i32 value_size = precision ? 2 : 1;
+      jpeg->failed = (table_idx > 3 || precision > 1 || segment_end - (p + 1) < 64 * value_size);
+      if(!jpeg->failed)
+      {
+        ++p;
+        for_count(i, 64)
+        {
+          jpeg->quant[table_idx][i] = (u16)(precision ? jpeg_read_u16(p + 2 * i) : p[i]);
+        }
+        p += 64 * value_size;
+      }
+    }
+  }
+  else if(marker == 0xc4)
+  {
+    // DHT.
+    while(!jpeg->failed && p < segment_end)
+    {
+      i32 table_class = p[0] >> 4;
+      i32 table_idx = p[0] & 15;
+      i32 symbol_count = 0;
+      if(segment_end - p >= 17)
+      {
+        for_count(i, 16) { symbol_count += p[1 + i]; }
+      }
+      jpeg->failed = (segment_end - p < 17 || table_class > 1 || table_idx > 3
+          || symbol_count > 256 || segment_end - (p + 17) < symbol_count);
+      if(!jpeg->failed)
+      {
+        jpeg_huffman_t* huff = table_class ? &jpeg->ac_tables[table_idx] : &jpeg->dc_tables[table_idx];
+        jpeg->failed = !jpeg_build_huffman(huff, p + 1, p + 17, symbol_count);
+        p += 17 + symbol_count;
+      }
+    }
+  }
+  else if(marker == 0xc0 || marker == 0xc1)
+  {
+    // SOF0 or SOF1, baseline or extended sequential with Huffman coding.
+    jpeg->failed = (jpeg->w != 0 || segment_end - p < 6);
+    if(!jpeg->failed)
+    {
+      jpeg->h = (i32)jpeg_read_u16(p + 1);
+      jpeg->w = (i32)jpeg_read_u16(p + 3);
+      jpeg->component_count = p[5];
+      // A height of 0 would come later in a DNL segment, which nobody writes.
+      jpeg->failed = (p[0] != 8 || jpeg->w == 0 || jpeg->h == 0 || (u64)jpeg->w * jpeg->h >= (1 << 29)
+          || (jpeg->component_count != 1 && jpeg->component_count != 3)
+          || segment_end - (p + 6) < 3 * jpeg->component_count);
+    }
+
+    jpeg->h_max = 1;
+    jpeg->v_max = 1;
+    for(i32 component_idx = 0;
+        !jpeg->failed && component_idx < jpeg->component_count;
+        ++component_idx)
+    {
+      jpeg_component_t* component = &jpeg->components[component_idx];
+      u8* spec = p + 6 + 3 * component_idx;
+      component->id = spec[0];
+      component->h = spec[1] >> 4;
+      component->v = spec[1] & 15;
+      component->quant_idx = spec[2];
+      jpeg->failed = (component->h < 1 || component->h > 4 || component->v < 1 || component->v > 4
+          || component->quant_idx > 3);
+      jpeg->h_max = max(jpeg->h_max, component->h);
+      jpeg->v_max = max(jpeg->v_max, component->v);
+    }
+
+    if(!jpeg->failed && jpeg->component_count == 3)
+    {
+      // Some encoders only say it through the component ids.
+      jpeg->rgb |= (jpeg->components[0].id == 'R' && jpeg->components[1].id == 'G' && jpeg->components[2].id == 'B');
+    }
+
+    for(i32 component_idx = 0;
+        !jpeg->failed && component_idx < jpeg->component_count;
+        ++component_idx)
+    {
+      // Chroma gets replicated, which only works for whole factors.
+      jpeg_component_t* component = &jpeg->components[component_idx];
+      jpeg->failed = (jpeg->h_max % component->h != 0 || jpeg->v_max % component->v != 0);
+    }
+  }
+  else if((marker >= 0xc2 && marker <= 0xcf) && marker != 0xc4 && marker != 0xc8 && marker != 0xcc)
+  {
+    // Progressive, lossless, hierarchical or arithmetic-coded.
+    jpeg->failed = true;
+  }
+  else if(marker == 0xdd)
+  {
+    // DRI.
+    jpeg->failed = (segment_end - p < 2);
+    if(!jpeg->failed)
+    {
+      jpeg->restart_interval = (i32)jpeg_read_u16(p);
+    }
+  }
+  else if(marker == 0xee)
+  {
+    // APP14, where Adobe says whether the components are YCbCr.
+    if(segment_end - p >= 12 && bytes_eq(5, p, "Adobe"))
+    {
+      jpeg->rgb = (p[11] == 0);
+    }
+  }
+}
+
+// Reads the headers up to the frame size. Returns false if the file is broken or isn't handled here;
+// the decoder must be ended either way.
+internal b32 jpeg_begin(jpeg_decoder_t* jpeg, u8* data, u64 size)
+{
+  zero_struct(*jpeg);
+  jpeg->at = data;
+  jpeg->end = data + size;
+
+  jpeg->failed = !(size >= 4 && data[0] == 0xff && data[1] == 0xd8);
+  while(!jpeg->failed && !jpeg->w)
+  {
+    i32 marker = jpeg_next_marker(jpeg);
+    if(!marker || marker == 0xd9 || marker == 0xda)
+    {
+      // No frame before the end or the first scan.
+      jpeg->failed = true;
+    }
+    else
+    {
+      jpeg_read_segment(jpeg, marker);
+    }
+  }
+
+  return !jpeg->failed;
+}
+
+internal void jpeg_end(jpeg_decoder_t* jpeg)
+{
+  for_count(component_idx, array_count(jpeg->components))
+  {
+    free(jpeg->components[component_idx].plane);
+  }
+  zero_struct(*jpeg);
+}
+
+// Decodes a block and writes block_size by block_size samples to out.
+internal b32 jpeg_decode_block(jpeg_decoder_t* jpeg, jpeg_component_t* component, u8* out, i32 out_stride)
+{
+  i32 n = jpeg->block_size;
+  u16* quant = jpeg->quant[component->quant_idx];
+  jpeg_huffman_t* ac_table = &jpeg->ac_tables[component->ac_table];
+
+  // Only the frequencies below n make it into the output.
+  r32 coefs[8][8];
+  for(i32 v = 0; v < n; ++v)
+  {
+    for(i32 u = 0; u < n; ++u) { coefs[v][u] = 0; }
+  }
+
+  i32 dc_bit_count = jpeg_decode_symbol(jpeg, &jpeg->dc_tables[component->dc_table]);
+  b32 result = (dc_bit_count >= 0 && dc_bit_count <= 11);
+  if(result)
+  {
+    component->dc_prediction += jpeg_receive_extend(jpeg, dc_bit_count);
+    coefs[0][0] = (r32)(component->dc_prediction * (i32)quant[0]);
+  }
+
+  b32 has_ac = false;
+  for(i32 k = 1; result && k < 64;)
+  {
+    if(jpeg->bit_count < 16)
+    {
+      jpeg_refill(jpeg);
+    }
+    i32 fast_ac = ac_table->fast_ac[jpeg->bits >> (64 - JPEG_FAST_BITS)];
+    if(fast_ac)
+    {
+      jpeg->bits <<= fast_ac & 15;
+      jpeg->bit_count -= fast_ac & 15;
+      k += (fast_ac >> 4) & 15;
+      if(k < 64)
+      {
+        i32 row = jpeg_zigzag[k] >> 3;
+        i32 column = jpeg_zigzag[k] & 7;
+        if(row < n && column < n)
+        {
+          coefs[row][column] = (r32)((fast_ac >> 8) * (i32)quant[k]);
+          has_ac = true;
+        }
+      }
+      result = (k < 64);
+      ++k;
+      continue;
+    }
+
+    i32 run_size = jpeg_decode_symbol(jpeg, ac_table);
+    i32 run = run_size >> 4;
+    i32 bit_count = run_size & 15;
+    if(run_size < 0)
+    {
+      result = false;
+    }
+    else if(bit_count == 0)
+    {
+      if(run != 15)
+      {
+        // End of block.
+        break;
+      }
+      k += 16;
+    }
+    else
+    {
+      k += run;
+      result = (k < 64);
+      if(result)
+      {
+        i32 value = jpeg_receive_extend(jpeg, bit_count);
+        i32 row = jpeg_zigzag[k] >> 3;
+        i32 column = jpeg_zigzag[k] & 7;
+        if(row < n && column < n)
+        {
+          coefs[row][column] = (r32)(value * (i32)quant[k]);
+          has_ac = true;
+        }
+        ++k;
+      }
+    }
+  }
+
+  if(result && !has_ac)
+  {
+    u8 value = (u8)clamp(0, 255, (i32)(coefs[0][0] * 0.125f + 128.5f));
+    for(i32 y = 0; y < n; ++y)
+    {
+      for(i32 x = 0; x < n; ++x) { out[y * out_stride + x] = value; }
+    }
+  }
+  else if(result)
+  {
+    // Separable: first along the rows, then down the columns.
+    r32 rows[8][8];
+    for(i32 v = 0; v < n; ++v)
+    {
+      for(i32 x = 0; x < n; ++x)
+      {
+        r32 sum = 0;
+        for(i32 u = 0; u < n; ++u) { sum += jpeg->idct[x][u] * coefs[v][u]; }
+        rows[v][x] = sum;
+      }
+    }
+    for(i32 y = 0; y < n; ++y)
+    {
+      for(i32 x = 0; x < n; ++x)
+      {
+        r32 sum = 128.5f;
+        for(i32 v = 0; v < n; ++v) { sum += jpeg->idct[y][v] * rows[v][x]; }
+        out[y * out_stride + x] = (u8)clamp(0, 255, (i32)sum);
+      }
+    }
+  }
+
+  return result;
+}
+
+internal void jpeg_restart(jpeg_decoder_t* jpeg)
+{
+  // Whatever is left before the marker is padding.
+  jpeg->bits = 0;
+  jpeg->bit_count = 0;
+  while(jpeg->at + 1 < jpeg->end && !(jpeg->at[0] == 0xff && jpeg->at[1] >= 0xd0 && jpeg->at[1] <= 0xd7))
+  {
+    ++jpeg->at;
+  }
+  jpeg->at = min(jpeg->at + 2, jpeg->end);
+
+  for_count(component_idx, jpeg->component_count)
+  {
+    jpeg->components[component_idx].dc_prediction = 0;
+  }
+}
+
+// Reads the scan header after an SOS marker and decodes the scan into the component planes.
+internal void jpeg_decode_scan(jpeg_decoder_t* jpeg)
+{
+  u8* p = jpeg->at + 2;
+  i32 scan_component_count = (jpeg->end - jpeg->at >= 3) ? p[0] : 0;
+  jpeg_component_t* scan_components[3] = {0};
+  jpeg->failed = (scan_component_count < 1 || scan_component_count > jpeg->component_count
+      || jpeg->end - p < 1 + 2 * scan_component_count + 3
+      || jpeg_read_u16(jpeg->at) > jpeg->end - jpeg->at);
+  for(i32 scan_idx = 0;
+      !jpeg->failed && scan_idx < scan_component_count;
+      ++scan_idx)
+  {
+    u8* spec = p + 1 + 2 * scan_idx;
+    for_count(component_idx, jpeg->component_count)
+    {
+      if(jpeg->components[component_idx].id == spec[0])
+      {
+        scan_components[scan_idx] = &jpeg->components[component_idx];
+      }
+    }
+    jpeg->failed = (!scan_components[scan_idx] || (spec[1] >> 4) > 3 || (spec[1] & 15) > 3);
+    if(!jpeg->failed)
+    {
+      scan_components[scan_idx]->dc_table = spec[1] >> 4;
+      scan_components[scan_idx]->ac_table = spec[1] & 15;
+      scan_components[scan_idx]->dc_prediction = 0;
+    }
+  }
+  if(jpeg->failed)
+  {
+    return;
+  }
+  jpeg->at += jpeg_read_u16(jpeg->at);
+  jpeg->bits = 0;
+  jpeg->bit_count = 0;
+
+  i32 n = jpeg->block_size;
+  i32 mcu_columns = (jpeg->w + 8 * jpeg->h_max - 1) / (8 * jpeg->h_max);
+  i32 mcu_rows = (jpeg->h + 8 * jpeg->v_max - 1) / (8 * jpeg->v_max);
+  if(scan_component_count == 1)
+  {
+    // Not interleaved, so the MCUs are single blocks that only cover the component's own size.
+    jpeg_component_t* component = scan_components[0];
+    i32 component_w = (jpeg->w * component->h + jpeg->h_max - 1) / jpeg->h_max;
+    i32 component_h = (jpeg->h * component->v + jpeg->v_max - 1) / jpeg->v_max;
+    mcu_columns = (component_w + 7) / 8;
+    mcu_rows = (component_h + 7) / 8;
+  }
+
+  i32 mcu_count = mcu_columns * mcu_rows;
+  for(i32 mcu_idx = 0;
+      !jpeg->failed && mcu_idx < mcu_count;
+      ++mcu_idx)
+  {
+    if(jpeg->restart_interval && mcu_idx > 0 && mcu_idx % jpeg->restart_interval == 0)
+    {
+      jpeg_restart(jpeg);
+    }
+
+    i32 mcu_x = mcu_idx % mcu_columns;
+    i32 mcu_y = mcu_idx / mcu_columns;
+    for(i32 scan_idx = 0;
+        !jpeg->failed && scan_idx < scan_component_count;
+        ++scan_idx)
+    {
+      jpeg_component_t* component = scan_components[scan_idx];
+      i32 block_columns = (scan_component_count == 1) ? 1 : component->h;
+      i32 block_rows = (scan_component_count == 1) ? 1 : component->v;
+      for(i32 block_y = 0; !jpeg->failed && block_y < block_rows; ++block_y)
+      {
+        for(i32 block_x = 0; !jpeg->failed && block_x < block_columns; ++block_x)
+        {
+          i32 x = (mcu_x * block_columns + block_x) * n;
+          i32 y = (mcu_y * block_rows + block_y) * n;
+          u8* out = component->plane + (i64)y * component->plane_w + x;
+          jpeg->failed = !jpeg_decode_block(jpeg, component, out, component->plane_w);
+        }
+      }
+    }
+  }
+}
+
+// Same rounding as the scalar version: Chroma is scaled up by 4 and multiplied by 2^14 times the factor,
+// keeping the upper 16 bits.
+internal void jpeg_ycbcr_to_rgba(u8* dst, u8* y, u8* cb, u8* cr, i32 pixel_count)
+{
+  i32 i = 0;
+#if defined(__SSE2__)
+  __m128i zero = _mm_setzero_si128();
+  __m128i bias = _mm_set1_epi16(128);
+  __m128i cr_to_r = _mm_set1_epi16(22970);   // 1.402
+  __m128i cb_to_g = _mm_set1_epi16(-5638);   // -0.344136
+  __m128i cr_to_g = _mm_set1_epi16(-11700);  // -0.714136
+  __m128i cb_to_b = _mm_set1_epi16(29032);   // 1.772
+  __m128i opaque = _mm_set1_epi8(-1);
+  for(; i + 8 <= pixel_count; i += 8)
+  {
+    __m128i y16 = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i*)(y + i)), zero);
+    __m128i cb16 = _mm_slli_epi16(_mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((__m128i*)(cb + i)), zero), bias), 2);
+    __m128i cr16 = _mm_slli_epi16(_mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((__m128i*)(cr + i)), zero), bias), 2);
+
+    __m128i r = _mm_add_epi16(y16, _mm_mulhi_epi16(cr16, cr_to_r));
+    __m128i g = _mm_add_epi16(y16, _mm_add_epi16(_mm_mulhi_epi16(cb16, cb_to_g), _mm_mulhi_epi16(cr16, cr_to_g)));
+    __m128i b = _mm_add_epi16(y16, _mm_mulhi_epi16(cb16, cb_to_b));
+
+    __m128i rg = _mm_unpacklo_epi8(_mm_packus_epi16(r, r), _mm_packus_epi16(g, g));
+    __m128i ba = _mm_unpacklo_epi8(_mm_packus_epi16(b, b), opaque);
+    _mm_storeu_si128((__m128i*)(dst + 4 * i), _mm_unpacklo_epi16(rg, ba));
+    _mm_storeu_si128((__m128i*)(dst + 4 * i + 16), _mm_unpackhi_epi16(rg, ba));
+  }
+#endif
+  for(; i < pixel_count; ++i)
+  {
+    i32 cb4 = 4 * (cb[i] - 128);
+    i32 cr4 = 4 * (cr[i] - 128);
+    dst[4*i + 0] = (u8)clamp(0, 255, y[i] + ((cr4 * 22970) >> 16));
+    dst[4*i + 1] = (u8)clamp(0, 255, y[i] + ((cb4 * -5638) >> 16) + ((cr4 * -11700) >> 16));
+    dst[4*i + 2] = (u8)clamp(0, 255, y[i] + ((cb4 * 29032) >> 16));
+    dst[4*i + 3] = 255;
+  }
+}
+
+internal i32 jpeg_scaled_size(i32 size, i32 scale_log2)
+{
+  return (size + (1 << scale_log2) - 1) >> scale_log2;
+}
+
+// Decodes the image, scaled down by 2^scale_log2 (up to 8), as RGBA into out, which gets rows of
+// 4*jpeg_scaled_size(w, scale_log2) bytes.
+internal b32 jpeg_decode(jpeg_decoder_t* jpeg, u8* out, i32 scale_log2)
+{
+  i32 n = 8 >> scale_log2;
+  jpeg->block_size = n;
+  for(i32 x = 0; x < n; ++x)
+  {
+    for(i32 u = 0; u < n; ++u)
+    {
+      // The low frequencies of the 8-point IDCT, averaged over the 8/n pixels that make up each output sample.
+      // That's the value at the center, times the average of the cosine's offsets from there.
+      r32 c = (u == 0) ? 0.70710678f : 1.0f;
+      r32 attenuation = 0;
+      for_count(pixel_idx, 8 / n)
+      {
+        attenuation += cosf((r32)((2 * (i32)pixel_idx + 1 - 8 / n) * u) * PI / 16.0f);
+      }
+      attenuation /= (r32)(8 / n);
+      jpeg->idct[x][u] = 0.5f * c * attenuation * cosf((r32)((2 * x + 1) * u) * PI / (r32)(2 * n));
+    }
+  }
+
+  i32 mcu_columns = (jpeg->w + 8 * jpeg->h_max - 1) / (8 * jpeg->h_max);
+  i32 mcu_rows = (jpeg->h + 8 * jpeg->v_max - 1) / (8 * jpeg->v_max);
+  for(i32 component_idx = 0;
+      !jpeg->failed && component_idx < jpeg->component_count;
+      ++component_idx)
+  {
+    jpeg_component_t* component = &jpeg->components[component_idx];
+    component->plane_w = mcu_columns * component->h * n;
+    component->plane_h = mcu_rows * component->v * n;
+    component->plane = malloc_array_zero((u64)component->plane_w * component->plane_h, u8);
+    jpeg->failed = !component->plane;
+  }
+
+  b32 seen_scan = false;
+  while(!jpeg->failed)
+  {
+    i32 marker = jpeg_next_marker(jpeg);
+    if(!marker || marker == 0xd9)
+    {
+      break;
+    }
+    else if(marker == 0xda)
+    {
+      jpeg_decode_scan(jpeg);
+      seen_scan = true;
+    }
+    else
+    {
+      jpeg_read_segment(jpeg, marker);
+    }
+  }
+
+  b32 result = (!jpeg->failed && seen_scan);
+  if(result)
+  {
+    i32 out_w = jpeg_scaled_size(jpeg->w, scale_log2);
+    i32 out_h = jpeg_scaled_size(jpeg->h, scale_log2);
+    u8* upsampled = malloc_array(3 * (u64)out_w, u8);
+    result = (upsampled != 0);
+    for(i32 y = 0;
+        result && y < out_h;
+        ++y)
+    {
+      // Chroma that's sampled more coarsely gets repeated.
+      u8* rows[3] = {0};
+      for_count(component_idx, jpeg->component_count)
+      {
+        jpeg_component_t* component = &jpeg->components[component_idx];
+        i32 h_step = jpeg->h_max / component->h;
+        u8* plane_row = component->plane + (i64)(y / (jpeg->v_max / component->v)) * component->plane_w;
+        rows[component_idx] = plane_row;
+        if(h_step > 1)
+        {
+          rows[component_idx] = upsampled + component_idx * out_w;
+          for(i32 x = 0; x < out_w; ++x) { rows[component_idx][x] = plane_row[x / h_step]; }
+        }
+      }
+
+      u8* out_row = out + 4 * (i64)y * out_w;
+      if(jpeg->component_count == 1)
+      {
+        for(i32 x = 0; x < out_w; ++x)
+        {
+          out_row[4*x + 0] = rows[0][x];
+          out_row[4*x + 1] = rows[0][x];
+          out_row[4*x + 2] = rows[0][x];
+          out_row[4*x + 3] = 255;
+        }
+      }
+      else if(jpeg->rgb)
+      {
+        for(i32 x = 0; x < out_w; ++x)
+        {
+          out_row[4*x + 0] = rows[0][x];
+          out_row[4*x + 1] = rows[1][x];
+          out_row[4*x + 2] = rows[2][x];
+          out_row[4*x + 3] = 255;
+        }
+      }
+      else
+      {
+        jpeg_ycbcr_to_rgba(out_row, rows[0], rows[1], rows[2], out_w);
+      }
+    }
+    free(upsampled);
+  }
+
+  return result;
+}
@@ -5,6 +5,7 @@
 
 #include <assert.h>
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <limits.h>
@@ -12,17 +13,34 @@
 #include <math.h>
 #include <poll.h>
 #include <pthread.h>
-#include <semaphore.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
 #include <sys/inotify.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Opening and reading files through io_uring needs kernel headers from Linux 5.7 or newer.
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#if defined(IORING_FEAT_FAST_POLL) && defined(__NR_io_uring_setup)
+#define HAS_IO_URING 1
+#endif
+#endif
+#endif
+
 // https://www.x.org/releases/current/doc/libX11/libX11/libX11.html
 #include <X11/Xlib.h>
 #include <X11/Xatom.h>
@@ -46,12 +64,43 @@
 #include "lib/stb_truetype.h"
 
 #include "util.h"
+#include "png.h"
+#include "jpeg.h"
 
 #define WINDOW_INIT_W 800
 #define WINDOW_INIT_H 600
 #define PROGRAM_NAME "i2x"
 
+// Longest side of the downscaled copies that get drawn in the thumbnail panel.
+#define THUMBNAIL_SIZE 256
+// The viewed image and this many neighbors after and before it get loaded in full resolution,
+// so flipping to them is instant.  Everything else only gets a thumbnail.
+#define FULL_RESOLUTION_NEIGHBOR_COUNT 2
+// Thumbnails that started loading are still finished if they're this close to the planned range.
+#define THUMBNAIL_PREFETCH_MARGIN 64
+// While scrolling, prefetching reaches as far as the viewport would move in this time.
+#define PREFETCH_LOOKAHEAD_SECS 2.0f
+// The I/O stage reads up to this many files per loader thread ahead of the decoding.
+#define READAHEAD_FILES_PER_LOADER 4
+// Images bigger than this on either side get split into tiles, with a pyramid of levels that are downscaled
+// by half each, so only the tiles in view at the current zoom go into VRAM.
+#define TILED_IMG_MIN_SIZE 4096
+#define TILE_SIZE 512
+#define MAX_TILE_LEVEL_COUNT 16
+// The viewed image gets shown row by row while it decodes, if it's at least this big.
+// Previews are box-filtered down by powers of two until they fit into PREVIEW_MAX_SIZE.
+#define PREVIEW_MIN_PIXEL_COUNT (2 * 1024 * 1024)
+#define PREVIEW_MAX_SIZE 2048
+// Thumbnails get drawn from slots in array textures with this many layers, which get created as they're needed.
+// Each slot holds THUMBNAIL_SIZE squared pixels and their mip levels.
+#define THUMBNAIL_ARRAY_LAYER_COUNT 64
+#define MAX_THUMBNAIL_ARRAY_COUNT 64
+// Thumbnails get averaged in linear light, and converted back with this many steps.
+#define LINEAR_TO_SRGB_TABLE_SIZE 4096
+
 static FILE* debug_out = 0;
+static r32 srgb_to_linear_table[256];
+static u8 linear_to_srgb_table[LINEAR_TO_SRGB_TABLE_SIZE];
 #if !RELEASE
 #define DEBUG_LOG(...) if(debug_out) { fprintf(debug_out, __VA_ARGS__); }
 #else
@@ -83,6 +132,21 @@ internal b32 is_directory(char* path)
   return result;
 }
 
+internal void create_parent_directories(char* path)
+{
+  for(i32 char_idx = 0;
+      path[char_idx] != 0;
+      ++char_idx)
+  {
+    if(path[char_idx] == '/')
+    {
+      path[char_idx] = 0;
+      mkdir(path, 0700);
+      path[char_idx] = '/';
+    }
+  }
+}
+
 enum
 {
   LOAD_STATE_UNLOADED = 0,
@@ -91,26 +155,107 @@ enum
 };
 typedef u32 load_state_t;
 
+typedef struct
+{
+  GLuint texture_id;
+  i64 bytes_used;
+  u64 last_drawn_frame;
+} img_tile_t;
+
+// Level 0 is the image itself, and the last level fits into a single tile.
+typedef struct
+{
+  i32 level_count;
+  i32 level_w[MAX_TILE_LEVEL_COUNT];
+  i32 level_h[MAX_TILE_LEVEL_COUNT];
+  u8* level_pixels[MAX_TILE_LEVEL_COUNT];  // The first one is the image's pixels, the others belong to this.
+  i32 channel_count;
+  i32 level_first_tile_idx[MAX_TILE_LEVEL_COUNT];
+  i32 tile_count;
+  img_tile_t* tiles;  // Only touched by the main thread.
+} tiled_img_t;
+
 typedef struct
 {
   i32 entry_idx;
 
   u32 load_generation;
+  b32 full_resolution;  // If false, only a thumbnail was requested.
+  b32 has_thumbnail;    // If false, another loader is taking care of the thumbnail.
 
   i32 w;
   i32 h;
   u8* pixels;
+  i32 channel_count;  // Of the pixels: 1 for gray, 2 for gray and alpha, 3 for RGB, 4 for RGBA.
+  tiled_img_t* tiled;
   i64 bytes_used;
+  b32 opaque;
+  b32 cancelled;  // The image went out of view while loading, so nothing got loaded.
 
-  volatile load_state_t load_state;
+  i32 thumbnail_w;
+  i32 thumbnail_h;
+  u8* thumbnail_pixels;
+  i64 thumbnail_bytes_used;
 } loaded_img_t;
 
+// Lower priority values get loaded first.
+typedef struct
+{
+  i32 img_idx;
+  i32 filtered_img_idx;
+  b32 full_resolution;
+  r32 priority;
+  u32 viewport_epoch;  // Of the viewport that the job was planned for.
+} load_job_t;
+
+// A claimed load on its way from the I/O stage to the decoders.
+typedef struct
+{
+  load_job_t job;
+  u64 path_hash;  // 0 if the thumbnail cache isn't used.
+  str_t file;     // The whole file, or empty if it couldn't be read.
+  loaded_img_t loaded_img;  // Might already have a thumbnail from the cache, then there's no file.
+} read_load_t;
+
+// The rings of an io_uring instance, mapped into memory.
+typedef struct
+{
+  int fd;
+  volatile u32* sq_tail;
+  u32 sq_mask;
+  u32* sq_array;
+  struct io_uring_sqe* sqes;
+  u32 unsubmitted_count;
+  volatile u32* cq_head;
+  volatile u32* cq_tail;
+  u32 cq_mask;
+  struct io_uring_cqe* cqes;
+} io_ring_t;
+
+#define COMPLETION_QUEUE_SIZE 1024
+
+typedef struct
+{
+  volatile u64 sequence;
+  loaded_img_t loaded_img;
+} completion_cell_t;
+
+typedef struct
+{
+  completion_cell_t cells[COMPLETION_QUEUE_SIZE];
+  u8 padding0[64];
+  volatile u64 enqueue_pos;
+  u8 padding1[64];
+  volatile u64 dequeue_pos;
+} completion_queue_t;
+
 enum
 {
   IMG_FLAG_UNUSED         = (1 << 0),  // Set if a file got deleted at a refresh.
   IMG_FLAG_FAILED_TO_LOAD = (1 << 1),
   IMG_FLAG_MARKED         = (1 << 2),
   IMG_FLAG_FILTERED       = (1 << 3),  // Only temporary, used during file refresh.
+  IMG_FLAG_OPAQUE         = (1 << 4),  // Every alpha value is 255, known once the image was loaded.
 };
 typedef u32 img_flags_t;
 
@@ -149,6 +294,8 @@ typedef struct img_entry_t
   u64 filesize;
 
   u32 metadata_generation;
+  b32 metadata_queued;  // These two are guarded by the metadata_mutex.
+  b32 metadata_busy;
   str_t annotation_path;
   str_t file_header_data;
   str_t parameter_strings[IMG_STR_COUNT];
@@ -158,6 +305,8 @@ typedef struct img_entry_t
   i32 w;
   i32 h;
   u8* pixels;
+  i32 channel_count;   // Of the pixels and the texture, 0 until the first full-resolution load.
+  tiled_img_t* tiled;  // Instead of texture_id, for big images.
   u32 load_generation;
   GLuint texture_id;
   i64 bytes_used;
@@ -171,33 +320,240 @@ typedef struct img_entry_t
   struct img_entry_t* lru_next;
 
   volatile load_state_t load_state;
+
+  i32 thumbnail_w;
+  i32 thumbnail_h;
+  u8* thumbnail_pixels;
+  GLuint thumbnail_texture_id;  // The array texture that thumbnail_slot is in, or a texture of its own if the slot is -1.
+  i32 thumbnail_slot;
+  i64 thumbnail_bytes_used;
+
+  struct img_entry_t* thumbnail_lru_prev;
+  struct img_entry_t* thumbnail_lru_next;
+
+  volatile load_state_t thumbnail_load_state;
 } img_entry_t;
 
 typedef struct
 {
-  i32 total_loader_count;
+  r32 x0;
+  r32 y0;
+  r32 x1;
+  r32 y1;
+  r32 u1;  // The thumbnail only covers part of its slot.
+  r32 v1;
+  i32 slot;
+  GLuint texture_id;  // For thumbnails that aren't in a slot.
+} thumbnail_quad_t;
+
+// Vertices are in window pixels, and the color is premultiplied.
+typedef struct
+{
+  r32 x;
+  r32 y;
+  r32 u;
+  r32 v;
+  r32 layer;  // For array textures.
+  u8 color[4];
+} render_vertex_t;
+
+// Quads for the whole frame go into one buffer, which gets drawn from whenever the texture, blending
+// or scissor changes.  If it fills up, it gets orphaned and starts over.  Their vertices are shared
+// between two triangles through a fixed index buffer, which 16-bit indices have to reach.
+#define RENDER_QUAD_CAPACITY 16384
+
+// The persistent caches are one file each, mapped into memory in its full size,
+// and shared by all running instances.  It starts with a header, followed by a hash table of slots,
+// followed by a ring buffer of records.  The file stays sparse until records get written.
+#define CACHE_FILE_PROBE_COUNT 8
+
+#define THUMBNAIL_CACHE_MAGIC 0x32435832  // "2XC2"
+#define THUMBNAIL_CACHE_SLOT_COUNT (256 * 1024)
+
+// Records are small, so this has room for a lot of them.
+#define METADATA_INDEX_MAGIC 0x4d585832  // "2XXM"
+#define METADATA_INDEX_SLOT_COUNT (512 * 1024)
+#define DEFAULT_METADATA_INDEX_MB 512
+// Goes up whenever the metadata parsing changes what it makes of the same file, so older records get parsed again.
+#define METADATA_PARSER_VERSION 3
+
+// Bigger text chunks don't get read, so broken sizes can't make the metadata loaders allocate a lot.
+#define PNG_METADATA_CHUNK_MAX_SIZE (64 * 1024 * 1024)
+
+typedef struct
+{
+  u32 magic;
+  u32 slot_count;
+  u64 data_capacity;
+  volatile u64 data_write_pos;  // Total bytes ever reserved; records are at (pos % data_capacity).
+} cache_file_header_t;
+
+typedef struct
+{
+  volatile u64 path_hash;
+  volatile u64 data_pos_plus_one;  // 0 for empty slots.
+} cache_file_slot_t;
+
+// Followed by the premultiplied RGBA thumbnail pixels.
+typedef struct
+{
+  u64 path_hash;
+  i64 modified_at_nsecs;
+  u64 filesize;
+  u32 record_size;
+  i32 w;
+  i32 h;
+  i32 thumbnail_w;
+  i32 thumbnail_h;
+  b32 opaque;
+} thumbnail_cache_record_t;
+
+// Followed by the bytes of the strings, where ones that lie within another,
+// like the prompts within the whole parameter text, are only stored once.
+typedef struct
+{
+  u64 path_hash;
+  i64 modified_at_nsecs;
+  u64 filesize;
+  u32 record_size;
+  u32 parser_version;
+  i32 w;
+  i32 h;
+  u32 string_offsets[IMG_STR_COUNT];
+  u32 string_sizes[IMG_STR_COUNT];
+  r32 parsed_r32s[PARSED_R32_COUNT];
+} metadata_index_record_t;
+
+typedef struct
+{
+  cache_file_header_t* header;
+  cache_file_slot_t* slots;
+  u8* data;
+  u64 mapped_size;
+} cache_file_t;
+
+// Decoded images mostly come in a handful of sizes, so their buffers get recycled here instead of going
+// back to malloc, which would unmap them and have fresh pages faulted in again for the next image.
+// There are four size classes per power of two, so at most a fifth of a buffer goes unused.
+#define PIXEL_POOL_MIN_CLASS_LOG2 16
+#define PIXEL_POOL_CLASS_COUNT 64
+#define PIXEL_POOL_HEADER_SIZE 64  // Keeps the pixels aligned for SIMD.
+#define PIXEL_POOL_FREE_BYTES_LIMIT (128 * 1024 * 1024)
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+// Textures uploaded per frame, beyond the first one, so a burst of finished loads gets spread over a few frames.
+#define UPLOAD_BYTES_PER_FRAME (8 * 1024 * 1024)
+#define DEFAULT_UPLOAD_ARENA_MB 256
+
+typedef struct pixel_buffer_header_t
+{
+  i32 class_idx;  // -1 for buffers that are too small or too big to be pooled.
+  b32 in_upload_arena;
+  struct pixel_buffer_header_t* next_free;
+} pixel_buffer_header_t;
+
+typedef struct
+{
+  pthread_mutex_t mutex;
+  pixel_buffer_header_t* free_buffers[PIXEL_POOL_CLASS_COUNT];
+  i64 free_bytes;
+  b32 use_huge_pages;
+
+  // When the driver can map a pixel buffer object persistently, pooled buffers get carved out of it,
+  // so textures can be uploaded from them without another copy.  These buffers are never given back.
+  u8* upload_arena;
+  u64 upload_arena_size;
+  u64 upload_arena_used;
+  pixel_buffer_header_t* free_arena_buffers[PIXEL_POOL_CLASS_COUNT];
+} pixel_pool_t;
+
+typedef struct
+{
+  GLsync fence;
+  u8* pixels;
+} pending_upload_t;
+
+// Rows of the viewed image as they come out of the decoder, so there's something to look at before it's done.
+// The loader that published the pixels frees them, after taking them out of here under the mutex.
+typedef struct
+{
+  pthread_mutex_t mutex;
+  i32 img_idx;  // -1 if there's nothing to show.
+  u32 load_generation;
+  i32 img_w;
+  i32 img_h;
+  i32 w;
+  i32 h;
+  i32 row_count;
+  u8* pixels;  // Premultiplied, like the textures.
+} preview_t;
 
+typedef struct
+{
   img_entry_t* img_entries;
 
+  cache_file_t thumbnail_cache;
+  pixel_pool_t pixel_pool;
+
   i32 filtered_img_count;
   i32* filtered_img_idxs;
 
-  volatile i64 total_bytes_used;
-  i64 total_bytes_limit;  // Not a strict limit.
+  // Decoded full-resolution pixels wait in RAM until they get uploaded, after that only the texture is kept.
+  volatile i64 ram_bytes_used;
+  i64 ram_bytes_limit;  // Not a strict limit.
+  volatile i64 vram_bytes_used;
+  i64 vram_bytes_limit;  // Not a strict limit either.
+  volatile i64 thumbnail_bytes_used;  // Thumbnails are also only kept as pixels or as a texture, not both.
+  i64 thumbnail_bytes_limit;  // Not a strict limit either.
+  i32 tiled_img_min_size;  // Smaller than TILED_IMG_MIN_SIZE if the GPU can't take textures that big.
+  i32 max_texture_size;  // 0 if unknown.
+  preview_t preview;
 
   volatile i32 viewing_filtered_img_idx;
   volatile i32 first_visible_thumbnail_idx;
   volatile i32 last_visible_thumbnail_idx;
-
-  volatile i64 next_loaded_img_id;
-  volatile i64 next_finalized_img_id;
-  loaded_img_t loaded_imgs[1024];
+  // In images per second, positive toward higher indices.
+  volatile r32 scroll_velocity;
+  volatile r32 flip_velocity;
+
+  // What the last load queue covered, in filtered indices, for deciding which started loads are still wanted.
+  // The thumbnail window can extend past both ends, and wraps around.
+  volatile i32 full_resolution_window_start_idx;
+  volatile i32 full_resolution_window_end_idx;
+  volatile i32 thumbnail_window_start_idx;
+  volatile i32 thumbnail_window_end_idx;
+  volatile u32 viewport_epoch;  // Goes up whenever the windows above change.
+
+  // Moving averages of how long loads take, written by the loaders.
+  volatile r32 full_resolution_load_secs;
+  volatile r32 thumbnail_load_secs;
+
+  // Filled by the main thread, which scans the wanted range whenever something changed.
+  pthread_mutex_t job_mutex;
+  pthread_cond_t job_cond;
+  load_job_t* jobs;  // Binary heap on priority.
+  i32 job_count;
+  i32 job_capacity;
+
+  // The I/O stage takes the jobs in order, claims them, and reads their files ahead into memory.
+  // The decoders take the read files from this ring, also protected by job_mutex.
+  pthread_cond_t read_cond;
+  read_load_t* reads;
+  i32 read_first_idx;
+  i32 read_count;
+  i32 readahead_used;  // Files that are being read, or waiting in the ring.
+  i32 readahead_limit;
+
+  // Without io_uring, the I/O threads wait on job_cond instead.
+  io_ring_t io_ring;
+  int io_wake_eventfd;  // -1 without io_uring.
+
+  completion_queue_t completions;
+  int completion_eventfd;  // Signaled after pushing completions, so the main thread wakes up for them.
 } shared_loader_data_t;
 
 typedef struct
 {
   i32 thread_idx;
-  sem_t* semaphore;
   shared_loader_data_t* shared;
 } loader_data_t;
 
@@ -250,6 +606,67 @@ typedef struct search_history_entry_t
   str_t str;
 } search_history_entry_t;
 
+// What drawing text needs of a glyph, taken from the font the first time the glyph comes up.
+typedef struct
+{
+  b32 known;
+  i32 x_advance;  // In font units, like the bearing.
+  i32 left_side_bearing;
+  i32 box_x0;  // The bitmap box in texels, with padding.
+  i32 box_y0;
+  i32 box_x1;
+  i32 box_y1;
+  i32 char_idx;  // The cell in the font texture, or -1.
+} glyph_info_t;
+
+#define CODEPOINT_NONE 0xffffffff
+
+typedef struct
+{
+  u32 codepoint;  // CODEPOINT_NONE if the slot is free.
+  i32 glyph;
+} codepoint_glyph_t;
+
+// Direct-mapped, so a pair that collides just takes over the entry.
+#define KERNING_CACHE_SIZE_LOG2 12
+#define KERNING_CACHE_SIZE (1 << KERNING_CACHE_SIZE_LOG2)
+
+typedef struct
+{
+  u32 glyph_pair;  // The first glyph in the upper half, or CODEPOINT_NONE if the entry is unused.
+  i32 advance;
+} kerning_entry_t;
+
+typedef struct
+{
+  i32 glyph;
+  i32 line_idx;
+  r32 x;  // The pen position, relative to the left edge of the text box.
+} laid_out_glyph_t;
+
+// Layouts are keyed by the address of the string, so only strings that stay put
+// until the metadata gets reloaded can go through the cache.
+#define TEXT_LAYOUT_CACHE_SET_COUNT_LOG2 6
+#define TEXT_LAYOUT_CACHE_WAY_COUNT 4
+#define TEXT_LAYOUT_CACHE_SIZE (TEXT_LAYOUT_CACHE_WAY_COUNT << TEXT_LAYOUT_CACHE_SET_COUNT_LOG2)
+
+typedef struct
+{
+  u8* str_data;
+  size_t str_size;
+  r32 fs;
+  b32 wrapped;
+  r32 wrap_width;
+  r32 start_x;  // Relative to the left edge of the text box, like the glyphs.
+  u64 last_used;  // 0 if the entry is unused.
+
+  laid_out_glyph_t* glyphs;
+  i32 glyph_count;
+  i32 glyph_capacity;
+  i32 line_count;
+  r32 end_x;
+} text_layout_t;
+
 typedef struct
 {
   i32 win_w;
@@ -287,10 +704,18 @@ typedef struct
   i32 font_char_h;
   u32 fixed_codepoint_range_start;
   u32 fixed_codepoint_range_length;
-  i32* custom_glyphs;
-  i32 custom_glyphs_first_char_idx;
+  i32* custom_glyphs;  // The glyph in each cell after the fixed ones, or -1.
+  u64* custom_glyph_last_used;  // For handing out the least recently used cell.
+  u64 glyph_use_count;
   i32 custom_glyph_count;
-  i32 next_custom_glyph_idx;
+  glyph_info_t* glyph_infos;  // For each glyph in the font.
+  codepoint_glyph_t* codepoint_glyphs;  // Open addressing, with a power of two size.
+  i32 codepoint_glyph_capacity;
+  i32 codepoint_glyph_count;
+  kerning_entry_t* kerning_cache;
+  text_layout_t text_layouts[TEXT_LAYOUT_CACHE_SIZE];
+  u64 text_layout_use_count;
+  u32 text_layout_metadata_reload_count;
 
   char** input_paths;
   i32 input_path_count;
@@ -337,7 +762,11 @@ typedef struct
   i32 sorted_idx_viewed_before_search;
   i64 selection_start;
   i64 selection_end;
-  i32 metadata_loaded_count;
+  i32 metadata_loaded_count;  // Counts from when the queue last ran empty, like metadata_queued_count.
+  i32 metadata_queued_count;
+  u32 metadata_reload_count;  // Bumped whenever parameter strings get replaced.
+  u32 handled_metadata_reload_count;  // What search, sort and layout have caught up with.
+  cache_file_t metadata_index;
   b32 all_metadata_loaded;
 
   FILE* search_history_file;
@@ -351,9 +780,21 @@ typedef struct
 #define MAX_THREAD_COUNT 16
   pthread_t loader_threads[MAX_THREAD_COUNT];
   loader_data_t loader_data[MAX_THREAD_COUNT];
-  sem_t loader_semaphores[MAX_THREAD_COUNT];
-  pthread_t metadata_loader_thread;
-  sem_t metadata_loader_semaphore;
+  i32 io_thread_count;
+  pthread_t io_threads[MAX_THREAD_COUNT];
+  loader_data_t io_data[MAX_THREAD_COUNT];
+  i32 metadata_loader_count;
+  pthread_t metadata_loader_threads[MAX_THREAD_COUNT];
+  pthread_mutex_t metadata_mutex;
+  pthread_cond_t metadata_cond;  // For newly queued images and new priorities.
+  i32* metadata_queue;  // Images whose load_generation changed, in the order of discovery.
+  i32 metadata_queue_count;
+  i32 metadata_queue_capacity;
+  i32 metadata_queue_idx;  // Where the claims continue after the prioritized images.
+#define METADATA_PRIORITY_CAPACITY 1024
+  i32 metadata_priority_img_idxs[METADATA_PRIORITY_CAPACITY];
+  i32 metadata_priority_count;
+  i32 metadata_priority_idx;
 
   int inotify_fd;
 
@@ -370,6 +811,57 @@ typedef struct
 
   img_entry_t* lru_first;
   img_entry_t* lru_last;
+  img_entry_t* thumbnail_lru_first;
+  img_entry_t* thumbnail_lru_last;
+
+  // The pixel pool's upload arena, if the driver supports mapping it persistently.
+  GLuint upload_arena_buffer;
+  b32 has_texture_swizzle;  // Otherwise gray images use the old luminance formats.
+  // Pixels in the arena that textures are still being uploaded from, to be given back once their fence is passed.
+  pending_upload_t* pending_uploads;
+  i32 pending_upload_count;
+  i32 pending_upload_capacity;
+  i64 uploaded_bytes_this_frame;
+  u64 frame_number;  // For telling which tiles went out of view.
+
+  // Everything gets drawn through the batch, see set_render_texture and push_render_quad.
+  GLuint render_program;  // If 0, the fixed-function pipeline takes the same vertex arrays instead.
+  GLuint render_buffer;
+  GLuint render_index_buffer;
+  render_vertex_t* render_vertices;  // Four per quad.
+  i32 render_quad_count;
+  i32 render_batch_start;  // The quads before it have been drawn.
+  GLenum render_target;
+  GLuint render_texture_id;
+  b32 render_blend;
+  i32 render_scissor[4];
+  u8 render_color[4];
+  r32 font_white_u;  // A white texel in the font texture, for untextured rectangles.
+  r32 font_white_v;
+
+  // Slot numbers count through the layers of one array after another.
+  // Without the program, every thumbnail gets a texture of its own instead.
+  GLuint thumbnail_program;  // Samples the thumbnail arrays, which fixed-function texturing can't.
+  GLuint thumbnail_arrays[MAX_THUMBNAIL_ARRAY_COUNT];
+  i32 thumbnail_array_used_slot_counts[MAX_THUMBNAIL_ARRAY_COUNT];
+  i32 thumbnail_array_count;
+  i32 free_thumbnail_slots[MAX_THUMBNAIL_ARRAY_COUNT * THUMBNAIL_ARRAY_LAYER_COUNT];
+  i32 free_thumbnail_slot_count;
+  // Collected while going through the thumbnail panel, to be drawn in one batch per array.
+  thumbnail_quad_t* thumbnail_quads;
+  i32 thumbnail_quad_count;
+  i32 thumbnail_quad_capacity;
+
+  // What of the shared preview made it into a texture, where row_count is the uploaded rows and the mutex is unused.
+  // It stays up after the loader is done, until the full image takes over.
+  GLuint preview_texture_id;
+  preview_t shown_preview;
+
+  // For estimating how fast the viewport moves.
+  u64 velocity_nsecs;
+  i32 velocity_first_visible_thumbnail_idx;
+  i32 velocity_viewing_filtered_img_idx;
+  i32 velocity_filtered_img_count;
 } state_t;
 
 internal void set_title(Display* display, Window window, u8* txt, i32 txt_len)
@@ -459,6 +951,26 @@ internal b32 advance_if_prefix_matches(u8** input, u8* input_end, char* prefix)
   return matches;
 }
 
+internal u8* find_json_quote_or_backslash(u8* ptr, u8* input_end)
+{
+#if defined(__SSE2__)
+  // Prompts make up most of the bytes, so skip over them 16 bytes at a time.
+  __m128i quotes = _mm_set1_epi8('"');
+  __m128i backslashes = _mm_set1_epi8('\\');
+  for(; ptr + 16 <= input_end; ptr += 16)
+  {
+    __m128i bytes = _mm_loadu_si128((__m128i*)ptr);
+    u32 mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(bytes, quotes), _mm_cmpeq_epi8(bytes, backslashes)));
+    if(mask)
+    {
+      return ptr + __builtin_ctz(mask);
+    }
+  }
+#endif
+  while(ptr < input_end && *ptr != '"' && *ptr != '\\') { ++ptr; }
+  return ptr;
+}
+
 internal str_t parse_next_json_str_destructively(u8** input, u8* input_end)
 {
   u8* in = *input;
@@ -470,7 +982,14 @@ internal str_t parse_next_json_str_destructively(u8** input, u8* input_end)
   u16 utf16_high_surrogate = 0;
   while(in < input_end && *in != '"')
   {
-    if(*in == '\\' && in + 1 < input_end)
+    if(*in != '\\')
+    {
+      u8* run_end = find_json_quote_or_backslash(in, input_end);
+      memmove(out, in, run_end - in);
+      out += run_end - in;
+      in = run_end;
+    }
+    else if(in + 1 < input_end)
     {
       ++in;
       if(0) {}
@@ -558,154 +1077,653 @@ internal str_t parse_next_json_str_destructively(u8** input, u8* input_end)
   return result;
 }
 
-internal b32 is_seeking_word_separator(u8 c)
+typedef enum
 {
-  return 0
-    || c == ' '
-    || c == '\n'
-    || c == ':'
-    || c == '/'
-    || c == '\\'
-    || c == '|'
-    ;
-}
+  JSON_TOKEN_NONE,  // At the end, or on malformed input.
+  JSON_TOKEN_OBJECT_START,
+  JSON_TOKEN_OBJECT_END,
+  JSON_TOKEN_ARRAY_START,
+  JSON_TOKEN_ARRAY_END,
+  JSON_TOKEN_STRING,  // Without the quotes, and still escaped.
+  JSON_TOKEN_PRIMITIVE,  // Numbers, true, false and null.
+} json_token_type_t;
 
-internal b32 is_linewrap_word_separator(u8 c)
+typedef struct
 {
-  return 0
-    || c == '-'
-    || c == ':'
-    || c == '/'
-    || c == '\\'
-    || c == '|'
-    ;
-}
+  json_token_type_t type;
+  str_t str;
+} json_token_t;
 
-internal i64 seek_left_in_str(str_t str, b32 word_wise, i64 start_idx)
+// Returns the closing quote, or input_end if there is none.
+internal u8* find_json_str_end(u8* ptr, u8* input_end)
 {
-  i64 result = start_idx;
-
-  while(word_wise && result > 0 && is_seeking_word_separator(str.data[result - 1]))
-  {
-    --result;
-  }
-  if(result > 0)
-  {
-    --result;
-  }
-  while(result > 0 &&
-      (is_utf8_continuation_byte(str.data[result]) ||
-       (word_wise && !is_seeking_word_separator(str.data[result - 1]))))
+  for(;;)
   {
-    --result;
+    ptr = find_json_quote_or_backslash(ptr, input_end);
+    if(ptr < input_end && *ptr == '\\' && input_end - ptr > 2)
+    {
+      ptr += 2;
+    }
+    else
+    {
+      break;
+    }
   }
 
-  return result;
+  return (ptr < input_end && *ptr == '"') ? ptr : input_end;
 }
 
-internal i64 seek_right_in_str(str_t str, b32 word_wise, i64 start_idx)
+// Colons and commas get skipped like whitespace, the callers know where keys and values go.
+internal json_token_t next_json_token(u8** input, u8* input_end)
 {
-  i64 result = start_idx;
+  json_token_t result = {0};
+  u8* ptr = *input;
 
-  while(word_wise && result < str.size && is_seeking_word_separator(str.data[result]))
-  {
-    ++result;
-  }
-  if(result < str.size)
-  {
-    ++result;
-  }
-  while(result < str.size &&
-      (is_utf8_continuation_byte(str.data[result]) ||
-       (word_wise && !is_seeking_word_separator(str.data[result]))))
+  while(ptr < input_end && (*ptr == ' ' || *ptr == '\n' || *ptr == '\r' || *ptr == '\t' || *ptr == ':' || *ptr == ','))
   {
-    ++result;
+    ++ptr;
   }
 
-  return result;
-}
-
-// Also replaces newlines by spaces.
-internal b32 str_replace_selection(i64 str_capacity, str_t* str,
-    i64* selection_start, i64* selection_end, str_t new_contents)
-{
-  b32 result = false;
-
-  i64 selection_min = min(*selection_start, *selection_end);
-  i64 selection_max = max(*selection_start, *selection_end);
-  i64 selection_length = selection_max - selection_min;
-  i64 str_length_change = new_contents.size - selection_length;
-
-  if(str_length_change < 0 || str->size + str_length_change <= str_capacity)
+  if(ptr < input_end)
   {
-    if(str_length_change > 0)
+    u8 c = *ptr;
+    if(0) {}
+    else if(c == '{') { result.type = JSON_TOKEN_OBJECT_START; ++ptr; }
+    else if(c == '}') { result.type = JSON_TOKEN_OBJECT_END; ++ptr; }
+    else if(c == '[') { result.type = JSON_TOKEN_ARRAY_START; ++ptr; }
+    else if(c == ']') { result.type = JSON_TOKEN_ARRAY_END; ++ptr; }
+    else if(c == '"')
     {
-      // Move bytes after the insertion to the right.
-      for(i64 move_idx = str->size + str_length_change - 1;
-          move_idx >= selection_max + str_length_change;
-          --move_idx)
+      u8* str_end = find_json_str_end(ptr + 1, input_end);
+      if(str_end < input_end)
       {
-        str->data[move_idx] = str->data[move_idx - str_length_change];
+        result.type = JSON_TOKEN_STRING;
+        result.str = str_from_span(ptr + 1, str_end);
+        ptr = str_end + 1;
+      }
+      else
+      {
+        ptr = input_end;
       }
     }
-
-    // Insert new bytes.
-    for(i64 new_idx = 0;
-        new_idx < new_contents.size;
-        ++new_idx)
-    {
-      u8 c = new_contents.data[new_idx];
-      if(c == '\n' || c == '\r') { c = ' '; }
-      str->data[selection_min + new_idx] = c;
-    }
-
-    if(str_length_change < 0)
+    else
     {
-      // Move bytes after the insertion to the left.
-      i64 length_reduction = -str_length_change;
-      for(i64 move_idx = selection_max - length_reduction;
-          move_idx < str->size - length_reduction;
-          ++move_idx)
+      u8* primitive_start = ptr;
+      while(ptr < input_end && *ptr != ',' && *ptr != ':' && *ptr != '}' && *ptr != ']' && *ptr != '"'
+          && *ptr != ' ' && *ptr != '\n' && *ptr != '\r' && *ptr != '\t')
       {
-        str->data[move_idx] = str->data[move_idx + length_reduction];
+        ++ptr;
+      }
+      if(ptr > primitive_start)
+      {
+        result.type = JSON_TOKEN_PRIMITIVE;
+        result.str = str_from_span(primitive_start, ptr);
+      }
+      else
+      {
+        ++ptr;
       }
     }
-
-    str->size += str_length_change;
-    *selection_end = selection_min + new_contents.size;
-    *selection_start = *selection_end;
-
-    result = true;
   }
 
+  *input = ptr;
   return result;
 }
 
-internal r64 parse_next_r64(u8** p, u8* end)
+// Consumes tokens until the given number of open objects and arrays got closed.
+internal void skip_json_containers(u8** input, u8* input_end, i32 depth)
 {
-  r64 result = 0;
-  b32 negative = false;
-
-  if(*p < end && **p == '-')
+  while(depth > 0)
   {
-    negative = true;
-    ++*p;
+    json_token_t token = next_json_token(input, input_end);
+    if(0) {}
+    else if(token.type == JSON_TOKEN_NONE) { break; }
+    else if(token.type == JSON_TOKEN_OBJECT_START || token.type == JSON_TOKEN_ARRAY_START) { ++depth; }
+    else if(token.type == JSON_TOKEN_OBJECT_END || token.type == JSON_TOKEN_ARRAY_END) { --depth; }
   }
+}
 
-  while(*p < end && **p >= '0' && **p <= '9')
+internal void skip_json_value(u8** input, u8* input_end, json_token_t first_token)
+{
+  if(first_token.type == JSON_TOKEN_OBJECT_START || first_token.type == JSON_TOKEN_ARRAY_START)
   {
-    result *= 10;
-    result += **p - '0';
-    ++*p;
+    skip_json_containers(input, input_end, 1);
   }
+}
 
-  if(*p < end && **p == '.')
-  {
-    ++*p;
+// comfyanonymous/ComfyUI prompts are a graph of nodes by id:
+//   {"3": {"inputs": {"seed": 5, "positive": ["6", 0], ...}, "class_type": "KSampler"}, "6": ...}
+// where inputs either hold a value or link to another node's output.
+#define COMFYUI_MAX_NODE_COUNT 512
+#define COMFYUI_MAX_INPUT_COUNT 4096
+#define COMFYUI_MAX_LINK_DEPTH 32
 
-    i64 divisor = 1;
+// Kept small, since there are thousands of them.
+typedef struct
+{
+  str_t name;
+  str_t value;  // For links, this is the id of the linked node.
+  i32 link_node_idx;
+  u8 type;  // The json_token_type_t of the value.
+  u8 is_link;
+  u8 decoded;
+} comfyui_input_t;
 
-    while(*p < end && **p >= '0' && **p <= '9')
+typedef struct
+{
+  str_t id;
+  i32 first_input_idx;
+  i32 input_count;
+  b32 is_linked_to;
+  b32 visited;
+} comfyui_node_t;
+
+// Too big for the stack of a metadata loader, so every loader allocates one up front.
+typedef struct
+{
+  comfyui_node_t nodes[COMFYUI_MAX_NODE_COUNT];
+  i32 node_count;
+  comfyui_input_t inputs[COMFYUI_MAX_INPUT_COUNT];
+  i32 input_count;
+} comfyui_graph_t;
+
+// Nodes and inputs past the capacity get skipped.
+internal void parse_comfyui_graph(comfyui_graph_t* graph, u8* json, u8* json_end)
+{
+  graph->node_count = 0;
+  graph->input_count = 0;
+
+  u8* p = json;
+  if(next_json_token(&p, json_end).type == JSON_TOKEN_OBJECT_START)
+  {
+    for(;;)
+    {
+      json_token_t id = next_json_token(&p, json_end);
+      if(id.type != JSON_TOKEN_STRING) { break; }
+
+      json_token_t node_value = next_json_token(&p, json_end);
+      if(node_value.type != JSON_TOKEN_OBJECT_START || graph->node_count >= COMFYUI_MAX_NODE_COUNT)
+      {
+        skip_json_value(&p, json_end, node_value);
+        continue;
+      }
+
+      comfyui_node_t* node = &graph->nodes[graph->node_count++];
+      zero_struct(*node);
+      node->id = id.str;
+      node->first_input_idx = graph->input_count;
+
+      for(;;)
+      {
+        json_token_t key = next_json_token(&p, json_end);
+        if(key.type != JSON_TOKEN_STRING) { break; }
+
+        json_token_t value = next_json_token(&p, json_end);
+        if(!str_eq_zstr(key.str, "inputs") || value.type != JSON_TOKEN_OBJECT_START)
+        {
+          skip_json_value(&p, json_end, value);
+          continue;
+        }
+
+        for(;;)
+        {
+          json_token_t input_name = next_json_token(&p, json_end);
+          if(input_name.type != JSON_TOKEN_STRING) { break; }
+
+          comfyui_input_t input = {0};
+          input.name = input_name.str;
+          json_token_t input_value = next_json_token(&p, json_end);
+          input.link_node_idx = -1;
+
+          if(input_value.type == JSON_TOKEN_ARRAY_START)
+          {
+            // Links look like ["6", 0], with the output index of node "6".
+            json_token_t link_id = next_json_token(&p, json_end);
+            json_token_t link_output = next_json_token(&p, json_end);
+            json_token_t link_end = next_json_token(&p, json_end);
+            if(link_id.type == JSON_TOKEN_STRING
+                && link_output.type == JSON_TOKEN_PRIMITIVE
+                && link_end.type == JSON_TOKEN_ARRAY_END)
+            {
+              input.is_link = true;
+              input_value = link_id;
+            }
+            else
+            {
+              i32 depth = 1;
+              json_token_t consumed[] = { link_id, link_output, link_end };
+              for(i32 i = 0;
+                  i < array_count(consumed) && depth > 0;
+                  ++i)
+              {
+                json_token_type_t type = consumed[i].type;
+                if(type == JSON_TOKEN_OBJECT_START || type == JSON_TOKEN_ARRAY_START) { ++depth; }
+                if(type == JSON_TOKEN_OBJECT_END || type == JSON_TOKEN_ARRAY_END) { --depth; }
+              }
+              skip_json_containers(&p, json_end, depth);
+              input_value.type = JSON_TOKEN_NONE;
+            }
+          }
+          else if(input_value.type == JSON_TOKEN_OBJECT_START)
+          {
+            skip_json_value(&p, json_end, input_value);
+            input_value.type = JSON_TOKEN_NONE;
+          }
+          input.value = input_value.str;
+          input.type = (u8)input_value.type;
+
+          if(input.type != JSON_TOKEN_NONE && graph->input_count < COMFYUI_MAX_INPUT_COUNT)
+          {
+            graph->inputs[graph->input_count++] = input;
+            ++node->input_count;
+          }
+        }
+      }
+    }
+  }
+
+  for_count(input_idx, graph->input_count)
+  {
+    comfyui_input_t* input = &graph->inputs[input_idx];
+    if(input->is_link)
+    {
+      for_count(node_idx, graph->node_count)
+      {
+        if(str_eq(graph->nodes[node_idx].id, input->value))
+        {
+          input->link_node_idx = node_idx;
+          graph->nodes[node_idx].is_linked_to = true;
+          break;
+        }
+      }
+    }
+  }
+}
+
+internal comfyui_input_t* get_comfyui_input(comfyui_graph_t* graph, i32 node_idx, char* name)
+{
+  comfyui_input_t* result = 0;
+  comfyui_node_t* node = &graph->nodes[node_idx];
+  for(i32 input_idx = node->first_input_idx;
+      input_idx < node->first_input_idx + node->input_count;
+      ++input_idx)
+  {
+    if(str_eq_zstr(graph->inputs[input_idx].name, name))
+    {
+      result = &graph->inputs[input_idx];
+      break;
+    }
+  }
+  return result;
+}
+
+// Looks for the first of the named inputs on the node, or else upstream through the link inputs.
+// The found input may be a link itself.
+internal comfyui_input_t* find_comfyui_input(comfyui_graph_t* graph, i32 node_idx,
+    char** names, char** link_names, i32 depth)
+{
+  comfyui_input_t* result = 0;
+
+  if(node_idx >= 0 && depth < COMFYUI_MAX_LINK_DEPTH)
+  {
+    for(char** name = names;
+        !result && *name;
+        ++name)
+    {
+      result = get_comfyui_input(graph, node_idx, *name);
+    }
+
+    for(char** link_name = link_names;
+        !result && link_name && *link_name;
+        ++link_name)
+    {
+      comfyui_input_t* link = get_comfyui_input(graph, node_idx, *link_name);
+      if(link && link->is_link)
+      {
+        result = find_comfyui_input(graph, link->link_node_idx, names, link_names, depth + 1);
+      }
+    }
+  }
+
+  return result;
+}
+
+// Like find_comfyui_input(), but follows a found link to the node providing the actual value.
+internal comfyui_input_t* find_comfyui_value(comfyui_graph_t* graph, i32 node_idx,
+    char** names, char** link_names)
+{
+  static char* generic_value_names[] = { "value", "string", "text", "int", "float", 0 };
+
+  comfyui_input_t* result = find_comfyui_input(graph, node_idx, names, link_names, 0);
+  for(i32 depth = 0;
+      result && result->is_link && depth < COMFYUI_MAX_LINK_DEPTH;
+      ++depth)
+  {
+    i32 linked_node_idx = result->link_node_idx;
+    result = find_comfyui_input(graph, linked_node_idx, names, 0, 0);
+    if(!result)
+    {
+      result = find_comfyui_input(graph, linked_node_idx, generic_value_names, 0, 0);
+    }
+  }
+
+  return (result && !result->is_link) ? result : 0;
+}
+
+// Decodes strings in place on first use, so the same input can be used for more than one field.
+internal str_t get_comfyui_str(comfyui_input_t* input)
+{
+  str_t result = {0};
+  if(input)
+  {
+    if(input->type == JSON_TOKEN_STRING && !input->decoded)
+    {
+      u8* quote = input->value.data - 1;
+      input->value = parse_next_json_str_destructively(&quote, input->value.data + input->value.size);
+      input->decoded = true;
+    }
+    result = input->value;
+  }
+  return result;
+}
+
+// The sampler is the node with a latent image input that's closest upstream from an output,
+// since other samplers, e.g. for upscaling, could come before it.
+internal i32 find_comfyui_sampler(comfyui_graph_t* graph)
+{
+  i32 result = -1;
+  i32 queue[COMFYUI_MAX_NODE_COUNT];
+  i32 queue_count = 0;
+
+  for_count(node_idx, graph->node_count)
+  {
+    graph->nodes[node_idx].visited = false;
+    if(!graph->nodes[node_idx].is_linked_to && get_comfyui_input(graph, node_idx, "images"))
+    {
+      graph->nodes[node_idx].visited = true;
+      queue[queue_count++] = node_idx;
+    }
+  }
+
+  for(i32 queue_idx = 0;
+      queue_idx < queue_count && result == -1;
+      ++queue_idx)
+  {
+    comfyui_node_t* node = &graph->nodes[queue[queue_idx]];
+    if(get_comfyui_input(graph, queue[queue_idx], "latent_image"))
+    {
+      result = queue[queue_idx];
+    }
+
+    for(i32 input_idx = node->first_input_idx;
+        input_idx < node->first_input_idx + node->input_count;
+        ++input_idx)
+    {
+      i32 linked_node_idx = graph->inputs[input_idx].link_node_idx;
+      if(linked_node_idx != -1 && !graph->nodes[linked_node_idx].visited)
+      {
+        graph->nodes[linked_node_idx].visited = true;
+        queue[queue_count++] = linked_node_idx;
+      }
+    }
+  }
+
+  for(i32 node_idx = 0;
+      node_idx < graph->node_count && result == -1;
+      ++node_idx)
+  {
+    if(get_comfyui_input(graph, node_idx, "latent_image"))
+    {
+      result = node_idx;
+    }
+  }
+
+  return result;
+}
+
+internal void parse_comfyui_prompt(img_entry_t* img, comfyui_graph_t* graph, u8* json, u8* json_end)
+{
+  parse_comfyui_graph(graph, json, json_end);
+
+  static char* seed_names[] = { "seed", "noise_seed", 0 };
+  static char* steps_names[] = { "steps", 0 };
+  static char* cfg_names[] = { "cfg", 0 };
+  static char* sampler_names[] = { "sampler_name", 0 };
+  static char* model_names[] = { "ckpt_name", "unet_name", 0 };
+  static char* batch_size_names[] = { "batch_size", 0 };
+  static char* text_names[] = { "text", 0 };
+  static char* positive_names[] = { "positive", 0 };
+  static char* negative_names[] = { "negative", 0 };
+  static char* conditioning_names[] = { "conditioning", 0 };
+
+  static char* noise_links[] = { "noise", 0 };
+  static char* sigmas_links[] = { "sigmas", 0 };
+  static char* guider_links[] = { "guider", 0 };
+  static char* sampler_links[] = { "sampler", 0 };
+  static char* model_links[] = { "model", "guider", 0 };
+  static char* latent_links[] = { "latent_image", "samples", 0 };
+  static char* conditioning_links[] = { "conditioning", "conditioning_to", "conditioning_1", 0 };
+
+  comfyui_input_t* seed = 0;
+  comfyui_input_t* steps = 0;
+  comfyui_input_t* cfg = 0;
+  comfyui_input_t* sampler = 0;
+  comfyui_input_t* model = 0;
+  comfyui_input_t* batch_size = 0;
+  comfyui_input_t* positive = 0;
+  comfyui_input_t* negative = 0;
+
+  i32 sampler_node_idx = find_comfyui_sampler(graph);
+  if(sampler_node_idx != -1)
+  {
+    seed = find_comfyui_value(graph, sampler_node_idx, seed_names, noise_links);
+    steps = find_comfyui_value(graph, sampler_node_idx, steps_names, sigmas_links);
+    cfg = find_comfyui_value(graph, sampler_node_idx, cfg_names, guider_links);
+    sampler = find_comfyui_value(graph, sampler_node_idx, sampler_names, sampler_links);
+    model = find_comfyui_value(graph, sampler_node_idx, model_names, model_links);
+    batch_size = find_comfyui_value(graph, sampler_node_idx, batch_size_names, latent_links);
+
+    comfyui_input_t* positive_link = find_comfyui_input(graph, sampler_node_idx, positive_names, guider_links, 0);
+    if(!positive_link)
+    {
+      // Guiders without CFG only take one conditioning.
+      positive_link = find_comfyui_input(graph, sampler_node_idx, conditioning_names, guider_links, 0);
+    }
+    comfyui_input_t* negative_link = find_comfyui_input(graph, sampler_node_idx, negative_names, guider_links, 0);
+
+    if(positive_link && positive_link->is_link)
+    {
+      positive = find_comfyui_value(graph, positive_link->link_node_idx, text_names, conditioning_links);
+    }
+    if(negative_link && negative_link->is_link)
+    {
+      negative = find_comfyui_value(graph, negative_link->link_node_idx, text_names, conditioning_links);
+    }
+  }
+  else
+  {
+    // Without a sampler, take the first of each, and the first two texts.
+    for_count(node_idx, graph->node_count)
+    {
+      if(!seed) { seed = find_comfyui_value(graph, node_idx, seed_names, 0); }
+      if(!steps) { steps = find_comfyui_value(graph, node_idx, steps_names, 0); }
+      if(!cfg) { cfg = find_comfyui_value(graph, node_idx, cfg_names, 0); }
+      if(!sampler) { sampler = find_comfyui_value(graph, node_idx, sampler_names, 0); }
+      if(!model) { model = find_comfyui_value(graph, node_idx, model_names, 0); }
+      if(!batch_size) { batch_size = find_comfyui_value(graph, node_idx, batch_size_names, 0); }
+
+      comfyui_input_t* text = find_comfyui_value(graph, node_idx, text_names, 0);
+      if(0) {}
+      else if(!positive) { positive = text; }
+      else if(!negative) { negative = text; }
+    }
+  }
+
+  if(seed) { img->parameter_strings[IMG_STR_SEED] = get_comfyui_str(seed); }
+  if(steps) { img->parameter_strings[IMG_STR_SAMPLING_STEPS] = get_comfyui_str(steps); }
+  if(cfg) { img->parameter_strings[IMG_STR_CFG] = get_comfyui_str(cfg); }
+  if(sampler) { img->parameter_strings[IMG_STR_SAMPLER] = get_comfyui_str(sampler); }
+  if(batch_size) { img->parameter_strings[IMG_STR_BATCH_SIZE] = get_comfyui_str(batch_size); }
+  if(positive) { img->parameter_strings[IMG_STR_POSITIVE_PROMPT] = get_comfyui_str(positive); }
+  if(negative) { img->parameter_strings[IMG_STR_NEGATIVE_PROMPT] = get_comfyui_str(negative); }
+  if(model)
+  {
+    str_t v = get_comfyui_str(model);
+    v = str_remove_suffix(v, str(".ckpt"));
+    v = str_remove_suffix(v, str(".safetensors"));
+    v = str_remove_suffix(v, str(".sft"));
+    img->parameter_strings[IMG_STR_MODEL] = v;
+  }
+}
+
+internal b32 is_seeking_word_separator(u8 c)
+{
+  return 0
+    || c == ' '
+    || c == '\n'
+    || c == ':'
+    || c == '/'
+    || c == '\\'
+    || c == '|'
+    ;
+}
+
+internal b32 is_linewrap_word_separator(u8 c)
+{
+  return 0
+    || c == '-'
+    || c == ':'
+    || c == '/'
+    || c == '\\'
+    || c == '|'
+    ;
+}
+
+internal i64 seek_left_in_str(str_t str, b32 word_wise, i64 start_idx)
+{
+  i64 result = start_idx;
+
+  while(word_wise && result > 0 && is_seeking_word_separator(str.data[result - 1]))
+  {
+    --result;
+  }
+  if(result > 0)
+  {
+    --result;
+  }
+  while(result > 0 &&
+      (is_utf8_continuation_byte(str.data[result]) ||
+       (word_wise && !is_seeking_word_separator(str.data[result - 1]))))
+  {
+    --result;
+  }
+
+  return result;
+}
+
+internal i64 seek_right_in_str(str_t str, b32 word_wise, i64 start_idx)
+{
+  i64 result = start_idx;
+
+  while(word_wise && result < str.size && is_seeking_word_separator(str.data[result]))
+  {
+    ++result;
+  }
+  if(result < str.size)
+  {
+    ++result;
+  }
+  while(result < str.size &&
+      (is_utf8_continuation_byte(str.data[result]) ||
+       (word_wise && !is_seeking_word_separator(str.data[result]))))
+  {
+    ++result;
+  }
+
+  return result;
+}
+
+// Also replaces newlines by spaces.
+internal b32 str_replace_selection(i64 str_capacity, str_t* str,
+    i64* selection_start, i64* selection_end, str_t new_contents)
+{
+  b32 result = false;
+
+  i64 selection_min = min(*selection_start, *selection_end);
+  i64 selection_max = max(*selection_start, *selection_end);
+  i64 selection_length = selection_max - selection_min;
+  i64 str_length_change = new_contents.size - selection_length;
+
+  if(str_length_change < 0 || str->size + str_length_change <= str_capacity)
+  {
+    if(str_length_change > 0)
+    {
+      // Move bytes after the insertion to the right.
+      for(i64 move_idx = str->size + str_length_change - 1;
+          move_idx >= selection_max + str_length_change;
+          --move_idx)
+      {
+        str->data[move_idx] = str->data[move_idx - str_length_change];
+      }
+    }
+
+    // Insert new bytes.
+    for(i64 new_idx = 0;
+        new_idx < new_contents.size;
+        ++new_idx)
+    {
+      u8 c = new_contents.data[new_idx];
+      if(c == '\n' || c == '\r') { c = ' '; }
+      str->data[selection_min + new_idx] = c;
+    }
+
+    if(str_length_change < 0)
+    {
+      // Move bytes after the insertion to the left.
+      i64 length_reduction = -str_length_change;
+      for(i64 move_idx = selection_max - length_reduction;
+          move_idx < str->size - length_reduction;
+          ++move_idx)
+      {
+        str->data[move_idx] = str->data[move_idx + length_reduction];
+      }
+    }
+
+    str->size += str_length_change;
+    *selection_end = selection_min + new_contents.size;
+    *selection_start = *selection_end;
+
+    result = true;
+  }
+
+  return result;
+}
+
+internal r64 parse_next_r64(u8** p, u8* end)
+{
+  r64 result = 0;
+  b32 negative = false;
+
+  if(*p < end && **p == '-')
+  {
+    negative = true;
+    ++*p;
+  }
+
+  while(*p < end && **p >= '0' && **p <= '9')
+  {
+    result *= 10;
+    result += **p - '0';
+    ++*p;
+  }
+
+  if(*p < end && **p == '.')
+  {
+    ++*p;
+
+    i64 divisor = 1;
+
+    while(*p < end && **p >= '0' && **p <= '9')
     {
       result *= 10;
       result += **p - '0';
@@ -713,721 +1731,3871 @@ internal r64 parse_next_r64(u8** p, u8* end)
       ++*p;
     }
 
-    result /= (r64)divisor;
+    result /= (r64)divisor;
+  }
+
+  if(negative)
+  {
+    result = -result;
+  }
+
+  return result;
+}
+
+internal r32 parse_r32(str_t str)
+{
+  u8* start = str.data;
+  u8* end = str.data + str.size;
+
+  return (r32)parse_next_r64(&start, end);
+}
+
+internal u64 get_pixel_class_capacity(i32 class_idx)
+{
+  return (u64)(4 + class_idx % 4) << (class_idx / 4 + PIXEL_POOL_MIN_CLASS_LOG2 - 2);
+}
+
+// Can be called from any thread, and the buffers can be freed on any other.
+internal u8* alloc_pixel_buffer(pixel_pool_t* pool, u64 size)
+{
+  i32 class_idx = -1;
+  if(size >= ((u64)1 << PIXEL_POOL_MIN_CLASS_LOG2))
+  {
+    i32 size_log2 = 63 - __builtin_clzll(size);
+    u64 step = ((u64)1 << size_log2) / 4;
+    class_idx = 4 * (size_log2 - PIXEL_POOL_MIN_CLASS_LOG2) + (i32)((size + step - 1) / step) - 4;
+    if(class_idx >= PIXEL_POOL_CLASS_COUNT)
+    {
+      class_idx = -1;
+    }
+  }
+
+  pixel_buffer_header_t* header = 0;
+  if(class_idx >= 0)
+  {
+    u64 arena_alloc_size = PIXEL_POOL_HEADER_SIZE + get_pixel_class_capacity(class_idx);
+    pthread_mutex_lock(&pool->mutex);
+    if(pool->free_arena_buffers[class_idx])
+    {
+      header = pool->free_arena_buffers[class_idx];
+      pool->free_arena_buffers[class_idx] = header->next_free;
+    }
+    else if(pool->upload_arena && pool->upload_arena_used + arena_alloc_size <= pool->upload_arena_size)
+    {
+      header = (pixel_buffer_header_t*)(pool->upload_arena + pool->upload_arena_used);
+      pool->upload_arena_used += arena_alloc_size;
+      header->class_idx = class_idx;
+      header->in_upload_arena = true;
+    }
+    else if(pool->free_buffers[class_idx])
+    {
+      header = pool->free_buffers[class_idx];
+      pool->free_buffers[class_idx] = header->next_free;
+      pool->free_bytes -= get_pixel_class_capacity(class_idx);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+  }
+
+  if(!header)
+  {
+    u64 alloc_size = PIXEL_POOL_HEADER_SIZE + ((class_idx >= 0) ? get_pixel_class_capacity(class_idx) : size);
+    if(pool->use_huge_pages && alloc_size >= HUGE_PAGE_SIZE)
+    {
+      void* memory = 0;
+      if(posix_memalign(&memory, HUGE_PAGE_SIZE, alloc_size) == 0)
+      {
+        header = (pixel_buffer_header_t*)memory;
+#if defined(MADV_HUGEPAGE)
+        // Only a hint, in case transparent huge pages are set to "madvise".
+        madvise(memory, alloc_size, MADV_HUGEPAGE);
+#endif
+      }
+    }
+    else
+    {
+      header = (pixel_buffer_header_t*)malloc(alloc_size);
+    }
+
+    if(header)
+    {
+      header->class_idx = class_idx;
+      header->in_upload_arena = false;
+    }
+  }
+
+  return header ? (u8*)header + PIXEL_POOL_HEADER_SIZE : 0;
+}
+
+// Returns the offset into the upload arena, or -1 if the buffer isn't in there.
+internal i64 get_upload_arena_offset(pixel_pool_t* pool, u8* pixels)
+{
+  pixel_buffer_header_t* header = (pixel_buffer_header_t*)(pixels - PIXEL_POOL_HEADER_SIZE);
+  return header->in_upload_arena ? pixels - pool->upload_arena : -1;
+}
+
+internal void free_pixel_buffer(pixel_pool_t* pool, u8* pixels)
+{
+  if(pixels)
+  {
+    pixel_buffer_header_t* header = (pixel_buffer_header_t*)(pixels - PIXEL_POOL_HEADER_SIZE);
+    b32 kept = false;
+    if(header->in_upload_arena)
+    {
+      pthread_mutex_lock(&pool->mutex);
+      header->next_free = pool->free_arena_buffers[header->class_idx];
+      pool->free_arena_buffers[header->class_idx] = header;
+      pthread_mutex_unlock(&pool->mutex);
+      kept = true;
+    }
+    else if(header->class_idx >= 0)
+    {
+      u64 capacity = get_pixel_class_capacity(header->class_idx);
+      pthread_mutex_lock(&pool->mutex);
+      if(pool->free_bytes + capacity <= PIXEL_POOL_FREE_BYTES_LIMIT)
+      {
+        header->next_free = pool->free_buffers[header->class_idx];
+        pool->free_buffers[header->class_idx] = header;
+        pool->free_bytes += capacity;
+        kept = true;
+      }
+      pthread_mutex_unlock(&pool->mutex);
+    }
+
+    if(!kept)
+    {
+      free(header);
+    }
+  }
+}
+
+internal void get_thumbnail_dimensions(i32 w, i32 h, i32* thumbnail_w, i32* thumbnail_h)
+{
+  *thumbnail_w = w;
+  *thumbnail_h = h;
+
+  if(w > THUMBNAIL_SIZE || h > THUMBNAIL_SIZE)
+  {
+    if(w >= h)
+    {
+      *thumbnail_w = THUMBNAIL_SIZE;
+      *thumbnail_h = max(1, (i32)(((i64)h * THUMBNAIL_SIZE + w / 2) / w));
+    }
+    else
+    {
+      *thumbnail_h = THUMBNAIL_SIZE;
+      *thumbnail_w = max(1, (i32)(((i64)w * THUMBNAIL_SIZE + h / 2) / h));
+    }
+  }
+}
+
+// The levels halve, rounding down, until both sides are 1.
+internal i32 get_mip_level_count(i32 w, i32 h)
+{
+  i32 result = 1;
+  while(w > 1 || h > 1)
+  {
+    w = max(1, w / 2);
+    h = max(1, h / 2);
+    ++result;
+  }
+  return result;
+}
+
+// Of RGBA pixels with all their mip levels following each other.
+internal i64 get_mip_chain_bytes(i32 w, i32 h)
+{
+  i64 result = 4 * (i64)w * (i64)h;
+  while(w > 1 || h > 1)
+  {
+    w = max(1, w / 2);
+    h = max(1, h / 2);
+    result += 4 * (i64)w * (i64)h;
+  }
+  return result;
+}
+
+// Drivers commonly pad RGB textures to four bytes per pixel, which the pixels in RAM aren't.
+internal i64 get_texture_bytes_used(i32 channel_count, i64 pixel_bytes)
+{
+  return (channel_count == 3) ? pixel_bytes / 3 * 4 : pixel_bytes;
+}
+
+// Every thumbnail takes up a whole slot on the GPU, no matter its size.
+internal i64 get_thumbnail_bytes_used()
+{
+  return get_mip_chain_bytes(THUMBNAIL_SIZE, THUMBNAIL_SIZE);
+}
+
+internal void init_srgb_tables()
+{
+  for_count(i, 256)
+  {
+    r32 x = (r32)i / 255.0f;
+    srgb_to_linear_table[i] = (x <= 0.04045f) ? x / 12.92f : powf((x + 0.055f) / 1.055f, 2.4f);
+  }
+
+  for_count(i, LINEAR_TO_SRGB_TABLE_SIZE)
+  {
+    r32 x = (r32)i / (r32)(LINEAR_TO_SRGB_TABLE_SIZE - 1);
+    r32 srgb = (x <= 0.0031308f) ? 12.92f * x : 1.055f * powf(x, 1.0f / 2.4f) - 0.055f;
+    linear_to_srgb_table[i] = (u8)(255.0f * srgb + 0.5f);
+  }
+}
+
+// Multiplies the color channels of RGBA pixels by their alpha, rounding exactly like round(x * a / 255).
+// Returns true if every pixel was opaque already, in which case nothing gets written.
+internal b32 premultiply_alpha(u64 pixel_count, u8* pixels)
+{
+  b32 opaque = true;
+  u64 pixel_idx = 0;
+
+#if defined(__SSE2__)
+  // Scan the alpha values first, most images with an alpha channel don't use it.
+  __m128i alpha_mask = _mm_set1_epi32((i32)0xff000000);
+  for(; opaque && pixel_idx + 16 <= pixel_count; pixel_idx += 16)
+  {
+    __m128i all = alpha_mask;
+    for_count(i, 4) { all = _mm_and_si128(all, _mm_loadu_si128((__m128i*)(pixels + 4 * pixel_idx) + i)); }
+    opaque = (_mm_movemask_epi8(_mm_cmpeq_epi8(all, alpha_mask)) == 0xffff);
+  }
+#endif
+  for(; opaque && pixel_idx < pixel_count; ++pixel_idx)
+  {
+    opaque = (pixels[4 * pixel_idx + 3] == 255);
+  }
+
+  if(!opaque)
+  {
+    pixel_idx = 0;
+
+#if defined(__SSE2__)
+    __m128i zero = _mm_setzero_si128();
+    __m128i half = _mm_set1_epi16(128);
+    for(; pixel_idx + 4 <= pixel_count; pixel_idx += 4)
+    {
+      __m128i* ptr = (__m128i*)(pixels + 4 * pixel_idx);
+      __m128i rgba = _mm_loadu_si128(ptr);
+      __m128i lo = _mm_unpacklo_epi8(rgba, zero);
+      __m128i hi = _mm_unpackhi_epi8(rgba, zero);
+      __m128i alpha_lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, 0xff), 0xff);
+      __m128i alpha_hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, 0xff), 0xff);
+
+      // x * a / 255, rounded: t = x * a + 128, then (t + (t >> 8)) >> 8.
+      __m128i t_lo = _mm_add_epi16(_mm_mullo_epi16(lo, alpha_lo), half);
+      __m128i t_hi = _mm_add_epi16(_mm_mullo_epi16(hi, alpha_hi), half);
+      t_lo = _mm_srli_epi16(_mm_add_epi16(t_lo, _mm_srli_epi16(t_lo, 8)), 8);
+      t_hi = _mm_srli_epi16(_mm_add_epi16(t_hi, _mm_srli_epi16(t_hi, 8)), 8);
+
+      __m128i premultiplied = _mm_packus_epi16(t_lo, t_hi);
+      _mm_storeu_si128(ptr, _mm_or_si128(_mm_andnot_si128(alpha_mask, premultiplied), _mm_and_si128(alpha_mask, rgba)));
+    }
+#endif
+    for(; pixel_idx < pixel_count; ++pixel_idx)
+    {
+      u32 a = pixels[4 * pixel_idx + 3];
+      for_count(i, 3)
+      {
+        u32 t = pixels[4 * pixel_idx + i] * a + 128;
+        pixels[4 * pixel_idx + i] = (u8)((t + (t >> 8)) >> 8);
+      }
+    }
+  }
+
+  return opaque;
+}
+
+internal b32 is_grayscale(u64 pixel_count, u8* pixels)
+{
+  b32 gray = true;
+  u64 pixel_idx = 0;
+
+#if defined(__SSE2__)
+  for(; gray && pixel_idx + 4 <= pixel_count; pixel_idx += 4)
+  {
+    // Compares red with green and green with blue, in the lowest two bytes of each pixel.
+    __m128i rgba = _mm_loadu_si128((__m128i*)(pixels + 4 * pixel_idx));
+    __m128i equal = _mm_cmpeq_epi8(rgba, _mm_srli_epi32(rgba, 8));
+    gray = ((_mm_movemask_epi8(equal) & 0x3333) == 0x3333);
+  }
+#endif
+  for(; gray && pixel_idx < pixel_count; ++pixel_idx)
+  {
+    u8* pixel = pixels + 4 * pixel_idx;
+    gray = (pixel[0] == pixel[1] && pixel[1] == pixel[2]);
+  }
+
+  return gray;
+}
+
+// Packs RGBA pixels into 1 (gray), 2 (gray and alpha) or 3 (RGB) channels.
+internal void pack_pixel_channels(u64 pixel_count, u8* src, u8* dst, i32 channel_count)
+{
+  for(u64 pixel_idx = 0;
+      pixel_idx < pixel_count;
+      ++pixel_idx)
+  {
+    u8* in = src + 4 * pixel_idx;
+    u8* out = dst + channel_count * pixel_idx;
+    out[0] = in[0];
+    if(channel_count == 2)
+    {
+      out[1] = in[3];
+    }
+    else if(channel_count == 3)
+    {
+      out[1] = in[1];
+      out[2] = in[2];
+    }
+  }
+}
+
+// Box-filters premultiplied RGBA pixels down to dst_w by dst_h, averaging in linear light so that fine
+// bright and dark detail doesn't come out darker than it looks.  The premultiplied colors get linearized
+// as they are, which is only exact for opaque pixels, but close enough for thumbnails.
+// Returns false if there wasn't enough memory.
+internal b32 box_filter_linear(u8* src, i32 src_w, i32 src_h, u8* dst, i32 dst_w, i32 dst_h)
+{
+  r32* sums = malloc_array(4 * dst_w, r32);
+  i32* x_starts = malloc_array(dst_w + 1, i32);
+  b32 result = (sums && x_starts);
+
+  if(result)
+  {
+    for(i32 dx = 0;
+        dx <= dst_w;
+        ++dx)
+    {
+      x_starts[dx] = (i32)(((i64)dx * src_w) / dst_w);
+    }
+
+    for(i32 dy = 0;
+        dy < dst_h;
+        ++dy)
+    {
+      i32 y0 = (i32)(((i64)dy * src_h) / dst_h);
+      i32 y1 = max(y0 + 1, (i32)(((i64)(dy + 1) * src_h) / dst_h));
+
+      zero_bytes(4 * dst_w * sizeof(r32), sums);
+
+      for(i32 y = y0;
+          y < y1;
+          ++y)
+      {
+        u8* row = src + 4 * (i64)y * src_w;
+        for(i32 dx = 0;
+            dx < dst_w;
+            ++dx)
+        {
+          r32* sum = sums + 4 * dx;
+          i32 x1 = max(x_starts[dx] + 1, x_starts[dx + 1]);
+          for(i32 x = x_starts[dx];
+              x < x1;
+              ++x)
+          {
+            sum[0] += srgb_to_linear_table[row[4 * x + 0]];
+            sum[1] += srgb_to_linear_table[row[4 * x + 1]];
+            sum[2] += srgb_to_linear_table[row[4 * x + 2]];
+            sum[3] += row[4 * x + 3];
+          }
+        }
+      }
+
+      u8* out = dst + 4 * (i64)dy * dst_w;
+      for(i32 dx = 0;
+          dx < dst_w;
+          ++dx)
+      {
+        r32 count = (r32)(y1 - y0) * (r32)max(1, x_starts[dx + 1] - x_starts[dx]);
+        r32 table_scale = (r32)(LINEAR_TO_SRGB_TABLE_SIZE - 1) / count;
+        for_count(c, 3)
+        {
+          i32 table_idx = (i32)(sums[4 * dx + c] * table_scale + 0.5f);
+          out[4 * dx + c] = linear_to_srgb_table[min(table_idx, LINEAR_TO_SRGB_TABLE_SIZE - 1)];
+        }
+        out[4 * dx + 3] = (u8)min(255.0f, sums[4 * dx + 3] / count + 0.5f);
+      }
+    }
+  }
+
+  free(sums);
+  free(x_starts);
+  return result;
+}
+
+// Fills in the smaller mip levels after the w by h RGBA pixels, which need room for get_mip_chain_bytes.
+// Falls back to the unfiltered corner pixels if there wasn't enough memory.
+internal void make_mips(u8* pixels, i32 w, i32 h)
+{
+  u8* level_pixels = pixels;
+  i32 level_w = w;
+  i32 level_h = h;
+  while(level_w > 1 || level_h > 1)
+  {
+    i32 next_w = max(1, level_w / 2);
+    i32 next_h = max(1, level_h / 2);
+    u8* next_pixels = level_pixels + 4 * (i64)level_w * level_h;
+    if(!box_filter_linear(level_pixels, level_w, level_h, next_pixels, next_w, next_h))
+    {
+      for(i32 y = 0;
+          y < next_h;
+          ++y)
+      {
+        memcpy(next_pixels + 4 * (i64)y * next_w, level_pixels + 4 * (i64)y * level_w, 4 * next_w);
+      }
+    }
+    level_pixels = next_pixels;
+    level_w = next_w;
+    level_h = next_h;
+  }
+}
+
+// Box-filters premultiplied RGBA pixels down to at most THUMBNAIL_SIZE on the longest side.
+// The pixels may be a scaled-down decode of an img_w by img_h image, which is what the thumbnail size goes by.
+// The buffer has room for the mip levels, which make_mips fills in.
+internal u8* make_thumbnail(pixel_pool_t* pool, i32 w, i32 h, u8* pixels, i32 img_w, i32 img_h,
+    i32* thumbnail_w_ptr, i32* thumbnail_h_ptr)
+{
+  i32 thumbnail_w = 0;
+  i32 thumbnail_h = 0;
+  get_thumbnail_dimensions(img_w, img_h, &thumbnail_w, &thumbnail_h);
+
+  u8* result = alloc_pixel_buffer(pool, get_mip_chain_bytes(thumbnail_w, thumbnail_h));
+  if(!result || !box_filter_linear(pixels, w, h, result, thumbnail_w, thumbnail_h))
+  {
+    free_pixel_buffer(pool, result);
+    result = 0;
+    thumbnail_w = 0;
+    thumbnail_h = 0;
+  }
+
+  *thumbnail_w_ptr = thumbnail_w;
+  *thumbnail_h_ptr = thumbnail_h;
+  return result;
+}
+
+// Box-filters down to half the size, rounding up, with the last row and column repeated for odd sizes.
+internal void downsample_by_half(u8* src, i32 src_w, i32 src_h, u8* dst, i32 dst_w, i32 dst_h, i32 channel_count)
+{
+  for(i32 y = 0;
+      y < dst_h;
+      ++y)
+  {
+    u8* row0 = src + channel_count * (i64)min(2 * y, src_h - 1) * src_w;
+    u8* row1 = src + channel_count * (i64)min(2 * y + 1, src_h - 1) * src_w;
+    u8* out = dst + channel_count * (i64)y * dst_w;
+    for(i32 x = 0;
+        x < dst_w;
+        ++x)
+    {
+      i32 x0 = channel_count * min(2 * x, src_w - 1);
+      i32 x1 = channel_count * min(2 * x + 1, src_w - 1);
+      for_count(c, channel_count)
+      {
+        out[channel_count * x + c] = (u8)((row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] + 2) >> 2);
+      }
+    }
+  }
+}
+
+// Returns 0 if there wasn't enough memory.
+internal tiled_img_t* make_tiled_img(pixel_pool_t* pool, i32 w, i32 h, i32 channel_count, u8* pixels, i64* bytes_used)
+{
+  tiled_img_t* result = malloc_struct(tiled_img_t);
+  b32 failed = !result;
+  if(result)
+  {
+    zero_struct(*result);
+    result->level_w[0] = w;
+    result->level_h[0] = h;
+    result->level_pixels[0] = pixels;
+    result->level_count = 1;
+    result->channel_count = channel_count;
+    while(!failed && max(result->level_w[result->level_count - 1], result->level_h[result->level_count - 1]) > TILE_SIZE
+        && result->level_count < MAX_TILE_LEVEL_COUNT)
+    {
+      i32 level = result->level_count;
+      i32 src_w = result->level_w[level - 1];
+      i32 src_h = result->level_h[level - 1];
+      i32 dst_w = (src_w + 1) / 2;
+      i32 dst_h = (src_h + 1) / 2;
+      u8* dst = alloc_pixel_buffer(pool, channel_count * (u64)dst_w * dst_h);
+      if(dst)
+      {
+        downsample_by_half(result->level_pixels[level - 1], src_w, src_h, dst, dst_w, dst_h, channel_count);
+        result->level_w[level] = dst_w;
+        result->level_h[level] = dst_h;
+        result->level_pixels[level] = dst;
+        *bytes_used += channel_count * (i64)dst_w * dst_h;
+        ++result->level_count;
+      }
+      else
+      {
+        failed = true;
+      }
+    }
+
+    for(i32 level = 0;
+        level < result->level_count;
+        ++level)
+    {
+      result->level_first_tile_idx[level] = result->tile_count;
+      result->tile_count += (((result->level_w[level] + TILE_SIZE - 1) / TILE_SIZE)
+          * ((result->level_h[level] + TILE_SIZE - 1) / TILE_SIZE));
+    }
+    result->tiles = malloc_array_zero(result->tile_count, img_tile_t);
+    failed |= !result->tiles;
+  }
+
+  if(failed && result)
+  {
+    for(i32 level = 1;
+        level < result->level_count;
+        ++level)
+    {
+      free_pixel_buffer(pool, result->level_pixels[level]);
+      *bytes_used -= channel_count * (i64)result->level_w[level] * result->level_h[level];
+    }
+    free(result->tiles);
+    free(result);
+    result = 0;
+  }
+
+  return result;
+}
+
+internal u64 hash_path_for_cache(char* path)
+{
+  char resolved_path[PATH_MAX];
+  if(realpath(path, resolved_path))
+  {
+    path = resolved_path;
+  }
+
+  // FNV-1a.
+  u64 result = 0xcbf29ce484222325ULL;
+  for(u8* c = (u8*)path; *c; ++c)
+  {
+    result ^= *c;
+    result *= 0x100000001b3ULL;
+  }
+  return result;
+}
+
+internal i64 timespec_to_nsecs(struct timespec t)
+{
+  return (i64)t.tv_sec * 1000000000LL + (i64)t.tv_nsec;
+}
+
+internal void open_cache_file(cache_file_t* cache, char* description, char* path,
+    u32 magic, u32 slot_count, u64 data_capacity)
+{
+  u64 header_size = 4096;  // Keeps the slots page-aligned.
+  u64 slots_size = slot_count * sizeof(cache_file_slot_t);
+  u64 mapped_size = header_size + slots_size + data_capacity;
+
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if(fd == -1)
+  {
+    fprintf(stderr, "%s file \"%s\" could not be opened.\n", description, path);
+  }
+  else
+  {
+    // Other instances might be initializing the same file right now.
+    flock(fd, LOCK_EX);
+
+    b32 valid = false;
+    struct stat stats = {0};
+    if(fstat(fd, &stats) == 0 && stats.st_size == mapped_size)
+    {
+      cache_file_header_t header = {0};
+      valid = (pread(fd, &header, sizeof(header), 0) == sizeof(header)
+          && header.magic == magic
+          && header.slot_count == slot_count
+          && header.data_capacity == data_capacity);
+    }
+
+    if(!valid)
+    {
+      // Truncating to zero first makes sure the file is sparse and all slots are empty.
+      cache_file_header_t header = {0};
+      header.magic = magic;
+      header.slot_count = slot_count;
+      header.data_capacity = data_capacity;
+      valid = (ftruncate(fd, 0) == 0
+          && ftruncate(fd, mapped_size) == 0
+          && pwrite(fd, &header, sizeof(header), 0) == sizeof(header));
+    }
+
+    if(valid)
+    {
+      u8* base = (u8*)mmap(0, mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if(base != MAP_FAILED)
+      {
+        cache->header = (cache_file_header_t*)base;
+        cache->slots = (cache_file_slot_t*)(base + header_size);
+        cache->data = base + header_size + slots_size;
+        cache->mapped_size = mapped_size;
+      }
+    }
+
+    if(!cache->header)
+    {
+      fprintf(stderr, "%s file \"%s\" could not be mapped.\n", description, path);
+    }
+
+    flock(fd, LOCK_UN);
+    close(fd);
+  }
+}
+
+// Records count as overwritten as soon as a writer has reserved their space again.
+internal b32 is_cache_file_record_intact(cache_file_t* cache, u64 data_pos)
+{
+  return cache->header->data_write_pos <= data_pos + cache->header->data_capacity;
+}
+
+// Returns the record stored for the path hash, which still has to be checked for
+// being what the caller expects, or 0.  The record may only be used while it's intact.
+internal u8* find_cache_file_record(cache_file_t* cache, u64 path_hash, u64 min_record_size, u64* data_pos)
+{
+  u8* result = 0;
+
+  if(cache->header)
+  {
+    u64 capacity = cache->header->data_capacity;
+    u32 slot_count = cache->header->slot_count;
+
+    for_count(probe_idx, CACHE_FILE_PROBE_COUNT)
+    {
+      cache_file_slot_t* slot = &cache->slots[(path_hash + probe_idx) % slot_count];
+      u64 data_pos_plus_one = slot->data_pos_plus_one;
+
+      if(data_pos_plus_one && slot->path_hash == path_hash)
+      {
+        *data_pos = data_pos_plus_one - 1;
+        u64 offset = *data_pos % capacity;
+
+        if(is_cache_file_record_intact(cache, *data_pos)
+            && offset + min_record_size <= capacity)
+        {
+          result = cache->data + offset;
+        }
+
+        // Storing always reuses the slot with the same path hash, so there's nothing further along.
+        break;
+      }
+    }
+  }
+
+  return result;
+}
+
+// Reserves the space for a record, which becomes findable with publish_cache_file_record.
+internal u8* reserve_cache_file_record(cache_file_t* cache, u64 record_size, u64* data_pos)
+{
+  u8* result = 0;
+  u64 reserved_size = (record_size + 63) & ~63ULL;
+
+  if(cache->header && reserved_size <= cache->header->data_capacity)
+  {
+    u64 capacity = cache->header->data_capacity;
+    u64 offset = 0;
+
+    // Records don't wrap around the end of the ring buffer; the remainder there just gets skipped.
+    do
+    {
+      *data_pos = __sync_fetch_and_add(&cache->header->data_write_pos, reserved_size);
+      offset = *data_pos % capacity;
+    } while(offset + reserved_size > capacity);
+
+    result = cache->data + offset;
+  }
+
+  return result;
+}
+
+internal void publish_cache_file_record(cache_file_t* cache, u64 path_hash, u64 data_pos)
+{
+  u32 slot_count = cache->header->slot_count;
+
+  // Replace the slot of an older version of this file, or an empty one, or the oldest one.
+  cache_file_slot_t* target_slot = 0;
+  for_count(probe_idx, CACHE_FILE_PROBE_COUNT)
+  {
+    cache_file_slot_t* slot = &cache->slots[(path_hash + probe_idx) % slot_count];
+    if(slot->path_hash == path_hash || !slot->data_pos_plus_one)
+    {
+      target_slot = slot;
+      break;
+    }
+    if(!target_slot || slot->data_pos_plus_one < target_slot->data_pos_plus_one)
+    {
+      target_slot = slot;
+    }
+  }
+
+  target_slot->data_pos_plus_one = 0;
+  __sync_synchronize();
+  target_slot->path_hash = path_hash;
+  __sync_synchronize();
+  target_slot->data_pos_plus_one = data_pos + 1;
+}
+
+// Returns a copy of the thumbnail pixels from the pool, or 0 if nothing valid is cached.
+internal u8* lookup_cached_thumbnail(cache_file_t* cache, pixel_pool_t* pool,
+    u64 path_hash, i64 modified_at_nsecs, u64 filesize,
+    i32* w, i32* h, i32* thumbnail_w, i32* thumbnail_h, b32* opaque)
+{
+  u8* result = 0;
+  u64 data_pos = 0;
+  u8* record_ptr = find_cache_file_record(cache, path_hash, sizeof(thumbnail_cache_record_t), &data_pos);
+
+  if(record_ptr)
+  {
+    thumbnail_cache_record_t record = *(thumbnail_cache_record_t*)record_ptr;
+    u64 pixel_bytes = 4 * (u64)record.thumbnail_w * (u64)record.thumbnail_h;
+
+    if(record.path_hash == path_hash
+        && record.modified_at_nsecs == modified_at_nsecs
+        && record.filesize == filesize
+        && record.thumbnail_w > 0 && record.thumbnail_w <= THUMBNAIL_SIZE
+        && record.thumbnail_h > 0 && record.thumbnail_h <= THUMBNAIL_SIZE
+        && record.record_size == sizeof(record) + pixel_bytes
+        && (record_ptr - cache->data) + record.record_size <= cache->header->data_capacity)
+    {
+      // Only the first mip level is stored.
+      result = alloc_pixel_buffer(pool, get_mip_chain_bytes(record.thumbnail_w, record.thumbnail_h));
+      if(result)
+      {
+        memcpy(result, record_ptr + sizeof(record), pixel_bytes);
+
+        __sync_synchronize();
+        if(is_cache_file_record_intact(cache, data_pos))
+        {
+          *w = record.w;
+          *h = record.h;
+          *thumbnail_w = record.thumbnail_w;
+          *thumbnail_h = record.thumbnail_h;
+          *opaque = record.opaque;
+        }
+        else
+        {
+          // Got overwritten while copying.
+          free_pixel_buffer(pool, result);
+          result = 0;
+        }
+      }
+    }
+  }
+
+  return result;
+}
+
+internal void store_cached_thumbnail(cache_file_t* cache, u64 path_hash, i64 modified_at_nsecs, u64 filesize,
+    i32 w, i32 h, i32 thumbnail_w, i32 thumbnail_h, b32 opaque, u8* pixels)
+{
+  u64 pixel_bytes = 4 * (u64)thumbnail_w * (u64)thumbnail_h;
+  u64 record_size = sizeof(thumbnail_cache_record_t) + pixel_bytes;
+  u64 data_pos = 0;
+  thumbnail_cache_record_t* record = (thumbnail_cache_record_t*)reserve_cache_file_record(cache, record_size, &data_pos);
+
+  if(record)
+  {
+    record->path_hash = path_hash;
+    record->modified_at_nsecs = modified_at_nsecs;
+    record->filesize = filesize;
+    record->record_size = (u32)record_size;
+    record->w = w;
+    record->h = h;
+    record->thumbnail_w = thumbnail_w;
+    record->thumbnail_h = thumbnail_h;
+    record->opaque = opaque;
+    memcpy((u8*)record + sizeof(*record), pixels, pixel_bytes);
+
+    publish_cache_file_record(cache, path_hash, data_pos);
+  }
+}
+
+// Decides whether a started load is still worth finishing.
+typedef struct
+{
+  shared_loader_data_t* shared;
+  i32 img_idx;
+  i32 filtered_img_idx;
+  u32 load_generation;
+  b32 full_resolution;
+  u32 checked_viewport_epoch;
+  b32 cancelled;
+} load_request_t;
+
+// Cheap enough to call between row batches, since the wanted range only gets looked at after the viewport moved.
+internal b32 is_load_cancelled(load_request_t* request)
+{
+  shared_loader_data_t* shared = request->shared;
+  u32 viewport_epoch = shared->viewport_epoch;
+
+  if(!request->cancelled && viewport_epoch != request->checked_viewport_epoch)
+  {
+    request->checked_viewport_epoch = viewport_epoch;
+    __sync_synchronize();
+
+    i32 filtered_img_count = shared->filtered_img_count;
+    if(request->filtered_img_idx >= filtered_img_count
+        || shared->filtered_img_idxs[request->filtered_img_idx] != request->img_idx)
+    {
+      // The filter or the sort order changed, so look for where the image went.
+      request->filtered_img_idx = -1;
+      for(i32 filtered_idx = 0; filtered_idx < filtered_img_count; ++filtered_idx)
+      {
+        if(shared->filtered_img_idxs[filtered_idx] == request->img_idx)
+        {
+          request->filtered_img_idx = filtered_idx;
+          break;
+        }
+      }
+    }
+
+    if(request->filtered_img_idx < 0)
+    {
+      request->cancelled = true;
+    }
+    else if(request->full_resolution)
+    {
+      request->cancelled = (request->filtered_img_idx < shared->full_resolution_window_start_idx
+          || request->filtered_img_idx > shared->full_resolution_window_end_idx);
+    }
+    else
+    {
+      // Same as the range that update_load_queue planned, with some leeway.
+      i32 wanted_start_idx = shared->thumbnail_window_start_idx - THUMBNAIL_PREFETCH_MARGIN;
+      i32 wanted_count = (shared->thumbnail_window_end_idx - shared->thumbnail_window_start_idx + 1
+          + 2 * THUMBNAIL_PREFETCH_MARGIN);
+      request->cancelled = (wanted_count < filtered_img_count
+          && i32_wrap_upto(request->filtered_img_idx - wanted_start_idx, filtered_img_count) >= wanted_count);
+    }
+  }
+
+  return request->cancelled;
+}
+
+typedef struct
+{
+  u8* at;
+  u8* end;
+  load_request_t* request;
+} stbi_reader_t;
+
+// stb_image reads through these, so a cancelled load looks like the end of the file to it.
+internal int stbi_read_callback(void* user, char* data, int size)
+{
+  stbi_reader_t* reader = (stbi_reader_t*)user;
+  int result = 0;
+  if(!is_load_cancelled(reader->request))
+  {
+    result = (int)min((i64)size, reader->end - reader->at);
+    memcpy(data, reader->at, result);
+    reader->at += result;
+  }
+  return result;
+}
+
+internal void stbi_skip_callback(void* user, int n)
+{
+  stbi_reader_t* reader = (stbi_reader_t*)user;
+  reader->at += min((i64)n, reader->end - reader->at);
+}
+
+internal int stbi_eof_callback(void* user)
+{
+  stbi_reader_t* reader = (stbi_reader_t*)user;
+  return reader->at >= reader->end || reader->request->cancelled;
+}
+
+// What a loader needs for filling in the shared preview.
+typedef struct
+{
+  preview_t* preview;
+  u8* pixels;
+  i32 w;
+  i32 h;
+  i32 scale_log2;
+  i32 row_count;
+  u32* sums;
+  b32 premultiply;
+} preview_writer_t;
+
+// Only for full-resolution loads of the viewed image; returns false for everything else.
+internal b32 begin_preview(preview_writer_t* writer, load_request_t* request, i32 img_w, i32 img_h, b32 premultiply)
+{
+  shared_loader_data_t* shared = request->shared;
+  zero_struct(*writer);
+  if(request->full_resolution && request->filtered_img_idx == shared->viewing_filtered_img_idx
+      && (i64)img_w * img_h >= PREVIEW_MIN_PIXEL_COUNT)
+  {
+    while(max(img_w, img_h) > (PREVIEW_MAX_SIZE << writer->scale_log2))
+    {
+      ++writer->scale_log2;
+    }
+    i32 scale = 1 << writer->scale_log2;
+    writer->w = (img_w + scale - 1) / scale;
+    writer->h = (img_h + scale - 1) / scale;
+    writer->pixels = malloc_array(4 * (u64)writer->w * writer->h, u8);
+    writer->sums = malloc_array(4 * writer->w, u32);
+    writer->premultiply = premultiply;
+
+    if(writer->pixels && writer->sums)
+    {
+      writer->preview = &shared->preview;
+      pthread_mutex_lock(&writer->preview->mutex);
+      // If another loader was showing something, it'll notice that its pixels are gone.
+      writer->preview->img_idx = request->img_idx;
+      writer->preview->load_generation = request->load_generation;
+      writer->preview->img_w = img_w;
+      writer->preview->img_h = img_h;
+      writer->preview->w = writer->w;
+      writer->preview->h = writer->h;
+      writer->preview->row_count = 0;
+      writer->preview->pixels = writer->pixels;
+      pthread_mutex_unlock(&writer->preview->mutex);
+    }
+    else
+    {
+      free(writer->pixels);
+      free(writer->sums);
+      zero_struct(*writer);
+    }
+  }
+  return writer->preview != 0;
+}
+
+// Box-filters the preview rows that the decoded rows complete, and makes them visible.
+internal void update_preview(preview_writer_t* writer, u8* img_pixels, i32 img_w, i32 img_h, i32 img_row_count)
+{
+  i32 scale = 1 << writer->scale_log2;
+  i32 first_row = writer->row_count;
+  i32 end_row = (img_row_count == img_h) ? writer->h : img_row_count / scale;
+
+  for(i32 y = first_row;
+      y < end_row;
+      ++y)
+  {
+    u8* out = writer->pixels + 4 * (u64)y * writer->w;
+    i32 img_y0 = y * scale;
+    i32 img_y1 = min(img_h, img_y0 + scale);
+    if(scale == 1)
+    {
+      memcpy(out, img_pixels + 4 * (u64)img_y0 * img_w, 4 * (u64)img_w);
+    }
+    else
+    {
+      zero_bytes(4 * writer->w * sizeof(u32), writer->sums);
+      for(i32 img_y = img_y0;
+          img_y < img_y1;
+          ++img_y)
+      {
+        u8* row = img_pixels + 4 * (u64)img_y * img_w;
+        for(i32 img_x = 0;
+            img_x < img_w;
+            ++img_x)
+        {
+          u32* sum = writer->sums + 4 * (img_x >> writer->scale_log2);
+          for_count(c, 4) { sum[c] += row[4 * img_x + c]; }
+        }
+      }
+
+      for(i32 x = 0;
+          x < writer->w;
+          ++x)
+      {
+        u32 count = (u32)(img_y1 - img_y0) * (u32)(min(img_w, (x + 1) * scale) - x * scale);
+        for_count(c, 4) { out[4 * x + c] = (u8)((writer->sums[4 * x + c] + count / 2) / count); }
+      }
+    }
+  }
+
+  if(end_row > first_row)
+  {
+    if(writer->premultiply)
+    {
+      premultiply_alpha((u64)writer->w * (end_row - first_row), writer->pixels + 4 * (u64)first_row * writer->w);
+    }
+    writer->row_count = end_row;
+
+    pthread_mutex_lock(&writer->preview->mutex);
+    if(writer->preview->pixels == writer->pixels)
+    {
+      writer->preview->row_count = end_row;
+    }
+    pthread_mutex_unlock(&writer->preview->mutex);
+  }
+}
+
+internal void end_preview(preview_writer_t* writer)
+{
+  if(writer->preview)
+  {
+    pthread_mutex_lock(&writer->preview->mutex);
+    if(writer->preview->pixels == writer->pixels)
+    {
+      writer->preview->img_idx = -1;
+      writer->preview->pixels = 0;
+    }
+    pthread_mutex_unlock(&writer->preview->mutex);
+  }
+  free(writer->pixels);
+  free(writer->sums);
+  zero_struct(*writer);
+}
+
+// Decodes an image file to RGBA, giving up early if the request gets cancelled.
+// The usual 8-bit RGB(A) PNGs go through our own decoder, everything else through stb_image.
+// While the viewed image decodes, its rows get published for previewing.
+// JPEGs that are only wanted for a thumbnail get decoded at a reduced scale, so the pixels can be smaller than w by h.
+internal u8* decode_img(load_request_t* request, u8* data, u64 size, i32* w, i32* h,
+    i32* pixels_w, i32* pixels_h, i32* channel_count)
+{
+  u8* result = 0;
+  b32 done = false;
+
+  jpeg_decoder_t jpeg = {0};
+  if(!request->full_resolution && jpeg_begin(&jpeg, data, size))
+  {
+    // As small as the IDCT can make it, without going below the thumbnail size.
+    i32 thumbnail_w = 0;
+    i32 thumbnail_h = 0;
+    get_thumbnail_dimensions(jpeg.w, jpeg.h, &thumbnail_w, &thumbnail_h);
+    i32 scale_log2 = 0;
+    while(scale_log2 < 3 && (jpeg.w >> (scale_log2 + 1)) >= thumbnail_w && (jpeg.h >> (scale_log2 + 1)) >= thumbnail_h)
+    {
+      ++scale_log2;
+    }
+
+    i32 scaled_w = jpeg_scaled_size(jpeg.w, scale_log2);
+    i32 scaled_h = jpeg_scaled_size(jpeg.h, scale_log2);
+    result = alloc_pixel_buffer(&request->shared->pixel_pool, 4 * (u64)scaled_w * scaled_h);
+    if(result && jpeg_decode(&jpeg, result, scale_log2))
+    {
+      *w = jpeg.w;
+      *h = jpeg.h;
+      *pixels_w = scaled_w;
+      *pixels_h = scaled_h;
+      *channel_count = jpeg.component_count;
+      done = true;
+    }
+    else
+    {
+      free_pixel_buffer(&request->shared->pixel_pool, result);
+      result = 0;
+    }
+  }
+  jpeg_end(&jpeg);
+
+  png_decoder_t png = {0};
+  if(!done && png_begin(&png, data, size))
+  {
+    result = alloc_pixel_buffer(&request->shared->pixel_pool, (u64)png.w * png.h * 4);
+    i32 batch_row_count = max(1, (256 * 1024) / (4 * png.w));
+    preview_writer_t preview_writer;
+    b32 previewing = (result && begin_preview(&preview_writer, request, png.w, png.h, png.channel_count == 4));
+    while(result && !png.failed && png.next_row < png.h && !is_load_cancelled(request))
+    {
+      png_decode_rows(&png, result + (u64)png.next_row * png.w * 4, batch_row_count);
+      if(previewing)
+      {
+        update_preview(&preview_writer, result, png.w, png.h, png.next_row);
+      }
+    }
+    if(previewing)
+    {
+      end_preview(&preview_writer);
+    }
+
+    if(result && png.next_row == png.h)
+    {
+      *w = png.w;
+      *h = png.h;
+      *pixels_w = png.w;
+      *pixels_h = png.h;
+      *channel_count = png.channel_count;
+      done = true;
+    }
+    else
+    {
+      free_pixel_buffer(&request->shared->pixel_pool, result);
+      result = 0;
+    }
+  }
+  png_end(&png);
+
+  if(!done && !request->cancelled)
+  {
+    stbi_io_callbacks callbacks = { stbi_read_callback, stbi_skip_callback, stbi_eof_callback };
+    stbi_reader_t reader = { data, data + size, request };
+    u8* stbi_pixels = stbi_load_from_callbacks(&callbacks, &reader, w, h, channel_count, 4);
+    if(stbi_pixels && !request->cancelled)
+    {
+      // stb_image allocates by itself, so these have to be copied over to get pooled.
+      u64 pixel_bytes = (u64)*w * *h * 4;
+      result = alloc_pixel_buffer(&request->shared->pixel_pool, pixel_bytes);
+      if(result)
+      {
+        memcpy(result, stbi_pixels, pixel_bytes);
+        *pixels_w = *w;
+        *pixels_h = *h;
+      }
+    }
+    stbi_image_free(stbi_pixels);
+  }
+
+  return result;
+}
+
+internal void push_load_job(shared_loader_data_t* shared, load_job_t job)
+{
+  if(shared->job_count == shared->job_capacity)
+  {
+    shared->job_capacity = max(256, 2 * shared->job_capacity);
+    shared->jobs = (load_job_t*)realloc(shared->jobs, shared->job_capacity * sizeof(load_job_t));
+  }
+
+  // Sift up.
+  i32 job_idx = shared->job_count++;
+  while(job_idx > 0)
+  {
+    i32 parent_idx = (job_idx - 1) / 2;
+    if(shared->jobs[parent_idx].priority <= job.priority) { break; }
+    shared->jobs[job_idx] = shared->jobs[parent_idx];
+    job_idx = parent_idx;
+  }
+  shared->jobs[job_idx] = job;
+}
+
+internal load_job_t pop_load_job(shared_loader_data_t* shared)
+{
+  assert(shared->job_count > 0);
+  load_job_t result = shared->jobs[0];
+  load_job_t last = shared->jobs[--shared->job_count];
+
+  // Sift down.
+  i32 job_idx = 0;
+  for(;;)
+  {
+    i32 child_idx = 2 * job_idx + 1;
+    if(child_idx >= shared->job_count) { break; }
+    if(child_idx + 1 < shared->job_count && shared->jobs[child_idx + 1].priority < shared->jobs[child_idx].priority)
+    {
+      ++child_idx;
+    }
+    if(last.priority <= shared->jobs[child_idx].priority) { break; }
+    shared->jobs[job_idx] = shared->jobs[child_idx];
+    job_idx = child_idx;
+  }
+  if(shared->job_count > 0)
+  {
+    shared->jobs[job_idx] = last;
+  }
+
+  return result;
+}
+
+// Bounded multi-producer queue after Dmitry Vyukov's:
+// https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+// Returns false if it's full.
+internal b32 push_completed_load(completion_queue_t* queue, loaded_img_t* loaded_img)
+{
+  b32 result = false;
+  u64 pos = queue->enqueue_pos;
+  for(;;)
+  {
+    completion_cell_t* cell = &queue->cells[pos % COMPLETION_QUEUE_SIZE];
+    i64 diff = (i64)cell->sequence - (i64)pos;
+    if(diff == 0)
+    {
+      if(__sync_bool_compare_and_swap(&queue->enqueue_pos, pos, pos + 1))
+      {
+        cell->loaded_img = *loaded_img;
+        __sync_synchronize();
+        cell->sequence = pos + 1;
+        result = true;
+        break;
+      }
+    }
+    else if(diff < 0)
+    {
+      break;
+    }
+    pos = queue->enqueue_pos;
+  }
+
+  return result;
+}
+
+// Only the main thread pops.
+internal b32 pop_completed_load(completion_queue_t* queue, loaded_img_t* loaded_img)
+{
+  b32 result = false;
+  u64 pos = queue->dequeue_pos;
+  completion_cell_t* cell = &queue->cells[pos % COMPLETION_QUEUE_SIZE];
+  if(cell->sequence == pos + 1)
+  {
+    __sync_synchronize();
+    *loaded_img = cell->loaded_img;
+    queue->dequeue_pos = pos + 1;
+    __sync_synchronize();
+    cell->sequence = pos + COMPLETION_QUEUE_SIZE;
+    result = true;
+  }
+
+  return result;
+}
+
+internal void wake_io_stage(shared_loader_data_t* shared)
+{
+  if(shared->io_wake_eventfd != -1)
+  {
+    u64 one = 1;
+    ssize_t write_result = write(shared->io_wake_eventfd, &one, sizeof(one));
+    (void)write_result;
+  }
+  else
+  {
+    pthread_cond_broadcast(&shared->job_cond);
+  }
+}
+
+// Pops the next job, if there's room for reading another file ahead.
+internal b32 take_load_job(shared_loader_data_t* shared, b32 wait, load_job_t* job)
+{
+  b32 result = false;
+  pthread_mutex_lock(&shared->job_mutex);
+  while(wait && (shared->job_count == 0 || shared->readahead_used >= shared->readahead_limit))
+  {
+    pthread_cond_wait(&shared->job_cond, &shared->job_mutex);
+  }
+  if(shared->job_count > 0 && shared->readahead_used < shared->readahead_limit)
+  {
+    *job = pop_load_job(shared);
+    ++shared->readahead_used;
+    result = true;
+  }
+  pthread_mutex_unlock(&shared->job_mutex);
+
+  return result;
+}
+
+// For taken jobs that turned out to need no reading.
+internal void release_readahead(shared_loader_data_t* shared)
+{
+  pthread_mutex_lock(&shared->job_mutex);
+  --shared->readahead_used;
+  pthread_mutex_unlock(&shared->job_mutex);
+  wake_io_stage(shared);
+}
+
+internal void push_read_load(shared_loader_data_t* shared, read_load_t* read)
+{
+  pthread_mutex_lock(&shared->job_mutex);
+  assert(shared->read_count < shared->readahead_limit);
+  shared->reads[(shared->read_first_idx + shared->read_count) % shared->readahead_limit] = *read;
+  ++shared->read_count;
+  pthread_mutex_unlock(&shared->job_mutex);
+  pthread_cond_signal(&shared->read_cond);
+}
+
+internal read_load_t pop_read_load(shared_loader_data_t* shared)
+{
+  pthread_mutex_lock(&shared->job_mutex);
+  while(shared->read_count == 0)
+  {
+    pthread_cond_wait(&shared->read_cond, &shared->job_mutex);
+  }
+  read_load_t result = shared->reads[shared->read_first_idx];
+  shared->read_first_idx = (shared->read_first_idx + 1) % shared->readahead_limit;
+  --shared->read_count;
+  --shared->readahead_used;
+  pthread_mutex_unlock(&shared->job_mutex);
+
+  // There's room for reading the next file now.
+  wake_io_stage(shared);
+
+  return result;
+}
+
+// Claims the image for the job, so no other loader starts on it, and looks for a cached thumbnail.
+// Returns false if there's nothing to do.
+internal b32 claim_load_job(shared_loader_data_t* shared, load_job_t job, read_load_t* read)
+{
+  img_entry_t* img_entry = &shared->img_entries[job.img_idx];
+
+  // The queue was planned with predicted sizes; don't go too far over the limits if they were off.
+  // Unloading on the main thread will trigger another round of jobs.
+  // The viewed image gets loaded no matter what, since a huge one might not fit at all.
+  if(job.full_resolution)
+  {
+    if(job.filtered_img_idx != shared->viewing_filtered_img_idx
+        && shared->ram_bytes_used + img_entry->bytes_used > (3 * shared->ram_bytes_limit) / 2)
+    {
+      return false;
+    }
+  }
+  else
+  {
+    if(shared->thumbnail_bytes_used + get_thumbnail_bytes_used() > (3 * shared->thumbnail_bytes_limit) / 2)
+    {
+      return false;
+    }
+  }
+
+  u32 load_generation = img_entry->load_generation;
+  b32 claimed = false;
+  b32 make_thumbnail_too = false;
+  if(job.full_resolution)
+  {
+    claimed = __sync_bool_compare_and_swap(&img_entry->load_state, LOAD_STATE_UNLOADED, LOAD_STATE_LOADING);
+    if(claimed)
+    {
+      make_thumbnail_too = __sync_bool_compare_and_swap(&img_entry->thumbnail_load_state,
+          LOAD_STATE_UNLOADED, LOAD_STATE_LOADING);
+    }
+  }
+  else
+  {
+    claimed = __sync_bool_compare_and_swap(&img_entry->thumbnail_load_state, LOAD_STATE_UNLOADED, LOAD_STATE_LOADING);
+    make_thumbnail_too = claimed;
+  }
+
+  if(claimed)
+  {
+    zero_struct(*read);
+    read->job = job;
+
+    loaded_img_t* loaded_img = &read->loaded_img;
+    loaded_img->load_generation = load_generation;
+    loaded_img->entry_idx = job.img_idx;
+    loaded_img->full_resolution = job.full_resolution;
+    loaded_img->has_thumbnail = make_thumbnail_too;
+
+    // Thumbnails are kept across runs, keyed by path, timestamp and size of the file.
+    if(make_thumbnail_too && shared->thumbnail_cache.header)
+    {
+      read->path_hash = hash_path_for_cache((char*)img_entry->path.data);  // XXX: This path string may have been freed!
+      if(!job.full_resolution)
+      {
+        loaded_img->thumbnail_pixels = lookup_cached_thumbnail(&shared->thumbnail_cache, &shared->pixel_pool,
+            read->path_hash, timespec_to_nsecs(img_entry->modified_at_time), img_entry->filesize,
+            &loaded_img->w, &loaded_img->h, &loaded_img->thumbnail_w, &loaded_img->thumbnail_h,
+            &loaded_img->opaque);
+      }
+    }
+  }
+
+  return claimed;
+}
+
+// The I/O stage without io_uring: Each of these threads reads one file at a time.
+internal void* blocking_io_fun(void* raw_data)
+{
+  loader_data_t* data = (loader_data_t*)raw_data;
+  shared_loader_data_t* shared = data->shared;
+
+  for(;;)
+  {
+    load_job_t job = {0};
+    take_load_job(shared, true, &job);
+
+    read_load_t read = {0};
+    if(claim_load_job(shared, job, &read))
+    {
+      if(!read.loaded_img.thumbnail_pixels)
+      {
+        read.file = read_file((char*)shared->img_entries[job.img_idx].path.data);  // XXX: This path string may have been freed!
+        // Read files count toward the RAM limit until the decoder frees them.
+        __sync_fetch_and_add(&shared->ram_bytes_used, read.file.size);
+      }
+      push_read_load(shared, &read);
+    }
+    else
+    {
+      release_readahead(shared);
+    }
+  }
+
+  return 0;
+}
+
+internal b32 open_io_ring(io_ring_t* ring, u32 entry_count)
+{
+  b32 result = false;
+#if HAS_IO_URING
+  struct io_uring_params params = {0};
+  int fd = (int)syscall(__NR_io_uring_setup, entry_count, &params);
+  if(fd >= 0)
+  {
+    // Opening and reading through the ring need Linux 5.6, so check for them.
+    u32 probe_op_count = 256;
+    struct io_uring_probe* probe = (struct io_uring_probe*)zero_bytes(
+        sizeof(struct io_uring_probe) + probe_op_count * sizeof(struct io_uring_probe_op),
+        malloc(sizeof(struct io_uring_probe) + probe_op_count * sizeof(struct io_uring_probe_op)));
+    b32 ops_supported = (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, probe_op_count) == 0
+        && probe->last_op >= IORING_OP_READ
+        && (probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED)
+        && (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED)
+        && (probe->ops[IORING_OP_POLL_ADD].flags & IO_URING_OP_SUPPORTED));
+    free(probe);
+
+    u8* sq_ring = (u8*)MAP_FAILED;
+    u8* cq_ring = (u8*)MAP_FAILED;
+    struct io_uring_sqe* sqes = (struct io_uring_sqe*)MAP_FAILED;
+    if(ops_supported)
+    {
+      sq_ring = (u8*)mmap(0, params.sq_off.array + params.sq_entries * sizeof(u32),
+          PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+      cq_ring = (u8*)mmap(0, params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe),
+          PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+      sqes = (struct io_uring_sqe*)mmap(0, params.sq_entries * sizeof(struct io_uring_sqe),
+          PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    }
+
+    if(sq_ring != MAP_FAILED && cq_ring != MAP_FAILED && sqes != (struct io_uring_sqe*)MAP_FAILED)
+    {
+      zero_struct(*ring);
+      ring->fd = fd;
+      ring->sq_tail = (u32*)(sq_ring + params.sq_off.tail);
+      ring->sq_mask = *(u32*)(sq_ring + params.sq_off.ring_mask);
+      ring->sq_array = (u32*)(sq_ring + params.sq_off.array);
+      ring->sqes = sqes;
+      ring->cq_head = (u32*)(cq_ring + params.cq_off.head);
+      ring->cq_tail = (u32*)(cq_ring + params.cq_off.tail);
+      ring->cq_mask = *(u32*)(cq_ring + params.cq_off.ring_mask);
+      ring->cqes = (struct io_uring_cqe*)(cq_ring + params.cq_off.cqes);
+      result = true;
+    }
+    else
+    {
+      // Mappings of the ring outlive its file, so undo the ones that worked.
+      if(sq_ring != MAP_FAILED) { munmap(sq_ring, params.sq_off.array + params.sq_entries * sizeof(u32)); }
+      if(cq_ring != MAP_FAILED) { munmap(cq_ring, params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe)); }
+      if(sqes != (struct io_uring_sqe*)MAP_FAILED) { munmap(sqes, params.sq_entries * sizeof(struct io_uring_sqe)); }
+      close(fd);
+    }
+  }
+#else
+  (void)ring;
+  (void)entry_count;
+#endif
+  return result;
+}
+
+#if HAS_IO_URING
+// Gets cleared, and submitted with the next wait.
+internal struct io_uring_sqe* get_io_sqe(io_ring_t* ring)
+{
+  u32 tail = *ring->sq_tail;
+  u32 sqe_idx = tail & ring->sq_mask;
+  struct io_uring_sqe* result = &ring->sqes[sqe_idx];
+  zero_struct(*result);
+  ring->sq_array[sqe_idx] = sqe_idx;
+  ++ring->unsubmitted_count;
+  __sync_synchronize();
+  *ring->sq_tail = tail + 1;
+  return result;
+}
+
+internal void submit_and_wait_for_io(io_ring_t* ring)
+{
+  for(;;)
+  {
+    int submitted_count = (int)syscall(__NR_io_uring_enter, ring->fd, ring->unsubmitted_count, 1,
+        IORING_ENTER_GETEVENTS, 0, 0);
+    if(submitted_count >= 0)
+    {
+      ring->unsubmitted_count -= submitted_count;
+      break;
+    }
+    else if(errno != EINTR)
+    {
+      fprintf(stderr, "io_uring_enter failed (errno %d).\n", errno);
+      usleep(10000);
+    }
+  }
+}
+
+typedef struct
+{
+  b32 in_use;
+  read_load_t read;
+  int fd;  // -1 while opening.
+  u64 read_pos;
+} io_uring_read_t;
+
+// The I/O stage with io_uring: One thread keeps all the files of the readahead opening and reading at once,
+// so the latencies of network file systems overlap with each other and with the decoding.
+internal void* io_uring_fun(void* raw_data)
+{
+  loader_data_t* data = (loader_data_t*)raw_data;
+  shared_loader_data_t* shared = data->shared;
+  io_ring_t* ring = &shared->io_ring;
+  io_uring_read_t* io_reads = malloc_array_zero(shared->readahead_limit, io_uring_read_t);
+  b32 waiting_for_wake = false;
+
+  for(;;)
+  {
+    if(!waiting_for_wake)
+    {
+      struct io_uring_sqe* sqe = get_io_sqe(ring);
+      sqe->opcode = IORING_OP_POLL_ADD;
+      sqe->fd = shared->io_wake_eventfd;
+      sqe->poll32_events = POLLIN;
+      sqe->user_data = 0;
+      waiting_for_wake = true;
+    }
+
+    load_job_t job = {0};
+    while(take_load_job(shared, false, &job))
+    {
+      read_load_t read = {0};
+      if(!claim_load_job(shared, job, &read))
+      {
+        release_readahead(shared);
+      }
+      else if(read.loaded_img.thumbnail_pixels)
+      {
+        push_read_load(shared, &read);
+      }
+      else
+      {
+        // There's always a free one, since they count toward the readahead.
+        i32 io_read_idx = 0;
+        while(io_reads[io_read_idx].in_use) { ++io_read_idx; }
+        assert(io_read_idx < shared->readahead_limit);
+        io_uring_read_t* io_read = &io_reads[io_read_idx];
+        zero_struct(*io_read);
+        io_read->in_use = true;
+        io_read->read = read;
+        io_read->fd = -1;
+
+        // The kernel copies the path when it gets submitted.
+        struct io_uring_sqe* sqe = get_io_sqe(ring);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (u64)shared->img_entries[job.img_idx].path.data;  // XXX: This path string may have been freed!
+        sqe->open_flags = O_RDONLY | O_CLOEXEC;
+        sqe->user_data = io_read_idx + 1;
+      }
+    }
+
+    submit_and_wait_for_io(ring);
+
+    u32 cq_head = *ring->cq_head;
+    while(cq_head != *ring->cq_tail)
+    {
+      __sync_synchronize();
+      struct io_uring_cqe* cqe = &ring->cqes[cq_head & ring->cq_mask];
+      ++cq_head;
+
+      if(cqe->user_data == 0)
+      {
+        // Jobs were added, or a decoder made room.
+        u64 wake_count = 0;
+        ssize_t read_result = read(shared->io_wake_eventfd, &wake_count, sizeof(wake_count));
+        (void)read_result;
+        waiting_for_wake = false;
+        continue;
+      }
+
+      io_uring_read_t* io_read = &io_reads[cqe->user_data - 1];
+      str_t* file = &io_read->read.file;
+      char* path = (char*)shared->img_entries[io_read->read.job.img_idx].path.data;  // XXX: This path string may have been freed!
+      b32 failed = false;
+      if(cqe->res < 0)
+      {
+        fprintf(stderr, "Could not %s file '%s'.\n", io_read->fd == -1 ? "open" : "read all of", path);
+        failed = true;
+      }
+      else if(io_read->fd == -1)
+      {
+        io_read->fd = cqe->res;
+        struct stat file_stat = {0};
+        if(fstat(io_read->fd, &file_stat) == -1)
+        {
+          fprintf(stderr, "Could not stat file '%s'.\n", path);
+          failed = true;
+        }
+        else
+        {
+          file->size = file_stat.st_size;
+          file->data = malloc_array(file->size + 1, u8);
+          if(!file->data)
+          {
+            fprintf(stderr, "Could not allocate %lu bytes for file '%s'.\n", file->size, path);
+            failed = true;
+          }
+          else
+          {
+            // Read files count toward the RAM limit until the decoder frees them.
+            __sync_fetch_and_add(&shared->ram_bytes_used, file->size);
+          }
+        }
+      }
+      else if(cqe->res == 0)
+      {
+        // The file got shorter in the meantime.
+        __sync_fetch_and_sub(&shared->ram_bytes_used, file->size - io_read->read_pos);
+        file->size = io_read->read_pos;
+      }
+      else
+      {
+        io_read->read_pos += cqe->res;
+      }
+
+      if(!failed && io_read->read_pos < file->size)
+      {
+        struct io_uring_sqe* sqe = get_io_sqe(ring);
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = io_read->fd;
+        sqe->addr = (u64)(file->data + io_read->read_pos);
+        sqe->len = (u32)min(file->size - io_read->read_pos, 1u << 30);
+        sqe->off = io_read->read_pos;
+        sqe->user_data = cqe->user_data;
+      }
+      else
+      {
+        if(io_read->fd != -1)
+        {
+          close(io_read->fd);
+        }
+        if(failed)
+        {
+          if(file->data)
+          {
+            __sync_fetch_and_sub(&shared->ram_bytes_used, file->size);
+          }
+          free(file->data);
+          file->data = 0;
+          file->size = 0;
+        }
+        push_read_load(shared, &io_read->read);
+        io_read->in_use = false;
+      }
+    }
+    __sync_synchronize();
+    *ring->cq_head = cq_head;
+  }
+
+  return 0;
+}
+#endif
+
+// Decodes the files that the I/O stage has read.
+internal void* loader_fun(void* raw_data)
+{
+  loader_data_t* data = (loader_data_t*)raw_data;
+  i32 thread_idx = data->thread_idx;
+  shared_loader_data_t* shared = data->shared;
+
+  for(;;)
+  {
+    read_load_t read = pop_read_load(shared);
+    load_job_t job = read.job;
+    loaded_img_t* loaded_img = &read.loaded_img;
+    img_entry_t* img_entry = &shared->img_entries[job.img_idx];
+    // printf("Loader %d: Got file for image %d (priority %f).\n", thread_idx, job.img_idx, job.priority);
+
+    // Reading was overlapped with other decoding, so only this counts toward the load times.
+    u64 load_start_nsecs = get_nanoseconds();
+    load_request_t request = {0};
+    request.shared = shared;
+    request.img_idx = job.img_idx;
+    request.filtered_img_idx = job.filtered_img_idx;
+    request.load_generation = loaded_img->load_generation;
+    request.full_resolution = job.full_resolution;
+    request.checked_viewport_epoch = job.viewport_epoch;
+
+    if(!loaded_img->thumbnail_pixels)
+    {
+      i32 original_channel_count = 0;
+      i32 pixels_w = 0;
+      i32 pixels_h = 0;
+      if(read.file.data && !is_load_cancelled(&request))
+      {
+        loaded_img->pixels = decode_img(&request, read.file.data, read.file.size,
+            &loaded_img->w, &loaded_img->h, &pixels_w, &pixels_h, &original_channel_count);
+      }
+      __sync_fetch_and_sub(&shared->ram_bytes_used, read.file.size);
+      free(read.file.data);
+
+      if(request.cancelled)
+      {
+        // printf("Loader %d: Cancelled loading image %d.\n", thread_idx, job.img_idx);
+        loaded_img->cancelled = true;
+        loaded_img->w = 0;
+        loaded_img->h = 0;
+      }
+      else if(!loaded_img->pixels)
+      {
+        loaded_img->w = 0;
+        loaded_img->h = 0;
+      }
+      else
+      {
+        loaded_img->opaque = true;
+        if(original_channel_count == 2 || original_channel_count == 4)
+        {
+          loaded_img->opaque = premultiply_alpha((u64)pixels_w * (u64)pixels_h, loaded_img->pixels);
+        }
+
+        if(loaded_img->has_thumbnail)
+        {
+          loaded_img->thumbnail_pixels = make_thumbnail(&shared->pixel_pool, pixels_w, pixels_h, loaded_img->pixels,
+              loaded_img->w, loaded_img->h, &loaded_img->thumbnail_w, &loaded_img->thumbnail_h);
+          if(loaded_img->thumbnail_pixels && read.path_hash)
+          {
+            store_cached_thumbnail(&shared->thumbnail_cache, read.path_hash,
+                timespec_to_nsecs(img_entry->modified_at_time), img_entry->filesize,
+                loaded_img->w, loaded_img->h, loaded_img->thumbnail_w, loaded_img->thumbnail_h,
+                loaded_img->opaque, loaded_img->thumbnail_pixels);
+          }
+        }
+
+        if(job.full_resolution)
+        {
+          // Keep only the channels that the image uses, which makes it smaller in RAM and VRAM.
+          u64 pixel_count = (u64)loaded_img->w * (u64)loaded_img->h;
+          b32 gray = (original_channel_count == 1 || original_channel_count == 2
+              || is_grayscale(pixel_count, loaded_img->pixels));
+          loaded_img->channel_count = (gray ? 1 : 3) + !loaded_img->opaque;
+          if(loaded_img->channel_count < 4)
+          {
+            u8* packed_pixels = alloc_pixel_buffer(&shared->pixel_pool, loaded_img->channel_count * pixel_count);
+            if(packed_pixels)
+            {
+              pack_pixel_channels(pixel_count, loaded_img->pixels, packed_pixels, loaded_img->channel_count);
+              free_pixel_buffer(&shared->pixel_pool, loaded_img->pixels);
+              loaded_img->pixels = packed_pixels;
+            }
+            else
+            {
+              loaded_img->channel_count = 4;
+            }
+          }
+
+          loaded_img->bytes_used = loaded_img->channel_count * (i64)pixel_count;
+          if(loaded_img->w > shared->tiled_img_min_size || loaded_img->h > shared->tiled_img_min_size)
+          {
+            loaded_img->tiled = make_tiled_img(&shared->pixel_pool, loaded_img->w, loaded_img->h,
+                loaded_img->channel_count, loaded_img->pixels, &loaded_img->bytes_used);
+            if(!loaded_img->tiled && shared->max_texture_size > 0
+                && max(loaded_img->w, loaded_img->h) > shared->max_texture_size)
+            {
+              // Without tiles it would need a single texture, which the GPU can't take.
+              fprintf(stderr, "Not enough memory for tiling a %d x %d image.\n", loaded_img->w, loaded_img->h);
+              free_pixel_buffer(&shared->pixel_pool, loaded_img->pixels);
+              loaded_img->pixels = 0;
+              loaded_img->bytes_used = 0;
+            }
+          }
+          __sync_fetch_and_add(&shared->ram_bytes_used, loaded_img->bytes_used);
+        }
+        else
+        {
+          // Only the dimensions are of interest from here on.
+          free_pixel_buffer(&shared->pixel_pool, loaded_img->pixels);
+          loaded_img->pixels = 0;
+        }
+      }
+    }
+
+    if(loaded_img->thumbnail_pixels)
+    {
+      make_mips(loaded_img->thumbnail_pixels, loaded_img->thumbnail_w, loaded_img->thumbnail_h);
+      loaded_img->thumbnail_bytes_used = get_thumbnail_bytes_used();
+      __sync_fetch_and_add(&shared->thumbnail_bytes_used, loaded_img->thumbnail_bytes_used);
+    }
+
+    if(!loaded_img->cancelled && (loaded_img->pixels || loaded_img->thumbnail_pixels))
+    {
+      // Racy, but it's only an estimate anyway.
+      r32 load_secs = 1e-9f * (r32)(get_nanoseconds() - load_start_nsecs);
+      if(job.full_resolution) { shared->full_resolution_load_secs = lerp(shared->full_resolution_load_secs, load_secs, 0.2f); }
+      else                    { shared->thumbnail_load_secs = lerp(shared->thumbnail_load_secs, load_secs, 0.2f); }
+    }
+
+    while(!push_completed_load(&shared->completions, loaded_img))
+    {
+      // The main thread is behind, and the earlier completions have woken it up already.
+      usleep(1000);
+    }
+
+    // Wake up the main thread if it's waiting for events.
+    u64 one = 1;
+    ssize_t write_result = write(shared->completion_eventfd, &one, sizeof(one));
+    (void)write_result;
+  }
+
+  return 0;
+}
+
+// Estimates how fast the viewport moves, smoothed over about a quarter second.
+// Calls without movement count as standing still for the time since the last call, so the estimate decays to 0.
+internal void update_viewport_velocity(state_t* state)
+{
+  shared_loader_data_t* shared = &state->shared;
+  i32 first_visible_thumbnail_idx = shared->first_visible_thumbnail_idx;
+  i32 last_visible_thumbnail_idx = shared->last_visible_thumbnail_idx;
+  i32 viewing_filtered_img_idx = shared->viewing_filtered_img_idx;
+  i32 filtered_img_count = shared->filtered_img_count;
+
+  u64 nsecs_now = get_nanoseconds();
+  r32 secs = max(0.001f, 1e-9f * (r32)(nsecs_now - state->velocity_nsecs));
+  r32 smoothing = 1 - expf(-secs / 0.25f);
+  i32 scroll_delta = first_visible_thumbnail_idx - state->velocity_first_visible_thumbnail_idx;
+  i32 flip_delta = viewing_filtered_img_idx - state->velocity_viewing_filtered_img_idx;
+
+  // Jumps (like Home/End, clicking a thumbnail, or a new search) don't count as moving.
+  if(filtered_img_count != state->velocity_filtered_img_count) { scroll_delta = 0; flip_delta = 0; }
+  if(absolute(scroll_delta) > 4 * max(1, last_visible_thumbnail_idx - first_visible_thumbnail_idx + 1)) { scroll_delta = 0; }
+  if(absolute(flip_delta) > 2 * FULL_RESOLUTION_NEIGHBOR_COUNT) { flip_delta = 0; }
+
+  shared->scroll_velocity = lerp(shared->scroll_velocity, scroll_delta / secs, smoothing);
+  shared->flip_velocity = lerp(shared->flip_velocity, flip_delta / secs, smoothing);
+  // printf("Scroll velocity %.1f, flip velocity %.1f\n", shared->scroll_velocity, shared->flip_velocity);
+
+  state->velocity_nsecs = nsecs_now;
+  state->velocity_first_visible_thumbnail_idx = first_visible_thumbnail_idx;
+  state->velocity_viewing_filtered_img_idx = viewing_filtered_img_idx;
+  state->velocity_filtered_img_count = filtered_img_count;
+}
+
+// Plans what the loader threads do next: The viewed image and its neighbors in full resolution,
+// then thumbnails for the visible range, then prefetching out from there, as far as the memory limits allow.
+// When the viewport moves faster than the loaders can follow, the neighbors and the prefetching shift toward
+// the direction of travel, and the prefetching reaches further.
+// Called on the main thread whenever the viewport changed, or something got loaded or unloaded.
+internal void update_load_queue(state_t* state)
+{
+  shared_loader_data_t* shared = &state->shared;
+  i32 viewing_filtered_img_idx = shared->viewing_filtered_img_idx;
+  i32 range_start_idx = shared->first_visible_thumbnail_idx;
+  i32 range_end_idx = shared->last_visible_thumbnail_idx;
+  i32 filtered_img_count = shared->filtered_img_count;
+  i32 loader_count = max(1, state->loader_count);
+
+  update_viewport_velocity(state);
+
+  // Going from 0 when standing still toward 1 when moving much faster than the images can be loaded.
+  r32 flip_ratio = absolute(shared->flip_velocity) * shared->full_resolution_load_secs / loader_count;
+  r32 flip_bias = flip_ratio / (1 + flip_ratio);
+  i32 flip_direction = (shared->flip_velocity >= 0) ? 1 : -1;
+  r32 scroll_ratio = absolute(shared->scroll_velocity) * shared->thumbnail_load_secs / loader_count;
+  r32 scroll_bias = scroll_ratio / (1 + scroll_ratio);
+  i32 scroll_direction = (shared->scroll_velocity >= 0) ? 1 : -1;
+
+  i32 visible_count = max(0, range_end_idx - range_start_idx + 1);
+  i32 prefetch_count = 100 + (i32)(absolute(shared->scroll_velocity) * PREFETCH_LOOKAHEAD_SECS);
+  prefetch_count = max(0, min(prefetch_count, filtered_img_count - visible_count));
+
+  // The images in the window wait in RAM until they get viewed, then move to VRAM, so they need to fit into both.
+  i64 wanted_bytes_limit = min(shared->ram_bytes_limit, shared->vram_bytes_limit);
+  i64 wanted_bytes = 0;
+  i64 wanted_thumbnail_bytes = 0;
+  r32 priority = 0;
+
+  pthread_mutex_lock(&shared->job_mutex);
+  shared->job_count = 0;
+  u32 viewport_epoch = shared->viewport_epoch + 1;
+
+  // The viewed image first, then whichever neighbor is cheaper to reach next,
+  // where steps against the direction of travel cost more.
+  i32 full_resolution_window_start_idx = viewing_filtered_img_idx;
+  i32 full_resolution_window_end_idx = viewing_filtered_img_idx;
+  i32 ahead_distance = 0;
+  i32 behind_distance = 0;
+  for(i32 load_idx = 0;
+      filtered_img_count > 0 && load_idx < 1 + 2 * FULL_RESOLUTION_NEIGHBOR_COUNT;
+      ++load_idx)
+  {
+    i32 filtered_img_idx = viewing_filtered_img_idx;
+    if(load_idx > 0)
+    {
+      if((ahead_distance + 1) * (1 - flip_bias) <= (behind_distance + 1) * (1 + flip_bias))
+      {
+        ++ahead_distance;
+        filtered_img_idx += flip_direction * ahead_distance;
+      }
+      else
+      {
+        ++behind_distance;
+        filtered_img_idx -= flip_direction * behind_distance;
+      }
+    }
+
+    if(filtered_img_idx < 0 || filtered_img_idx >= filtered_img_count)
+    {
+      continue;
+    }
+    full_resolution_window_start_idx = min(full_resolution_window_start_idx, filtered_img_idx);
+    full_resolution_window_end_idx = max(full_resolution_window_end_idx, filtered_img_idx);
+
+    i32 img_idx = shared->filtered_img_idxs[filtered_img_idx];
+    img_entry_t* img_entry = &shared->img_entries[img_idx];
+    if(load_idx > 0 && wanted_bytes + img_entry->bytes_used > wanted_bytes_limit)
+    {
+      continue;
+    }
+    wanted_bytes += img_entry->bytes_used;
+
+    if(img_entry->load_state == LOAD_STATE_UNLOADED)
+    {
+      load_job_t job = {0};
+      job.img_idx = img_idx;
+      job.filtered_img_idx = filtered_img_idx;
+      job.full_resolution = true;
+      job.priority = priority++;
+      job.viewport_epoch = viewport_epoch;
+      push_load_job(shared, job);
+    }
+  }
+
+  // Thumbnails for the visible range, then prefetching out from it the same way.
+  i32 thumbnail_window_start_idx = range_start_idx;
+  i32 thumbnail_window_end_idx = range_end_idx;
+  ahead_distance = 0;
+  behind_distance = 0;
+  for(i32 load_idx = 0;
+      filtered_img_count > 0 && load_idx < visible_count + prefetch_count;
+      ++load_idx)
+  {
+    i32 filtered_img_idx = range_start_idx + load_idx;
+    if(load_idx >= visible_count)
+    {
+      if((ahead_distance + 1) * (1 - scroll_bias) <= (behind_distance + 1) * (1 + scroll_bias))
+      {
+        ++ahead_distance;
+        filtered_img_idx = (scroll_direction > 0) ? range_end_idx + ahead_distance : range_start_idx - ahead_distance;
+      }
+      else
+      {
+        ++behind_distance;
+        filtered_img_idx = (scroll_direction > 0) ? range_start_idx - behind_distance : range_end_idx + behind_distance;
+      }
+      thumbnail_window_start_idx = min(thumbnail_window_start_idx, filtered_img_idx);
+      thumbnail_window_end_idx = max(thumbnail_window_end_idx, filtered_img_idx);
+      filtered_img_idx = i32_wrap_upto(filtered_img_idx, filtered_img_count);
+    }
+
+    i32 img_idx = shared->filtered_img_idxs[filtered_img_idx];
+    img_entry_t* img_entry = &shared->img_entries[img_idx];
+    i64 thumbnail_bytes_used = get_thumbnail_bytes_used();
+    if(wanted_thumbnail_bytes + thumbnail_bytes_used > shared->thumbnail_bytes_limit)
+    {
+      break;
+    }
+    wanted_thumbnail_bytes += thumbnail_bytes_used;
+
+    if(img_entry->thumbnail_load_state == LOAD_STATE_UNLOADED)
+    {
+      load_job_t job = {0};
+      job.img_idx = img_idx;
+      job.filtered_img_idx = filtered_img_idx;
+      job.full_resolution = false;
+      job.priority = priority++;
+      job.viewport_epoch = viewport_epoch;
+      push_load_job(shared, job);
+    }
+  }
+
+  // Loads that are already running check these once they see the new epoch.
+  shared->full_resolution_window_start_idx = full_resolution_window_start_idx;
+  shared->full_resolution_window_end_idx = full_resolution_window_end_idx;
+  shared->thumbnail_window_start_idx = thumbnail_window_start_idx;
+  shared->thumbnail_window_end_idx = thumbnail_window_end_idx;
+  __sync_synchronize();
+  shared->viewport_epoch = viewport_epoch;
+
+  b32 got_jobs = (shared->job_count > 0);
+  pthread_mutex_unlock(&shared->job_mutex);
+
+  if(got_jobs)
+  {
+    wake_io_stage(shared);
+  }
+}
+
+// Gathers the chunks that the metadata parsing looks at, from wherever they are in the file, into one
+// buffer that is laid out like a PNG file with only those chunks.  In between, only the chunk headers
+// get read, so the image data gets skipped.  Returns false if the file couldn't be read.
+internal b32 read_png_metadata_chunks(int fd, str_t* chunks)
+{
+  b32 result = false;
+  zero_struct(*chunks);
+
+  // Usually all of the metadata is near the start, so this is the only read.
+  u8 window[4096];
+  ssize_t window_size = pread(fd, window, sizeof(window), 0);
+  u8 signature[8] = { 0x89, 'P', 'N', 'G', 0x0d, 0x0a, 0x1a, 0x0a };
+
+  if(window_size != -1)
+  {
+    result = true;
+
+    if(window_size >= 8 && bytes_eq(8, window, signature))
+    {
+      // From here on, read-ahead would mostly fetch image data that gets skipped.
+      posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+
+      u64 capacity = sizeof(window);
+      chunks->data = malloc_array(capacity, u8);
+      memcpy(chunks->data, signature, 8);
+      chunks->size = 8;
+
+      for(u64 offset = 8;
+         ;
+         )
+      {
+        u8 chunk_header[8];
+        if(offset + 8 <= (u64)window_size)
+        {
+          memcpy(chunk_header, window + offset, 8);
+        }
+        else if(pread(fd, chunk_header, 8, offset) != 8)
+        {
+          break;
+        }
+
+        u32 chunk_size = png_read_u32(chunk_header);
+        u8* chunk_type = chunk_header + 4;
+        if(bytes_eq(4, chunk_type, "IEND"))
+        {
+          break;
+        }
+
+        if((bytes_eq(4, chunk_type, "IHDR") || bytes_eq(4, chunk_type, "tEXt") || bytes_eq(4, chunk_type, "iTXt"))
+            && chunk_size <= PNG_METADATA_CHUNK_MAX_SIZE)
+        {
+          // With the CRC at the end, like in the file.
+          u64 chunk_total_size = 8 + (u64)chunk_size + 4;
+          if(chunks->size + chunk_total_size > capacity)
+          {
+            capacity = max(2 * capacity, chunks->size + chunk_total_size);
+            chunks->data = (u8*)realloc(chunks->data, capacity);
+          }
+
+          u8* dst = chunks->data + chunks->size;
+          if(offset + chunk_total_size <= (u64)window_size)
+          {
+            memcpy(dst, window + offset, chunk_total_size);
+          }
+          else
+          {
+            memcpy(dst, chunk_header, 8);
+            if(pread(fd, dst + 8, chunk_size + 4, offset + 8) != chunk_size + 4)
+            {
+              // Truncated, so the parsing wouldn't take it anyway.
+              break;
+            }
+          }
+          chunks->size += chunk_total_size;
+        }
+
+        offset += 8 + (u64)chunk_size + 4;
+      }
+    }
+  }
+
+  return result;
+}
+
+// Fills in the parameter strings and the parsed values, if the index has them for this version of the file.
+internal b32 load_indexed_metadata(cache_file_t* index, img_entry_t* img, u64 path_hash)
+{
+  b32 result = false;
+  u64 data_pos = 0;
+  u8* record_ptr = find_cache_file_record(index, path_hash, sizeof(metadata_index_record_t), &data_pos);
+
+  if(record_ptr)
+  {
+    metadata_index_record_t record = *(metadata_index_record_t*)record_ptr;
+    u64 strings_size = record.record_size - sizeof(record);
+    b32 valid = (record.path_hash == path_hash
+        && record.modified_at_nsecs == timespec_to_nsecs(img->modified_at_time)
+        && record.filesize == img->filesize
+        && record.parser_version == METADATA_PARSER_VERSION
+        && record.record_size >= sizeof(record)
+        && (record_ptr - index->data) + record.record_size <= index->header->data_capacity);
+    for_count(i, IMG_STR_COUNT)
+    {
+      valid = valid && ((u64)record.string_offsets[i] + record.string_sizes[i] <= strings_size);
+    }
+
+    if(valid)
+    {
+      // Nothing gets allocated without strings, since only a nonzero size marks file_header_data to be freed.
+      u8* strings = 0;
+      if(strings_size)
+      {
+        strings = malloc_array(strings_size, u8);
+        memcpy(strings, record_ptr + sizeof(record), strings_size);
+      }
+
+      __sync_synchronize();
+      if(is_cache_file_record_intact(index, data_pos))
+      {
+        img->file_header_data.data = strings;
+        img->file_header_data.size = strings_size;
+        for_count(i, IMG_STR_COUNT)
+        {
+          if(record.string_sizes[i])
+          {
+            img->parameter_strings[i].data = strings + record.string_offsets[i];
+            img->parameter_strings[i].size = record.string_sizes[i];
+          }
+        }
+        for_count(i, PARSED_R32_COUNT)
+        {
+          img->parsed_r32s[i] = record.parsed_r32s[i];
+        }
+
+        if(record.w && record.h)
+        {
+          __sync_bool_compare_and_swap(&img->w, 0, record.w);
+          __sync_bool_compare_and_swap(&img->h, 0, record.h);
+          __sync_bool_compare_and_swap(&img->bytes_used, 0, 4 * (i64)record.w * record.h);
+        }
+
+        result = true;
+      }
+      else
+      {
+        // Got overwritten while copying.
+        free(strings);
+      }
+    }
+  }
+
+  return result;
+}
+
+internal void store_indexed_metadata(cache_file_t* index, img_entry_t* img, u64 path_hash)
+{
+  metadata_index_record_t record = {0};
+  record.path_hash = path_hash;
+  record.modified_at_nsecs = timespec_to_nsecs(img->modified_at_time);
+  record.filesize = img->filesize;
+  record.parser_version = METADATA_PARSER_VERSION;
+  record.w = img->w;
+  record.h = img->h;
+  for_count(i, PARSED_R32_COUNT)
+  {
+    record.parsed_r32s[i] = img->parsed_r32s[i];
+  }
+
+  // Going from the longest string down, every string either lies within one that is
+  // stored already, or gets stored after them.
+  i32 str_idxs_by_size[IMG_STR_COUNT];
+  for_count(i, IMG_STR_COUNT)
+  {
+    i32 j = i;
+    for(;
+        j > 0 && img->parameter_strings[str_idxs_by_size[j - 1]].size < img->parameter_strings[i].size;
+        --j)
+    {
+      str_idxs_by_size[j] = str_idxs_by_size[j - 1];
+    }
+    str_idxs_by_size[j] = i;
+  }
+
+  b32 stored[IMG_STR_COUNT] = {0};
+  u64 strings_size = 0;
+  for_count(i, IMG_STR_COUNT)
+  {
+    i32 str_idx = str_idxs_by_size[i];
+    str_t str = img->parameter_strings[str_idx];
+    record.string_sizes[str_idx] = str.size;
+    record.string_offsets[str_idx] = strings_size;
+    stored[str_idx] = (str.size > 0);
+
+    for_count(j, i)
+    {
+      i32 outer_idx = str_idxs_by_size[j];
+      str_t outer = img->parameter_strings[outer_idx];
+      if(stored[str_idx] && stored[outer_idx] && str.data >= outer.data && str.data + str.size <= outer.data + outer.size)
+      {
+        record.string_offsets[str_idx] = record.string_offsets[outer_idx] + (str.data - outer.data);
+        stored[str_idx] = false;
+        break;
+      }
+    }
+
+    if(stored[str_idx])
+    {
+      strings_size += str.size;
+    }
+  }
+
+  record.record_size = sizeof(record) + strings_size;
+  u64 data_pos = 0;
+  u8* record_ptr = reserve_cache_file_record(index, record.record_size, &data_pos);
+  if(record_ptr)
+  {
+    memcpy(record_ptr, &record, sizeof(record));
+    for_count(str_idx, IMG_STR_COUNT)
+    {
+      if(stored[str_idx])
+      {
+        memcpy(record_ptr + sizeof(record) + record.string_offsets[str_idx],
+            img->parameter_strings[str_idx].data, record.string_sizes[str_idx]);
+      }
+    }
+    publish_cache_file_record(index, path_hash, data_pos);
+  }
+}
+
+internal void load_img_metadata(state_t* state, img_entry_t* img, comfyui_graph_t* comfyui_graph)
+{
+  u32 load_generation = img->load_generation;
+
+  if(!(img->flags & IMG_FLAG_UNUSED) && load_generation != img->metadata_generation)
+  {
+    if(img->parameter_strings[IMG_STR_ANNOTATION].size)
+    {
+      // This was allocated and read from a separate file.
+      free(img->parameter_strings[IMG_STR_ANNOTATION].data);
+      zero_struct(img->parameter_strings[IMG_STR_ANNOTATION]);
+    }
+
+    if(img->file_header_data.size)
+    {
+      zero_struct(img->parameter_strings);
+      free(img->file_header_data.data);
+      zero_struct(img->file_header_data);
+    }
+
+    // Annotations come from another file, which the index doesn't keep track of.
+    b32 use_index = (state->metadata_index.header && !img->annotation_path.size);
+    u64 path_hash = 0;
+    int fd = -1;
+    if(use_index)
+    {
+      path_hash = hash_path_for_cache((char*)img->path.data);
+    }
+    if(!use_index || !load_indexed_metadata(&state->metadata_index, img, path_hash))
+    {
+      fd = open((char*)img->path.data, O_RDONLY);
+    }
+
+    if(fd != -1)
+    {
+      b32 read_successfully = read_png_metadata_chunks(fd, &img->file_header_data);
+      close(fd);
+      if(read_successfully)
+      {
+        // Look for PNG metadata.
+        if(img->file_header_data.size >= 16)
+        {
+          u8* ptr = img->file_header_data.data;
+          u8* file_end = img->file_header_data.data + img->file_header_data.size;
+          b32 bad = false;
+
+          // https://www.w3.org/TR/2003/REC-PNG-20031110/#5PNG-file-signature
+          bad |= (*ptr++ != 0x89);
+          bad |= (*ptr++ != 'P');
+          bad |= (*ptr++ != 'N');
+          bad |= (*ptr++ != 'G');
+          bad |= (*ptr++ != 0x0d);
+          bad |= (*ptr++ != 0x0a);
+          bad |= (*ptr++ != 0x1a);
+          bad |= (*ptr++ != 0x0a);
+
+          while(!bad)
+          {
+            // Convert big-endian to little-endian.
+            u32 chunk_size = 0;
+            chunk_size |= *ptr++; chunk_size <<= 8;
+            chunk_size |= *ptr++; chunk_size <<= 8;
+            chunk_size |= *ptr++; chunk_size <<= 8;
+            chunk_size |= *ptr++;
+
+            u8* value_end = ptr + 4 + chunk_size;
+            if(value_end > file_end)
+            {
+              bad = true;
+            }
+            else
+            {
+              b32 IHDR_header = (ptr[0] == 'I' && ptr[1] == 'H' && ptr[2] == 'D' && ptr[3] == 'R');
+              b32 tEXt_header = (ptr[0] == 't' && ptr[1] == 'E' && ptr[2] == 'X' && ptr[3] == 't');
+              b32 iTXt_header = (ptr[0] == 'i' && ptr[1] == 'T' && ptr[2] == 'X' && ptr[3] == 't');
+
+              // https://www.w3.org/TR/2003/REC-PNG-20031110/#11IHDR
+              if(IHDR_header)
+              {
+                if(chunk_size >= 8)
+                {
+                  u8* p = ptr + 4;
+
+                  u32 w = 0;
+                  w |= *p++; w <<= 8;
+                  w |= *p++; w <<= 8;
+                  w |= *p++; w <<= 8;
+                  w |= *p++;
+
+                  u32 h = 0;
+                  h |= *p++; h <<= 8;
+                  h |= *p++; h <<= 8;
+                  h |= *p++; h <<= 8;
+                  h |= *p++;
+
+                  i64 bytes_used = 4 * w * h;
+
+                  // Use atomic compare-exchange to make sure that the other
+                  // loader threads have precedence on setting these fields.
+                  __sync_bool_compare_and_swap(&img->w, 0, w);
+                  __sync_bool_compare_and_swap(&img->h, 0, h);
+                  __sync_bool_compare_and_swap(&img->bytes_used, 0, bytes_used);
+
+                  // printf("%.*s: %d x %d\n", PF_STR(img->path), w, h);
+                }
+              }
+              else if(tEXt_header || iTXt_header) // https://www.w3.org/TR/2003/REC-PNG-20031110/#11tEXt
+              {
+                u8* key_start = ptr + 4;
+
+                i32 key_len = 0;
+                while(key_start[key_len] != 0 && key_start + key_len + 1 < value_end)
+                {
+                  ++key_len;
+                }
+
+                u8* value_start = key_start + key_len + 1;
+                // https://www.w3.org/TR/2003/REC-PNG-20031110/#11iTXt
+                if(iTXt_header)
+                {
+                  value_start += 2;
+                  while(*value_start) { ++value_start; }
+                  ++value_start;
+                  while(*value_start) { ++value_start; }
+                  ++value_start;
+                }
+
+                str_t key = { key_start, key_len };
+                str_t value = str_from_span(value_start, value_end);
+                // printf("tEXt: %.*s: %.*s\n", (int)key.size, key.data, (int)value.size, value.data);
+
+                if(str_eq_zstr(key, "prompt"))
+                {
+                  parse_comfyui_prompt(img, comfyui_graph, value_start, value_end);
+                }
+                else if(str_eq_zstr(key, "parameters"))
+                {
+                  // AUTOMATIC1111/stable-diffusion-webui.
+                  // Be careful with newlines and misleading labels in the
+                  // positive and negative prompts; use the last found keywords.
+
+                  u8* p = value_start;
+                  u8* negative_prompt_label_start = 0;
+                  u8* steps_label_start = value_end;
+
+                  while(p < value_end)
+                  {
+                    u8* p_prev = p;
+                    if(0) {}
+                    else if(advance_if_prefix_matches(&p, value_end, "\nNegative prompt: "))
+                    {
+                      negative_prompt_label_start = p_prev;
+                      img->parameter_strings[IMG_STR_NEGATIVE_PROMPT].data = p;
+                    }
+                    else if(advance_if_prefix_matches(&p, value_end, "\nSteps: "))
+                    {
+                      steps_label_start = p_prev;
+                      img->parameter_strings[IMG_STR_SAMPLING_STEPS].data = p;
+                    }
+
+                    ++p;
+                  }
+
+                  if(negative_prompt_label_start)
+                  {
+                    img->parameter_strings[IMG_STR_POSITIVE_PROMPT] = str_from_span(value_start, negative_prompt_label_start);
+                  }
+                  else
+                  {
+                    img->parameter_strings[IMG_STR_POSITIVE_PROMPT] = str_from_span(value_start, steps_label_start);
+                  }
+
+                  if(img->parameter_strings[IMG_STR_NEGATIVE_PROMPT].data)
+                  {
+                    img->parameter_strings[IMG_STR_NEGATIVE_PROMPT].size = steps_label_start - img->parameter_strings[IMG_STR_NEGATIVE_PROMPT].data;
+                  }
+
+                  p = steps_label_start;
+
+                  while(p < value_end)
+                  {
+                    u8* p_prev = p;
+                    if(0) {}
+                    else if(advance_if_prefix_matches(&p, value_end, "Steps: "))
+                    {
+                      str_t v = {p};
+                      while(p < value_end && *p != ',') { ++p; }
+                      v.size = p - v.data;
+
+                      img->parameter_strings[IMG_STR_SAMPLING_STEPS] = v;
+                    }
+                    else if(advance_if_prefix_matches(&p, value_end, "Sampler: "))
+                    {
+                      str_t v = {p};
+                      while(p < value_end && *p != ',') { ++p; }
+                      v.size = p - v.data;
+
+                      img->parameter_strings[IMG_STR_SAMPLER] = v;
+                    }
+                    else if(advance_if_prefix_matches(&p, value_end, "CFG scale: "))
+                    {
+                      str_t v = {p};
+                      while(p < value_end && *p != ',') { ++p; }
+                      v.size = p - v.data;
+
+                      img->parameter_strings[IMG_STR_CFG] = v;
+                    }
+                    else if(advance_if_prefix_matches(&p, value_end, "Seed: "))
+                    {
+                      str_t v = {p};
+                      while(p < value_end && *p != ',') { ++p; }
+                      v.size = p - v.data;
+
+                      img->parameter_strings[IMG_STR_SEED] = v;
+                    }
+                    else if(advance_if_prefix_matches(&p, value_end, "Model: "))
+                    {
+                      str_t v = {p};
+                      while(p < value_end && *p != ',') { ++p; }
+                      v.size = p - v.data;
+
+                      img->parameter_strings[IMG_STR_MODEL] = v;
+                    }
+                    else if(advance_if_prefix_matches(&p, value_end, "Score: "))
+                    {
+                      str_t v = {p};
+                      while(p < value_end && *p != ',') { ++p; }
+                      v.size = p - v.data;
+
+                      img->parameter_strings[IMG_STR_SCORE] = v;
+                    }
+
+                    ++p;
+                  }
+                }
+
+                if(!img->parameter_strings[IMG_STR_GENERATION_PARAMETERS].size)
+                {
+                  img->parameter_strings[IMG_STR_GENERATION_PARAMETERS] = value;
+                }
+
+                // Parse r32 values.
+                struct
+                {
+                  img_str_t str_idx;
+                  parsed_r32_t parsed_idx;
+                } parse_tasks[] = {
+                  { IMG_STR_SAMPLING_STEPS, PARSED_R32_SAMPLING_STEPS },
+                  { IMG_STR_CFG,            PARSED_R32_CFG },
+                  { IMG_STR_SCORE,          PARSED_R32_SCORE },
+                };
+                for_count(task_idx, array_count(parse_tasks))
+                {
+                  str_t param_str = img->parameter_strings[parse_tasks[task_idx].str_idx];
+                  r32* parsed_ptr = &img->parsed_r32s[parse_tasks[task_idx].parsed_idx];
+                  if(param_str.size > 0)
+                  {
+                    *parsed_ptr = parse_r32(param_str);
+                    // printf("[%d]: \"%.*s\" -> %f\n", parse_tasks[task_idx].parsed_idx, PF_STR(param_str), *parsed_ptr);
+                  }
+                }
+              }
+            }
+
+            ptr += 4 + chunk_size + 4;
+
+            bad |= (ptr + 8 >= file_end);
+          }
+        }
+
+#if 0
+        printf("\n%.*s\n", PF_STR(img->path));
+#define P(x) printf("  " #x ": (%d) %.*s\n", (int)img->parameter_strings[x].size, PF_STR(img->parameter_strings[x]));
+        P(IMG_STR_GENERATION_PARAMETERS);
+        P(IMG_STR_POSITIVE_PROMPT);
+        P(IMG_STR_NEGATIVE_PROMPT);
+        P(IMG_STR_SEED);
+        P(IMG_STR_BATCH_SIZE);
+        P(IMG_STR_MODEL);
+        P(IMG_STR_SAMPLER);
+        P(IMG_STR_SAMPLING_STEPS);
+        P(IMG_STR_CFG);
+#undef P
+#endif
+
+        if(use_index)
+        {
+          store_indexed_metadata(&state->metadata_index, img, path_hash);
+        }
+      }
+
+      if(img->annotation_path.size
+          && !img->parameter_strings[IMG_STR_POSITIVE_PROMPT].size
+        )
+      {
+        img->parameter_strings[IMG_STR_POSITIVE_PROMPT] =
+          img->parameter_strings[IMG_STR_ANNOTATION] =
+          read_file((char*)img->annotation_path.data);
+      }
+    }
+
+
+    // Also when the file couldn't be read, so that the info panel stops waiting for it.
+    img->metadata_generation = load_generation;
+    __sync_fetch_and_add(&state->metadata_reload_count, 1);
+  }
+}
+
+// Call this with the metadata_mutex held.
+// Images that are still busy get skipped here;  the thread loading them
+// notices that they got queued again and loads them once more.
+internal i32 claim_img_for_metadata(state_t* state)
+{
+  i32 result = -1;
+
+  while(result == -1 && state->metadata_priority_idx < state->metadata_priority_count)
+  {
+    i32 img_idx = state->metadata_priority_img_idxs[state->metadata_priority_idx++];
+    if(img_idx >= 0 && img_idx < state->total_img_count
+        && state->img_entries[img_idx].metadata_queued
+        && !state->img_entries[img_idx].metadata_busy)
+    {
+      result = img_idx;
+    }
+  }
+
+  while(result == -1 && state->metadata_queue_idx < state->metadata_queue_count)
+  {
+    i32 img_idx = state->metadata_queue[state->metadata_queue_idx++];
+    if(state->img_entries[img_idx].metadata_queued
+        && !state->img_entries[img_idx].metadata_busy)
+    {
+      result = img_idx;
+    }
+  }
+
+  if(state->metadata_queue_idx == state->metadata_queue_count)
+  {
+    state->metadata_queue_idx = 0;
+    state->metadata_queue_count = 0;
+  }
+
+  if(result != -1)
+  {
+    state->img_entries[result].metadata_queued = false;
+    state->img_entries[result].metadata_busy = true;
+  }
+
+  return result;
+}
+
+internal void* metadata_loader_fun(void* raw_data)
+{
+  state_t* state = (state_t*)raw_data;
+  comfyui_graph_t* comfyui_graph = malloc_struct(comfyui_graph_t);
+
+  pthread_mutex_lock(&state->metadata_mutex);
+  for(;;)
+  {
+    i32 img_idx = claim_img_for_metadata(state);
+    if(img_idx == -1)
+    {
+      pthread_cond_wait(&state->metadata_cond, &state->metadata_mutex);
+      continue;
+    }
+
+    img_entry_t* img = &state->img_entries[img_idx];
+    do
+    {
+      img->metadata_queued = false;
+      pthread_mutex_unlock(&state->metadata_mutex);
+      load_img_metadata(state, img, comfyui_graph);
+      pthread_mutex_lock(&state->metadata_mutex);
+      ++state->metadata_loaded_count;
+    } while(img->metadata_queued);
+    img->metadata_busy = false;
+  }
+
+  return 0;
+}
+
+// Only the given images get loaded, so refreshing doesn't go over all the unchanged ones again.
+internal void queue_metadata_loads(state_t* state, i32* img_idxs, i32 img_count)
+{
+  pthread_mutex_lock(&state->metadata_mutex);
+  if(state->metadata_loaded_count == state->metadata_queued_count)
+  {
+    // Let the progress only cover what's new since everything was loaded.
+    state->metadata_loaded_count = 0;
+    state->metadata_queued_count = 0;
+  }
+  for_count(i, img_count)
+  {
+    img_entry_t* img = &state->img_entries[img_idxs[i]];
+    if(!img->metadata_queued)
+    {
+      img->metadata_queued = true;
+      ++state->metadata_queued_count;
+
+      if(state->metadata_queue_count == state->metadata_queue_capacity)
+      {
+        state->metadata_queue_capacity = max(1024, 2 * state->metadata_queue_capacity);
+        state->metadata_queue = (i32*)realloc(state->metadata_queue,
+            state->metadata_queue_capacity * sizeof(state->metadata_queue[0]));
+      }
+      state->metadata_queue[state->metadata_queue_count++] = img_idxs[i];
+    }
+  }
+  pthread_cond_broadcast(&state->metadata_cond);
+  pthread_mutex_unlock(&state->metadata_mutex);
+}
+
+// The viewed image goes first, then the visible thumbnails.
+internal void prioritize_metadata(state_t* state,
+    i32 viewing_filtered_idx, i32 first_visible_filtered_idx, i32 last_visible_filtered_idx)
+{
+  pthread_mutex_lock(&state->metadata_mutex);
+  state->metadata_priority_count = 0;
+  state->metadata_priority_idx = 0;
+  if(viewing_filtered_idx >= 0 && viewing_filtered_idx < state->filtered_img_count)
+  {
+    state->metadata_priority_img_idxs[state->metadata_priority_count++] =
+      state->filtered_img_idxs[viewing_filtered_idx];
+  }
+  for(i32 filtered_idx = max(0, first_visible_filtered_idx);
+      filtered_idx <= min(last_visible_filtered_idx, state->filtered_img_count - 1)
+      && state->metadata_priority_count < METADATA_PRIORITY_CAPACITY;
+      ++filtered_idx)
+  {
+    state->metadata_priority_img_idxs[state->metadata_priority_count++] =
+      state->filtered_img_idxs[filtered_idx];
+  }
+  pthread_cond_broadcast(&state->metadata_cond);
+  pthread_mutex_unlock(&state->metadata_mutex);
+}
+
+// Returns 0 if it didn't compile or link, after printing why.
+internal GLuint compile_shader_program(char* vertex_source, char* fragment_source)
+{
+  GLuint program = glCreateProgram();
+  char* sources[] = {vertex_source, fragment_source};
+  GLenum types[] = {GL_VERTEX_SHADER, GL_FRAGMENT_SHADER};
+  for_count(shader_idx, array_count(sources))
+  {
+    GLuint shader = glCreateShader(types[shader_idx]);
+    glShaderSource(shader, 1, (const GLchar**)&sources[shader_idx], 0);
+    glCompileShader(shader);
+
+    GLint compiled = 0;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+    if(!compiled)
+    {
+      char info_log[1024];
+      glGetShaderInfoLog(shader, sizeof(info_log), 0, info_log);
+      fprintf(stderr, "Shader did not compile:\n%s\n", info_log);
+    }
+
+    glAttachShader(program, shader);
+    glDeleteShader(shader);
+  }
+
+  glLinkProgram(program);
+  GLint linked = 0;
+  glGetProgramiv(program, GL_LINK_STATUS, &linked);
+  if(!linked)
+  {
+    char info_log[1024];
+    glGetProgramInfoLog(program, sizeof(info_log), 0, info_log);
+    fprintf(stderr, "Shader program did not link:\n%s\n", info_log);
+    glDeleteProgram(program);
+    program = 0;
+  }
+
+  return program;
+}
+
+// For the bound texture.
+internal void set_texture_sampling(state_t* state, GLenum target, b32 mipmapped)
+{
+  if(state->linear_sampling)
+  {
+    glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(target, GL_TEXTURE_MIN_FILTER, mipmapped ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+  }
+  else
+  {
+    glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(target, GL_TEXTURE_MIN_FILTER, mipmapped ? GL_NEAREST_MIPMAP_NEAREST : GL_NEAREST);
+  }
+}
+
+// Draws the quads that were pushed since the last batch, with the texture that was set for them.
+internal void flush_render_batch(state_t* state)
+{
+  i32 count = state->render_quad_count - state->render_batch_start;
+  if(count > 0)
+  {
+    glBindBuffer(GL_ARRAY_BUFFER, state->render_buffer);
+    glBufferSubData(GL_ARRAY_BUFFER, 4 * state->render_batch_start * sizeof(render_vertex_t),
+        4 * count * sizeof(render_vertex_t), state->render_vertices + 4 * state->render_batch_start);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    glUseProgram((state->render_target == GL_TEXTURE_2D_ARRAY) ? state->thumbnail_program : state->render_program);
+    glBindTexture(state->render_target, state->render_texture_id);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, state->render_index_buffer);
+    glDrawElements(GL_TRIANGLES, 6 * count, GL_UNSIGNED_SHORT, (void*)(6 * state->render_batch_start * sizeof(u16)));
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    glUseProgram(0);
+
+    state->render_batch_start = state->render_quad_count;
+  }
+}
+
+// For textures that are about to get changed or deleted, which the pending batch might still use.
+internal void flush_render_batch_using(state_t* state, GLuint texture_id)
+{
+  if(texture_id == state->render_texture_id)
+  {
+    flush_render_batch(state);
+  }
+}
+
+// Gives the buffer new storage, so the GPU can keep drawing from the old one.
+internal void orphan_render_buffer(state_t* state)
+{
+  glBindBuffer(GL_ARRAY_BUFFER, state->render_buffer);
+  glBufferData(GL_ARRAY_BUFFER, 4 * RENDER_QUAD_CAPACITY * sizeof(render_vertex_t), 0, GL_STREAM_DRAW);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  state->render_quad_count = 0;
+  state->render_batch_start = 0;
+}
+
+internal void init_renderer(state_t* state)
+{
+  state->render_vertices = malloc_array(4 * RENDER_QUAD_CAPACITY, render_vertex_t);
+  glGenBuffers(1, &state->render_buffer);
+  orphan_render_buffer(state);
+
+  u16* indices = malloc_array(6 * RENDER_QUAD_CAPACITY, u16);
+  for_count(quad, RENDER_QUAD_CAPACITY)
+  {
+    u16 corners[6] = {0, 1, 2, 0, 2, 3};
+    for_count(i, 6)
+    {
+      indices[6 * quad + i] = (u16)(4 * quad + corners[i]);
+    }
+  }
+  glGenBuffers(1, &state->render_index_buffer);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, state->render_index_buffer);
+  glBufferData(GL_ELEMENT_ARRAY_BUFFER, 6 * RENDER_QUAD_CAPACITY * sizeof(u16), indices, GL_STATIC_DRAW);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+  free(indices);
+
+  // The pointers are into the buffer, since it's bound while they get set.
+  glBindBuffer(GL_ARRAY_BUFFER, state->render_buffer);
+  glVertexPointer(2, GL_FLOAT, sizeof(render_vertex_t), (void*)offsetof(render_vertex_t, x));
+  glTexCoordPointer(3, GL_FLOAT, sizeof(render_vertex_t), (void*)offsetof(render_vertex_t, u));
+  glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(render_vertex_t), (void*)offsetof(render_vertex_t, color));
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  glEnableClientState(GL_VERTEX_ARRAY);
+  glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+  glEnableClientState(GL_COLOR_ARRAY);
+}
+
+internal void set_render_texture(state_t* state, GLenum target, GLuint texture_id)
+{
+  if(target != state->render_target || texture_id != state->render_texture_id)
+  {
+    flush_render_batch(state);
+    state->render_target = target;
+    state->render_texture_id = texture_id;
+  }
+}
+
+// Blending is always for premultiplied colors.
+internal void set_render_blend(state_t* state, b32 blend)
+{
+  if(blend != state->render_blend)
+  {
+    flush_render_batch(state);
+    state->render_blend = blend;
+    if(blend)
+    {
+      glEnable(GL_BLEND);
+    }
+    else
+    {
+      glDisable(GL_BLEND);
+    }
   }
+}
 
-  if(negative)
+internal void set_render_scissor(state_t* state, i32 x, i32 y, i32 w, i32 h)
+{
+  i32 scissor[4] = {x, y, w, h};
+  if(memcmp(scissor, state->render_scissor, sizeof(scissor)) != 0)
   {
-    result = -result;
+    flush_render_batch(state);
+    copy_bytes(sizeof(scissor), scissor, state->render_scissor);
+    glScissor(x, y, w, h);
   }
+}
 
-  return result;
+// For the vertices pushed after this, with the components not premultiplied yet.
+internal void set_render_color(state_t* state, r32 r, r32 g, r32 b, r32 a)
+{
+  r32 components[4] = {a * r, a * g, a * b, a};
+  for_count(i, 4)
+  {
+    state->render_color[i] = (u8)(clamp(0.0f, 1.0f, components[i]) * 255.0f + 0.5f);
+  }
 }
 
-internal r32 parse_r32(str_t str)
+internal void begin_render_frame(state_t* state)
 {
-  u8* start = str.data;
-  u8* end = str.data + str.size;
+  orphan_render_buffer(state);
+  state->render_target = GL_TEXTURE_2D;
+  state->render_texture_id = 0;
+  state->render_blend = true;
+  glEnable(GL_BLEND);
+  glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+  state->render_scissor[2] = -1;  // So that it gets set.
+  set_render_scissor(state, 0, 0, state->win_w, state->win_h);
+  set_render_color(state, 1.0f, 1.0f, 1.0f, 1.0f);
+}
 
-  return (r32)parse_next_r64(&start, end);
+// Out of the corners in order around the quad.
+internal void push_render_quad_corners(state_t* state, render_vertex_t* corners)
+{
+  if(state->render_quad_count == RENDER_QUAD_CAPACITY)
+  {
+    flush_render_batch(state);
+    orphan_render_buffer(state);
+  }
+  copy_bytes(4 * sizeof(render_vertex_t), corners, state->render_vertices + 4 * state->render_quad_count);
+  ++state->render_quad_count;
 }
 
-internal void* loader_fun(void* raw_data)
+// In the current color, with (u0, v0) at (x0, y0) and (u1, v1) at (x1, y1).
+internal void push_render_quad(state_t* state, r32 x0, r32 y0, r32 x1, r32 y1,
+    r32 u0, r32 v0, r32 u1, r32 v1, r32 layer)
 {
-  loader_data_t* data = (loader_data_t*)raw_data;
-  i32 thread_idx = data->thread_idx;
-  shared_loader_data_t* shared = data->shared;
+  render_vertex_t corners[4] = {
+    {x0, y0, u0, v0, layer},
+    {x1, y0, u1, v0, layer},
+    {x1, y1, u1, v1, layer},
+    {x0, y1, u0, v1, layer},
+  };
+  for_count(corner, 4)
+  {
+    copy_bytes(4, state->render_color, corners[corner].color);
+  }
+  push_render_quad_corners(state, corners);
+}
 
-  i64 loaded_count_limit = array_count(shared->loaded_imgs) - shared->total_loader_count;
-  // i64 thread_bytes_limit = shared->total_bytes_limit / shared->total_loader_count;
-  i64 thread_bytes_limit = shared->total_bytes_limit;
+// Untextured, which is the white texel of the font texture, so it goes into the same batch as text.
+internal void push_render_rect(state_t* state, r32 x0, r32 y0, r32 x1, r32 y1)
+{
+  set_render_texture(state, GL_TEXTURE_2D, state->font_texture_id);
+  push_render_quad(state, x0, y0, x1, y1,
+      state->font_white_u, state->font_white_v, state->font_white_u, state->font_white_v, 0.0f);
+}
 
-  for(;;)
+// Specifies a level of the bound texture from the pixels at offset into a pixel buffer.
+internal void upload_texture_level(state_t* state, i32 level, GLint internal_format, GLenum format,
+    i32 w, i32 h, u8* pixels, i64 offset)
+{
+  i64 arena_offset = get_upload_arena_offset(&state->shared.pixel_pool, pixels);
+  if(arena_offset >= 0)
   {
-    i32 viewing_filtered_img_idx = shared->viewing_filtered_img_idx;
-    i32 range_start_idx = shared->first_visible_thumbnail_idx;
-    i32 range_end_idx = shared->last_visible_thumbnail_idx;
-    i32 filtered_img_count = shared->filtered_img_count;
+    // Copied by the GPU in the background; release_uploaded_pixels waits for that.
+    glTexImage2D(GL_TEXTURE_2D, level, internal_format, w, h, 0, format, GL_UNSIGNED_BYTE, 0);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, state->upload_arena_buffer);
+    glTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, w, h, format, GL_UNSIGNED_BYTE, (void*)(arena_offset + offset));
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  }
+  else
+  {
+    glTexImage2D(GL_TEXTURE_2D, level, internal_format, w, h, 0, format, GL_UNSIGNED_BYTE, pixels + offset);
+  }
+}
 
-    // printf("Loader %d focus %d range_start %d range_end %d\n", thread_idx, viewing_filtered_img_idx, range_start_idx, range_end_idx);
+// Uploads a w x h region at (x, y) out of pixels that are pixels_w wide and have channel_count channels.
+// The edges are clamped rather than sampling a transparent border, since textures without alpha
+// would make that border opaque black; draw_faded_quad does the fading instead.
+internal GLuint create_texture_from_region(state_t* state, u8* pixels, i32 pixels_w, i32 channel_count,
+    i32 x, i32 y, i32 w, i32 h)
+{
+  GLuint texture_id = 0;
+  glGenTextures(1, &texture_id);
 
-    i32 max_loading_idx = min(filtered_img_count + 1, (range_end_idx - range_start_idx) + 100);
-    // i32 max_loading_idx = min(filtered_img_count + 1, 200);
-    i64 thread_bytes_used = 0;
-    for(i32 loading_idx = 0;
-        1
-        && loading_idx < max_loading_idx
-        && shared->next_loaded_img_id - shared->next_finalized_img_id < loaded_count_limit
-        ;
-        ++loading_idx)
-    {
-      if(0
-          || viewing_filtered_img_idx != shared->viewing_filtered_img_idx
-          || range_start_idx != shared->first_visible_thumbnail_idx
-          || range_end_idx != shared->last_visible_thumbnail_idx
-          || filtered_img_count != shared->filtered_img_count
-          || shared->filtered_img_count == 0
-        )
-      {
-        break;
-      }
+  glBindTexture(GL_TEXTURE_2D, texture_id);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  set_texture_sampling(state, GL_TEXTURE_2D, false);
 
-      // Load the viewed image, then the thumbnail range, then spiral around the thumbnail range.
-      i32 filtered_img_idx = 0;
-      if(loading_idx == 0)
-      {
-        filtered_img_idx = viewing_filtered_img_idx;
-      }
-      else
-      {
-        filtered_img_idx = range_start_idx + loading_idx - 1;
-        i32 extra_range_idx = filtered_img_idx - range_end_idx;
-        if(extra_range_idx > 0)
-        {
-          if(extra_range_idx % 2 == 0)
-          {
-            filtered_img_idx = range_start_idx - (extra_range_idx + 1) / 2;
-          }
-          else
-          {
-            filtered_img_idx = range_end_idx + (extra_range_idx + 1) / 2;
-          }
-        }
-        filtered_img_idx = i32_wrap_upto(filtered_img_idx, shared->filtered_img_count);
-      }
+  GLint internal_format = GL_RGBA;
+  GLenum format = GL_RGBA;
+  if(channel_count == 3)
+  {
+    internal_format = GL_RGB8;
+    format = GL_RGB;
+  }
+  else if(channel_count == 1 || channel_count == 2)
+  {
+    if(state->has_texture_swizzle)
+    {
+      // Gray is in red and alpha in green, and both get spread back out when sampling.
+      GLint gray_swizzle[] = {GL_RED, GL_RED, GL_RED, GL_ONE};
+      GLint gray_alpha_swizzle[] = {GL_RED, GL_RED, GL_RED, GL_GREEN};
+      internal_format = (channel_count == 1) ? GL_R8 : GL_RG8;
+      format = (channel_count == 1) ? GL_RED : GL_RG;
+      glTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_RGBA, (channel_count == 1) ? gray_swizzle : gray_alpha_swizzle);
+    }
+    else
+    {
+      internal_format = (channel_count == 1) ? GL_LUMINANCE8 : GL_LUMINANCE8_ALPHA8;
+      format = (channel_count == 1) ? GL_LUMINANCE : GL_LUMINANCE_ALPHA;
+    }
+  }
 
-      i32 img_idx = shared->filtered_img_idxs[filtered_img_idx];
+  i64 region_offset = channel_count * ((i64)y * pixels_w + x);
+  if(pixels_w != w)
+  {
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, pixels_w);
+  }
+  if(channel_count != 4)
+  {
+    // The rows aren't padded to four bytes.
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  }
 
-      img_entry_t* img_entry = &shared->img_entries[img_idx];
+  upload_texture_level(state, 0, internal_format, format, w, h, pixels, region_offset);
 
-      // printf("- total %ldk, thread %ldk, img %ldk\n", shared->total_bytes_used / 1024, thread_bytes_used / 1024, img_entry->bytes_used / 1024);
-      if(shared->total_bytes_used + img_entry->bytes_used > (3 * shared->total_bytes_limit) / 2
-          || thread_bytes_used + img_entry->bytes_used > thread_bytes_limit)
-      {
-        break;
-      }
+  if(pixels_w != w)
+  {
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+  }
+  if(channel_count != 4)
+  {
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+  }
 
-      u32 load_generation = img_entry->load_generation;
-      if(__sync_bool_compare_and_swap(&img_entry->load_state, LOAD_STATE_UNLOADED, LOAD_STATE_LOADING))
-      {
-        i64 loaded_img_id = __sync_fetch_and_add(&shared->next_loaded_img_id, 1);
-        loaded_img_t* loaded_img = &shared->loaded_imgs[loaded_img_id % array_count(shared->loaded_imgs)];
+  return texture_id;
+}
 
-        if(loaded_img->load_state != LOAD_STATE_UNLOADED)
-        {
-          printf("WARNING: Loaded image slot %ld was not unloaded, but will be overwritten!\n", loaded_img_id);
-        }
+internal GLuint create_img_texture(state_t* state, i32 w, i32 h, i32 channel_count, u8* pixels)
+{
+  return create_texture_from_region(state, pixels, w, channel_count, 0, 0, w, h);
+}
 
-        loaded_img->load_generation = load_generation;
-        loaded_img->entry_idx = img_idx;
+// Pixels that were just uploaded from the arena can only be reused after the GPU has read them.
+internal void release_uploaded_pixels(state_t* state, u8* pixels)
+{
+  if(get_upload_arena_offset(&state->shared.pixel_pool, pixels) >= 0)
+  {
+    if(state->pending_upload_count == state->pending_upload_capacity)
+    {
+      state->pending_upload_capacity = max(64, 2 * state->pending_upload_capacity);
+      state->pending_uploads = (pending_upload_t*)realloc(state->pending_uploads,
+          state->pending_upload_capacity * sizeof(pending_upload_t));
+    }
+    pending_upload_t* pending = &state->pending_uploads[state->pending_upload_count++];
+    pending->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    pending->pixels = pixels;
+  }
+  else
+  {
+    free_pixel_buffer(&state->shared.pixel_pool, pixels);
+  }
+}
 
-        loaded_img->bytes_used = 0;
-        i32 original_channel_count = 0;
-        loaded_img->pixels = stbi_load((char*)img_entry->path.data,  // XXX: This path string may have been freed!
-            &loaded_img->w, &loaded_img->h, &original_channel_count, 4);
+internal void free_finished_uploads(state_t* state)
+{
+  for(i32 pending_idx = 0;
+      pending_idx < state->pending_upload_count;
+      )
+  {
+    pending_upload_t* pending = &state->pending_uploads[pending_idx];
+    if(glClientWaitSync(pending->fence, 0, 0) != GL_TIMEOUT_EXPIRED)
+    {
+      glDeleteSync(pending->fence);
+      free_pixel_buffer(&state->shared.pixel_pool, pending->pixels);
+      *pending = state->pending_uploads[--state->pending_upload_count];
+    }
+    else
+    {
+      ++pending_idx;
+    }
+  }
+}
 
-        if(!loaded_img->pixels)
-        {
-          loaded_img->w = 0;
-          loaded_img->h = 0;
-        }
-        else
-        {
-          loaded_img->bytes_used = 4 * loaded_img->w * loaded_img->h;
-          __sync_fetch_and_add(&shared->total_bytes_used, loaded_img->bytes_used);
-          thread_bytes_used += loaded_img->bytes_used;
+// The first upload in a frame always goes ahead, the rest only while they fit into the budget.
+internal b32 take_upload_budget(state_t* state, i64 bytes)
+{
+  b32 result = (state->uploaded_bytes_this_frame == 0
+      || state->uploaded_bytes_this_frame + bytes <= UPLOAD_BYTES_PER_FRAME);
+  if(result)
+  {
+    state->uploaded_bytes_this_frame += bytes;
+  }
+  return result;
+}
 
-#if 1
-          if(original_channel_count == 4)
-          {
-            // Premultiply alpha.
-            // printf("Premultiplying alpha.\n");
-            for(u64 i = 0; i < (u64)loaded_img->w * (u64)loaded_img->h; ++i)
-            {
-              if(loaded_img->pixels[4*i + 3] != 255)
-              {
-                r32 r = loaded_img->pixels[4*i + 0] / 255.0f;
-                r32 g = loaded_img->pixels[4*i + 1] / 255.0f;
-                r32 b = loaded_img->pixels[4*i + 2] / 255.0f;
-                r32 a = loaded_img->pixels[4*i + 3] / 255.0f;
-
-                loaded_img->pixels[4*i + 0] = (u8)(255.0f * a * r + 0.5f);
-                loaded_img->pixels[4*i + 1] = (u8)(255.0f * a * g + 0.5f);
-                loaded_img->pixels[4*i + 2] = (u8)(255.0f * a * b + 0.5f);
-              }
-            }
-          }
-#endif
-        }
+internal void free_tile_texture(state_t* state, img_tile_t* tile)
+{
+  flush_render_batch_using(state, tile->texture_id);
+  glDeleteTextures(1, &tile->texture_id);
+  tile->texture_id = 0;
+  __sync_fetch_and_sub(&state->shared.vram_bytes_used, tile->bytes_used);
+}
 
-        __sync_synchronize();
-        loaded_img->load_state = LOAD_STATE_LOADED_INTO_RAM;
-      }
-      else
-      {
-        thread_bytes_used += img_entry->bytes_used;
-      }
+// Level 0 stays, since it's the image's own pixels.
+internal void free_tiled_img(state_t* state, tiled_img_t* tiled)
+{
+  for(i32 tile_idx = 0;
+      tile_idx < tiled->tile_count;
+      ++tile_idx)
+  {
+    if(tiled->tiles[tile_idx].texture_id)
+    {
+      free_tile_texture(state, &tiled->tiles[tile_idx]);
     }
+  }
 
-    // printf("Loader %d: Waiting on semaphore.\n", thread_idx);
-    sem_wait(data->semaphore);
-    // printf("Loader %d: Got signal!\n", thread_idx);
+  for(i32 level = 1;
+      level < tiled->level_count;
+      ++level)
+  {
+    release_uploaded_pixels(state, tiled->level_pixels[level]);
   }
 
-  return 0;
+  free(tiled->tiles);
+  free(tiled);
 }
 
-internal void* metadata_loader_fun(void* raw_data)
+internal void unload_texture(state_t* state, img_entry_t* unload)
 {
-  state_t* state = (state_t*)raw_data;
-
-  for(;;)
+  if(unload->lru_prev)
+  {
+    unload->lru_prev->lru_next = unload->lru_next;
+  }
+  else if(state->lru_first == unload)
   {
-    // printf("Metadata loader: Waiting on semaphore.\n");
-    sem_wait(&state->metadata_loader_semaphore);
-    // printf("Metadata loader: Got signal!\n");
+    state->lru_first = unload->lru_next;
+  }
 
-    state->metadata_loaded_count = 0;
+  if(unload->lru_next)
+  {
+    unload->lru_next->lru_prev = unload->lru_prev;
+  }
+  else if(state->lru_last == unload)
+  {
+    state->lru_last = unload->lru_prev;
+  }
 
-    // TODO: Prioritize loading currently viewed images,
-    //       or let the decoder threads parse the metadata too.
-    for(i32 img_idx = 0;
-        img_idx < state->total_img_count;
-        ++img_idx)
-    {
-      img_entry_t* img = &state->img_entries[img_idx];
-      u32 load_generation = img->load_generation;
-      // printf("meta %d / %d\n", img_idx, state->total_img_count);
+  unload->lru_prev = 0;
+  unload->lru_next = 0;
 
-      if(!(img->flags & IMG_FLAG_UNUSED) && load_generation != img->metadata_generation)
-      {
-        if(img->parameter_strings[IMG_STR_ANNOTATION].size)
-        {
-          // This was allocated and read from a separate file.
-          free(img->parameter_strings[IMG_STR_ANNOTATION].data);
-          zero_struct(img->parameter_strings[IMG_STR_ANNOTATION]);
-        }
+  // printf("Unloading entry %ld\n", unload - state->img_entries);
 
-        if(img->file_header_data.size)
-        {
-          zero_struct(img->parameter_strings);
-          free(img->file_header_data.data);
-          zero_struct(img->file_header_data);
-        }
+  if(unload->texture_id)
+  {
+    flush_render_batch_using(state, unload->texture_id);
+    glDeleteTextures(1, &unload->texture_id);
+    unload->texture_id = 0;
+    __sync_fetch_and_sub(&state->shared.vram_bytes_used, get_texture_bytes_used(unload->channel_count, unload->bytes_used));
+  }
 
-        int fd = open((char*)img->path.data, O_RDONLY);
-        if(fd != -1)
-        {
-          size_t bytes_to_read = 4 * 1024;
-          img->file_header_data.data = malloc_array(bytes_to_read, u8);
-          ssize_t bytes_actually_read = read(fd, img->file_header_data.data, bytes_to_read);
-          // off_t lseek_result = lseek(fd, 0, SEEK_END);
-          // if(lseek_result != -1) { img->filesize = lseek_result; }
-          close(fd);
-          if(bytes_actually_read != -1)
-          {
-            img->file_header_data.size = bytes_actually_read;
+  if(unload->tiled)
+  {
+    free_tiled_img(state, unload->tiled);
+    unload->tiled = 0;
+  }
 
-            // Look for PNG metadata.
-            if(img->file_header_data.size >= 16)
-            {
-              u8* ptr = img->file_header_data.data;
-              u8* file_end = img->file_header_data.data + img->file_header_data.size;
-              b32 bad = false;
-
-              // https://www.w3.org/TR/2003/REC-PNG-20031110/#5PNG-file-signature
-              bad |= (*ptr++ != 0x89);
-              bad |= (*ptr++ != 'P');
-              bad |= (*ptr++ != 'N');
-              bad |= (*ptr++ != 'G');
-              bad |= (*ptr++ != 0x0d);
-              bad |= (*ptr++ != 0x0a);
-              bad |= (*ptr++ != 0x1a);
-              bad |= (*ptr++ != 0x0a);
-
-              while(!bad)
-              {
-                // Convert big-endian to little-endian.
-                u32 chunk_size = 0;
-                chunk_size |= *ptr++; chunk_size <<= 8;
-                chunk_size |= *ptr++; chunk_size <<= 8;
-                chunk_size |= *ptr++; chunk_size <<= 8;
-                chunk_size |= *ptr++;
-
-                u8* value_end = ptr + 4 + chunk_size;
-                if(value_end > file_end)
-                {
-                  bad = true;
-                }
-                else
-                {
-                  b32 IHDR_header = (ptr[0] == 'I' && ptr[1] == 'H' && ptr[2] == 'D' && ptr[3] == 'R');
-                  b32 tEXt_header = (ptr[0] == 't' && ptr[1] == 'E' && ptr[2] == 'X' && ptr[3] == 't');
-                  b32 iTXt_header = (ptr[0] == 'i' && ptr[1] == 'T' && ptr[2] == 'X' && ptr[3] == 't');
+  if(unload->pixels)
+  {
+    // Tiles might have been uploaded from them.
+    release_uploaded_pixels(state, unload->pixels);
+    unload->pixels = 0;
+    __sync_fetch_and_sub(&state->shared.ram_bytes_used, unload->bytes_used);
+  }
 
-                  // https://www.w3.org/TR/2003/REC-PNG-20031110/#11IHDR
-                  if(IHDR_header)
-                  {
-                    if(chunk_size >= 8)
-                    {
-                      u8* p = ptr + 4;
+  // unload->w = 0;
+  // unload->h = 0;
 
-                      u32 w = 0;
-                      w |= *p++; w <<= 8;
-                      w |= *p++; w <<= 8;
-                      w |= *p++; w <<= 8;
-                      w |= *p++;
+  // unload->bytes_used = 0;
+  // TODO: Make sure to update the remembered bytes_used on refresh,
+  //       if it gets used for loading prediction.
 
-                      u32 h = 0;
-                      h |= *p++; h <<= 8;
-                      h |= *p++; h <<= 8;
-                      h |= *p++; h <<= 8;
-                      h |= *p++;
+  __sync_synchronize();
+  unload->load_state = LOAD_STATE_UNLOADED;
+}
 
-                      i64 bytes_used = 4 * w * h;
+internal b32 upload_img_texture(state_t* state, img_entry_t* img)
+{
+  u64 nsecs_start = get_nanoseconds();
+  // i32 num_deletions = 0;
+  i32 num_uploads = 0;
 
-                      // Use atomic compare-exchange to make sure that the other
-                      // loader threads have precedence on setting these fields.
-                      __sync_bool_compare_and_swap(&img->w, 0, w);
-                      __sync_bool_compare_and_swap(&img->h, 0, h);
-                      __sync_bool_compare_and_swap(&img->bytes_used, 0, bytes_used);
+  b32 result = false;
 
-                      // printf("%.*s: %d x %d\n", PF_STR(img->path), w, h);
-                    }
-                  }
-                  else if(tEXt_header || iTXt_header) // https://www.w3.org/TR/2003/REC-PNG-20031110/#11tEXt
-                  {
-                    u8* key_start = ptr + 4;
+  if(img->load_state == LOAD_STATE_LOADED_INTO_RAM)
+  {
+    // if(!(img->flags & IMG_FLAG_FAILED_TO_LOAD))
+    if(img->tiled)
+    {
+      // The tiles get uploaded while drawing, as they come into view.
+    }
+    else if(!img->texture_id && img->pixels && !take_upload_budget(state, img->bytes_used))
+    {
+      // Try again next frame.
+      result = true;
+    }
+    else if(!img->texture_id && img->pixels)
+    {
+      img->texture_id = create_img_texture(state, img->w, img->h, img->channel_count, img->pixels);
+      ++num_uploads;
 
-                    i32 key_len = 0;
-                    while(key_start[key_len] != 0 && key_start + key_len + 1 < value_end)
-                    {
-                      ++key_len;
-                    }
+      // The texture is the only copy from here on.
+      if(img->texture_id)
+      {
+        release_uploaded_pixels(state, img->pixels);
+        img->pixels = 0;
+        __sync_fetch_and_sub(&state->shared.ram_bytes_used, img->bytes_used);
+        __sync_fetch_and_add(&state->shared.vram_bytes_used, get_texture_bytes_used(img->channel_count, img->bytes_used));
+      }
 
-                    u8* value_start = key_start + key_len + 1;
-                    // https://www.w3.org/TR/2003/REC-PNG-20031110/#11iTXt
-                    if(iTXt_header)
-                    {
-                      value_start += 2;
-                      while(*value_start) { ++value_start; }
-                      ++value_start;
-                      while(*value_start) { ++value_start; }
-                      ++value_start;
-                    }
+      // GLint tmp = 0;
+      // printf("VRAM used: approx. %.0f MiB\n", (r64)state->vram_bytes_used / (1024.0 * 1024.0));
 
-                    str_t key = { key_start, key_len };
-                    str_t value = str_from_span(value_start, value_end);
-                    // printf("tEXt: %.*s: %.*s\n", (int)key.size, key.data, (int)value.size, value.data);
+      // glGetIntegerv(GL_GPU_MEMORY_INFO_DEDICATED_VIDMEM_NVX, &tmp);
+      // printf("  GPU_MEMORY_INFO_DEDICATED_VIDMEM_NVX:         %d kiB\n", tmp);
 
-                    if(str_eq_zstr(key, "prompt"))
-                    {
-                      // comfyanonymous/ComfyUI JSON.
-                      // TODO: Tokenize properly, or string contents might get mistaken for object keys,
-                      //       like {"seed": "tricky \"seed:"}
+      // glGetIntegerv(GL_GPU_MEMORY_INFO_TOTAL_AVAILABLE_MEMORY_NVX, &tmp);
+      // printf("  GPU_MEMORY_INFO_TOTAL_AVAILABLE_MEMORY_NVX:   %d kiB\n", tmp);
 
-                      for(u8* p = value_start;
-                          p < value_end;
-                         )
-                      {
-                        if(0) {}
-                        else if(advance_if_prefix_matches(&p, value_end, "\"seed\"")
-                            || advance_if_prefix_matches(&p, value_end, "\"noise_seed\""))
-                        {
-                          while(p < value_end && !is_digit(*p)) { ++p; }
-                          str_t v = {p};
-                          while(p < value_end && is_digit(*p)) { ++p; }
-                          v.size = p - v.data;
+      // glGetIntegerv(GL_GPU_MEMORY_INFO_CURRENT_AVAILABLE_VIDMEM_NVX, &tmp);
+      // printf("  GPU_MEMORY_INFO_CURRENT_AVAILABLE_VIDMEM_NVX: %d kiB\n", tmp);
 
-                          img->parameter_strings[IMG_STR_SEED] = v;
-                        }
-                        else if(advance_if_prefix_matches(&p, value_end, "\"steps\""))
-                        {
-                          while(p < value_end && !is_digit(*p)) { ++p; }
-                          str_t v = {p};
-                          while(p < value_end && is_digit(*p)) { ++p; }
-                          v.size = p - v.data;
+      // glGetIntegerv(GL_GPU_MEMORY_INFO_EVICTION_COUNT_NVX, &tmp);
+      // printf("  GPU_MEMORY_INFO_EVICTION_COUNT_NVX: %d\n", tmp);
 
-                          img->parameter_strings[IMG_STR_SAMPLING_STEPS] = v;
-                        }
-                        else if(advance_if_prefix_matches(&p, value_end, "\"cfg\""))
-                        {
-                          while(p < value_end && !(is_digit(*p) || *p == '.')) { ++p; }
-                          str_t v = {p};
-                          while(p < value_end && (is_digit(*p) || *p == '.')) { ++p; }
-                          v.size = p - v.data;
+      // glGetIntegerv(GL_GPU_MEMORY_INFO_EVICTED_MEMORY_NVX, &tmp);
+      // printf("  GPU_MEMORY_INFO_EVICTED_MEMORY_NVX: %d kiB\n", tmp);
+    }
+  }
+  else
+  {
+    result = true;
+  }
 
-                          img->parameter_strings[IMG_STR_CFG] = v;
-                        }
-                        else if(advance_if_prefix_matches(&p, value_end, "\"sampler_name\""))
-                        {
-                          str_t v = parse_next_json_str_destructively(&p, value_end);
-                          img->parameter_strings[IMG_STR_SAMPLER] = v;
-                        }
-                        else if(advance_if_prefix_matches(&p, value_end, "\"ckpt_name\"")
-                            || (!img->parameter_strings[IMG_STR_MODEL].size && advance_if_prefix_matches(&p, value_end, "\"unet_name\"")))
-                        {
-                          str_t v = parse_next_json_str_destructively(&p, value_end);
-                          v = str_remove_suffix(v, str(".ckpt"));
-                          v = str_remove_suffix(v, str(".safetensors"));
-                          v = str_remove_suffix(v, str(".sft"));
-                          img->parameter_strings[IMG_STR_MODEL] = v;
-                        }
-                        else if(advance_if_prefix_matches(&p, value_end, "\"batch_size\""))
-                        {
-                          while(p < value_end && !is_digit(*p)) { ++p; }
-                          str_t v = {p};
-                          while(p < value_end && is_digit(*p)) { ++p; }
-                          v.size = p - v.data;
+  if(img->texture_id || img->tiled)
+  {
+    if(!state->lru_first)
+    {
+      state->lru_first = img;
+      state->lru_last = img;
+    }
+    else
+    {
+      if(img != state->lru_first)
+      {
+        if(img == state->lru_last)
+        {
+          state->lru_last = img->lru_prev;
+        }
 
-                          img->parameter_strings[IMG_STR_BATCH_SIZE] = v;
-                        }
-                        else if(advance_if_prefix_matches(&p, value_end, "\"text\""))
-                        {
-                          str_t v = parse_next_json_str_destructively(&p, value_end);
-                          if(!img->parameter_strings[IMG_STR_POSITIVE_PROMPT].data) { img->parameter_strings[IMG_STR_POSITIVE_PROMPT] = v; }
-                          else if(!img->parameter_strings[IMG_STR_NEGATIVE_PROMPT].data) { img->parameter_strings[IMG_STR_NEGATIVE_PROMPT] = v; }
-                        }
-                        else
-                        {
-                          ++p;
-                        }
-                      }
-                    }
-                    else if(str_eq_zstr(key, "parameters"))
-                    {
-                      // AUTOMATIC1111/stable-diffusion-webui.
-                      // Be careful with newlines and misleading labels in the
-                      // positive and negative prompts; use the last found keywords.
+        if(img->lru_next)
+        {
+          img->lru_next->lru_prev = img->lru_prev;
+        }
+        if(img->lru_prev)
+        {
+          img->lru_prev->lru_next = img->lru_next;
+        }
 
-                      u8* p = value_start;
-                      u8* negative_prompt_label_start = 0;
-                      u8* steps_label_start = value_end;
+        state->lru_first->lru_prev = img;
+        img->lru_next = state->lru_first;
+        img->lru_prev = 0;
+        state->lru_first = img;
+      }
+    }
+  }
 
-                      while(p < value_end)
-                      {
-                        u8* p_prev = p;
-                        if(0) {}
-                        else if(advance_if_prefix_matches(&p, value_end, "\nNegative prompt: "))
-                        {
-                          negative_prompt_label_start = p_prev;
-                          img->parameter_strings[IMG_STR_NEGATIVE_PROMPT].data = p;
-                        }
-                        else if(advance_if_prefix_matches(&p, value_end, "\nSteps: "))
-                        {
-                          steps_label_start = p_prev;
-                          img->parameter_strings[IMG_STR_SAMPLING_STEPS].data = p;
-                        }
+#if 0
+  {
+    printf("LRU chain:");
+    img_entry_t* detected_last = 0;
+    for(img_entry_t* i = lru_first; i; i = i->lru_next)
+    {
+      printf(" %u", i->texture_id);
+      detected_last = i;
+    }
+    if(state->lru_last != detected_last) { printf(", WRONG last: %u", state->lru_last->texture_id); }
+    printf("\n");
+  }
+#endif
 
-                        ++p;
-                      }
+#if 0
+  u64 nsecs_end = get_nanoseconds();
+  u64 nsecs_taken = nsecs_end - nsecs_start;
+  if(nsecs_taken > 1 * 1000 * 1000)
+  {
+    printf("upload_img_texture took %.0f ms (%d deletions, %d uploads)\n",
+        1e-6 * (r64)nsecs_taken,
+        num_deletions,
+        num_uploads);
+  }
+#endif
 
-                      if(negative_prompt_label_start)
-                      {
-                        img->parameter_strings[IMG_STR_POSITIVE_PROMPT] = str_from_span(value_start, negative_prompt_label_start);
-                      }
-                      else
-                      {
-                        img->parameter_strings[IMG_STR_POSITIVE_PROMPT] = str_from_span(value_start, steps_label_start);
-                      }
+  return result;
+}
 
-                      if(img->parameter_strings[IMG_STR_NEGATIVE_PROMPT].data)
-                      {
-                        img->parameter_strings[IMG_STR_NEGATIVE_PROMPT].size = steps_label_start - img->parameter_strings[IMG_STR_NEGATIVE_PROMPT].data;
-                      }
+// Arrays don't get released while there are thumbnails in them, so VRAM would otherwise stay at its peak.
+internal void release_empty_thumbnail_arrays(state_t* state)
+{
+  while(state->thumbnail_array_count > 0
+      && state->thumbnail_array_used_slot_counts[state->thumbnail_array_count - 1] == 0)
+  {
+    i32 array_idx = --state->thumbnail_array_count;
+    i32 kept_count = 0;
+    for(i32 free_idx = 0;
+        free_idx < state->free_thumbnail_slot_count;
+        ++free_idx)
+    {
+      i32 slot = state->free_thumbnail_slots[free_idx];
+      if(slot / THUMBNAIL_ARRAY_LAYER_COUNT != array_idx)
+      {
+        state->free_thumbnail_slots[kept_count++] = slot;
+      }
+    }
+    state->free_thumbnail_slot_count = kept_count;
 
-                      p = steps_label_start;
+    flush_render_batch_using(state, state->thumbnail_arrays[array_idx]);
+    glDeleteTextures(1, &state->thumbnail_arrays[array_idx]);
+    state->thumbnail_arrays[array_idx] = 0;
+  }
+}
 
-                      while(p < value_end)
-                      {
-                        u8* p_prev = p;
-                        if(0) {}
-                        else if(advance_if_prefix_matches(&p, value_end, "Steps: "))
-                        {
-                          str_t v = {p};
-                          while(p < value_end && *p != ',') { ++p; }
-                          v.size = p - v.data;
+internal void unload_thumbnail(state_t* state, img_entry_t* unload)
+{
+  if(unload->thumbnail_lru_prev)
+  {
+    unload->thumbnail_lru_prev->thumbnail_lru_next = unload->thumbnail_lru_next;
+  }
+  else if(state->thumbnail_lru_first == unload)
+  {
+    state->thumbnail_lru_first = unload->thumbnail_lru_next;
+  }
 
-                          img->parameter_strings[IMG_STR_SAMPLING_STEPS] = v;
-                        }
-                        else if(advance_if_prefix_matches(&p, value_end, "Sampler: "))
-                        {
-                          str_t v = {p};
-                          while(p < value_end && *p != ',') { ++p; }
-                          v.size = p - v.data;
+  if(unload->thumbnail_lru_next)
+  {
+    unload->thumbnail_lru_next->thumbnail_lru_prev = unload->thumbnail_lru_prev;
+  }
+  else if(state->thumbnail_lru_last == unload)
+  {
+    state->thumbnail_lru_last = unload->thumbnail_lru_prev;
+  }
 
-                          img->parameter_strings[IMG_STR_SAMPLER] = v;
-                        }
-                        else if(advance_if_prefix_matches(&p, value_end, "CFG scale: "))
-                        {
-                          str_t v = {p};
-                          while(p < value_end && *p != ',') { ++p; }
-                          v.size = p - v.data;
+  unload->thumbnail_lru_prev = 0;
+  unload->thumbnail_lru_next = 0;
 
-                          img->parameter_strings[IMG_STR_CFG] = v;
-                        }
-                        else if(advance_if_prefix_matches(&p, value_end, "Seed: "))
-                        {
-                          str_t v = {p};
-                          while(p < value_end && *p != ',') { ++p; }
-                          v.size = p - v.data;
+  if(unload->thumbnail_texture_id || unload->thumbnail_pixels)
+  {
+    __sync_fetch_and_sub(&state->shared.thumbnail_bytes_used, unload->thumbnail_bytes_used);
+  }
 
-                          img->parameter_strings[IMG_STR_SEED] = v;
-                        }
-                        else if(advance_if_prefix_matches(&p, value_end, "Model: "))
-                        {
-                          str_t v = {p};
-                          while(p < value_end && *p != ',') { ++p; }
-                          v.size = p - v.data;
+  if(unload->thumbnail_texture_id && unload->thumbnail_slot >= 0)
+  {
+    state->free_thumbnail_slots[state->free_thumbnail_slot_count++] = unload->thumbnail_slot;
+    --state->thumbnail_array_used_slot_counts[unload->thumbnail_slot / THUMBNAIL_ARRAY_LAYER_COUNT];
+    release_empty_thumbnail_arrays(state);
+    unload->thumbnail_texture_id = 0;
+  }
+  else if(unload->thumbnail_texture_id)
+  {
+    flush_render_batch_using(state, unload->thumbnail_texture_id);
+    glDeleteTextures(1, &unload->thumbnail_texture_id);
+    unload->thumbnail_texture_id = 0;
+  }
 
-                          img->parameter_strings[IMG_STR_MODEL] = v;
-                        }
-                        else if(advance_if_prefix_matches(&p, value_end, "Score: "))
-                        {
-                          str_t v = {p};
-                          while(p < value_end && *p != ',') { ++p; }
-                          v.size = p - v.data;
+  if(unload->thumbnail_pixels)
+  {
+    free_pixel_buffer(&state->shared.pixel_pool, unload->thumbnail_pixels);
+    unload->thumbnail_pixels = 0;
+  }
 
-                          img->parameter_strings[IMG_STR_SCORE] = v;
-                        }
+  __sync_synchronize();
+  unload->thumbnail_load_state = LOAD_STATE_UNLOADED;
+}
 
-                        ++p;
-                      }
-                    }
+internal void touch_thumbnail_lru(state_t* state, img_entry_t* img)
+{
+  if(img != state->thumbnail_lru_first)
+  {
+    if(img == state->thumbnail_lru_last)
+    {
+      state->thumbnail_lru_last = img->thumbnail_lru_prev;
+    }
 
-                    if(!img->parameter_strings[IMG_STR_GENERATION_PARAMETERS].size)
-                    {
-                      img->parameter_strings[IMG_STR_GENERATION_PARAMETERS] = value;
-                    }
+    if(img->thumbnail_lru_next)
+    {
+      img->thumbnail_lru_next->thumbnail_lru_prev = img->thumbnail_lru_prev;
+    }
+    if(img->thumbnail_lru_prev)
+    {
+      img->thumbnail_lru_prev->thumbnail_lru_next = img->thumbnail_lru_next;
+    }
 
-                    // Parse r32 values.
-                    struct
-                    {
-                      img_str_t str_idx;
-                      parsed_r32_t parsed_idx;
-                    } parse_tasks[] = {
-                      { IMG_STR_SAMPLING_STEPS, PARSED_R32_SAMPLING_STEPS },
-                      { IMG_STR_CFG,            PARSED_R32_CFG },
-                      { IMG_STR_SCORE,          PARSED_R32_SCORE },
-                    };
-                    for_count(task_idx, array_count(parse_tasks))
-                    {
-                      str_t param_str = img->parameter_strings[parse_tasks[task_idx].str_idx];
-                      r32* parsed_ptr = &img->parsed_r32s[parse_tasks[task_idx].parsed_idx];
-                      if(param_str.size > 0)
-                      {
-                        *parsed_ptr = parse_r32(param_str);
-                        // printf("[%d]: \"%.*s\" -> %f\n", parse_tasks[task_idx].parsed_idx, PF_STR(param_str), *parsed_ptr);
-                      }
-                    }
-                  }
-                }
+    img->thumbnail_lru_prev = 0;
+    img->thumbnail_lru_next = state->thumbnail_lru_first;
+    if(state->thumbnail_lru_first)
+    {
+      state->thumbnail_lru_first->thumbnail_lru_prev = img;
+    }
+    state->thumbnail_lru_first = img;
+    if(!state->thumbnail_lru_last)
+    {
+      state->thumbnail_lru_last = img;
+    }
+  }
+}
 
-                ptr += 4 + chunk_size + 4;
+// Tiles are stored level by level, and row by row within a level.
+internal img_tile_t* get_tile(tiled_img_t* tiled, i32 level, i32 tile_x, i32 tile_y)
+{
+  i32 tile_columns = (tiled->level_w[level] + TILE_SIZE - 1) / TILE_SIZE;
+  return &tiled->tiles[tiled->level_first_tile_idx[level] + tile_y * tile_columns + tile_x];
+}
 
-                bad |= (ptr + 8 >= file_end);
-              }
-            }
+// The tile's texture holds a pixel of its neighbors on each inner side, so the seams get filtered like the rest.
+internal void get_tile_texture_rect(tiled_img_t* tiled, i32 level, i32 tile_x, i32 tile_y,
+    i32* x0, i32* y0, i32* x1, i32* y1)
+{
+  *x0 = max(0, tile_x * TILE_SIZE - 1);
+  *y0 = max(0, tile_y * TILE_SIZE - 1);
+  *x1 = min(tiled->level_w[level], (tile_x + 1) * TILE_SIZE + 1);
+  *y1 = min(tiled->level_h[level], (tile_y + 1) * TILE_SIZE + 1);
+}
 
-#if 0
-            printf("\n%.*s\n", PF_STR(img->path));
-#define P(x) printf("  " #x ": (%d) %.*s\n", (int)img->parameter_strings[x].size, PF_STR(img->parameter_strings[x]));
-            P(IMG_STR_GENERATION_PARAMETERS);
-            P(IMG_STR_POSITIVE_PROMPT);
-            P(IMG_STR_NEGATIVE_PROMPT);
-            P(IMG_STR_SEED);
-            P(IMG_STR_BATCH_SIZE);
-            P(IMG_STR_MODEL);
-            P(IMG_STR_SAMPLER);
-            P(IMG_STR_SAMPLING_STEPS);
-            P(IMG_STR_CFG);
-#undef P
-#endif
+// Returns false if the tile isn't on the GPU yet.
+internal b32 upload_tile(state_t* state, tiled_img_t* tiled, i32 level, i32 tile_x, i32 tile_y)
+{
+  img_tile_t* tile = get_tile(tiled, level, tile_x, tile_y);
+  if(!tile->texture_id)
+  {
+    i32 x0, y0, x1, y1;
+    get_tile_texture_rect(tiled, level, tile_x, tile_y, &x0, &y0, &x1, &y1);
+    i64 bytes = tiled->channel_count * (i64)(x1 - x0) * (i64)(y1 - y0);
+    if(take_upload_budget(state, bytes))
+    {
+      tile->texture_id = create_texture_from_region(state, tiled->level_pixels[level], tiled->level_w[level],
+          tiled->channel_count, x0, y0, x1 - x0, y1 - y0);
+      if(tile->texture_id)
+      {
+        tile->bytes_used = get_texture_bytes_used(tiled->channel_count, bytes);
+        __sync_fetch_and_add(&state->shared.vram_bytes_used, tile->bytes_used);
+      }
+    }
+  }
+  return tile->texture_id != 0;
+}
 
-            img->metadata_generation = load_generation;
-          }
+// Draws the render texture from (x0, y0) to (x1, y1) on screen, with (u0, v0) and (u1, v1) at those corners.
+// Each edge fades out from its given distance inside to the same distance outside, like linear
+// sampling against a transparent border would, with premultiplied vertex colors.
+internal void draw_faded_quad(state_t* state, r32 x0, r32 y0, r32 x1, r32 y1, r32 u0, r32 v0, r32 u1, r32 v1,
+    r32 fade_x0, r32 fade_y0, r32 fade_x1, r32 fade_y1)
+{
+  r32 xs[] = {x0 - fade_x0, x0 + fade_x0, x1 - fade_x1, x1 + fade_x1};
+  r32 ys[] = {y0 - fade_y0, y0 + fade_y0, y1 - fade_y1, y1 + fade_y1};
+  r32 alphas[] = {0.0f, 1.0f, 1.0f, 0.0f};
+  r32 u_per_x = (u1 - u0) / (x1 - x0);
+  r32 v_per_y = (v1 - v0) / (y1 - y0);
 
-          if(img->annotation_path.size
-              && !img->parameter_strings[IMG_STR_POSITIVE_PROMPT].size
-            )
-          {
-            img->parameter_strings[IMG_STR_POSITIVE_PROMPT] =
-              img->parameter_strings[IMG_STR_ANNOTATION] =
-              read_file((char*)img->annotation_path.data);
-          }
+  for_count(row, 3)
+  {
+    for_count(column, 3)
+    {
+      u32 corner_columns[4] = {column, column + 1, column + 1, column};
+      u32 corner_rows[4] = {row, row, row + 1, row + 1};
+      render_vertex_t corners[4];
+      for_count(corner, 4)
+      {
+        render_vertex_t* vertex = &corners[corner];
+        r32 alpha = alphas[corner_columns[corner]] * alphas[corner_rows[corner]];
+        vertex->x = xs[corner_columns[corner]];
+        vertex->y = ys[corner_rows[corner]];
+        vertex->u = u0 + (vertex->x - x0) * u_per_x;
+        vertex->v = v0 + (vertex->y - y0) * v_per_y;
+        vertex->layer = 0.0f;
+        for_count(i, 4)
+        {
+          vertex->color[i] = (u8)(alpha * state->render_color[i] + 0.5f);
         }
       }
-
-      ++state->metadata_loaded_count;
-      // usleep(200);
+      push_render_quad_corners(state, corners);
     }
   }
-
-  return 0;
 }
 
-internal void unload_texture(state_t* state, img_entry_t* unload)
+// Draws the visible tiles of the level that fits the magnification, with (x0, y0) being the image's
+// lower left corner on screen.  Tiles that aren't uploaded yet are stood in for by the last level,
+// which is a single tile.  Returns true if some tiles are still missing.
+internal b32 draw_tiled_img(state_t* state, tiled_img_t* tiled, r32 x0, r32 y0, r32 mag,
+    i32 region_x0, i32 region_y0, i32 region_w, i32 region_h, b32 border_sampling)
 {
-  if(unload->lru_prev)
+  b32 result = false;
+  i32 w = tiled->level_w[0];
+  i32 h = tiled->level_h[0];
+  r32 y1 = y0 + mag * h;
+
+  i32 overview_level = tiled->level_count - 1;
+  img_tile_t* overview_tile = 0;
+  if(tiled->level_first_tile_idx[overview_level] + 1 == tiled->tile_count
+      && upload_tile(state, tiled, overview_level, 0, 0))
   {
-    unload->lru_prev->lru_next = unload->lru_next;
+    overview_tile = get_tile(tiled, overview_level, 0, 0);
+    overview_tile->last_drawn_frame = state->frame_number;
   }
-  else if(state->lru_first == unload)
+
+  // The finest level that doesn't need more than one texel per screen pixel.
+  i32 level = 0;
+  while(level < overview_level && mag * (r32)(1 << (level + 1)) <= 1.0f)
   {
-    state->lru_first = unload->lru_next;
+    ++level;
   }
 
-  if(unload->lru_next)
+  i32 level_w = tiled->level_w[level];
+  i32 level_h = tiled->level_h[level];
+  r32 level_scale_x = (r32)w / (r32)level_w;
+  r32 level_scale_y = (r32)h / (r32)level_h;
+  i32 tile_columns = (level_w + TILE_SIZE - 1) / TILE_SIZE;
+  i32 tile_rows = (level_h + TILE_SIZE - 1) / TILE_SIZE;
+
+  r32 visible_x0 = (region_x0 - x0) / (mag * level_scale_x);
+  r32 visible_x1 = (region_x0 + region_w - x0) / (mag * level_scale_x);
+  r32 visible_y0 = (y1 - (region_y0 + region_h)) / (mag * level_scale_y);
+  r32 visible_y1 = (y1 - region_y0) / (mag * level_scale_y);
+  i32 first_tile_x = (i32)clamp(0.0f, (r32)tile_columns, floorf(visible_x0 / TILE_SIZE));
+  i32 end_tile_x   = (i32)clamp(0.0f, (r32)tile_columns, floorf(visible_x1 / TILE_SIZE) + 1);
+  i32 first_tile_y = (i32)clamp(0.0f, (r32)tile_rows,    floorf(visible_y0 / TILE_SIZE));
+  i32 end_tile_y   = (i32)clamp(0.0f, (r32)tile_rows,    floorf(visible_y1 / TILE_SIZE) + 1);
+
+  for(i32 tile_y = first_tile_y;
+      tile_y < end_tile_y;
+      ++tile_y)
   {
-    unload->lru_next->lru_prev = unload->lru_prev;
+    for(i32 tile_x = first_tile_x;
+        tile_x < end_tile_x;
+        ++tile_x)
+    {
+      i32 inner_x0 = tile_x * TILE_SIZE;
+      i32 inner_y0 = tile_y * TILE_SIZE;
+      i32 inner_x1 = min(level_w, inner_x0 + TILE_SIZE);
+      i32 inner_y1 = min(level_h, inner_y0 + TILE_SIZE);
+
+      r32 qx0 = x0 + mag * level_scale_x * inner_x0;
+      r32 qx1 = x0 + mag * level_scale_x * inner_x1;
+      r32 qy_top    = y1 - mag * level_scale_y * inner_y0;
+      r32 qy_bottom = y1 - mag * level_scale_y * inner_y1;
+
+      GLuint texture_id = 0;
+      r32 u0 = 0.0f;
+      r32 v0 = 0.0f;
+      r32 u1 = 1.0f;
+      r32 v1 = 1.0f;
+      if(upload_tile(state, tiled, level, tile_x, tile_y))
+      {
+        img_tile_t* tile = get_tile(tiled, level, tile_x, tile_y);
+        tile->last_drawn_frame = state->frame_number;
+        texture_id = tile->texture_id;
+
+        i32 tex_x0, tex_y0, tex_x1, tex_y1;
+        get_tile_texture_rect(tiled, level, tile_x, tile_y, &tex_x0, &tex_y0, &tex_x1, &tex_y1);
+        u0 = (r32)(inner_x0 - tex_x0) / (r32)(tex_x1 - tex_x0);
+        u1 = (r32)(inner_x1 - tex_x0) / (r32)(tex_x1 - tex_x0);
+        v0 = (r32)(inner_y0 - tex_y0) / (r32)(tex_y1 - tex_y0);
+        v1 = (r32)(inner_y1 - tex_y0) / (r32)(tex_y1 - tex_y0);
+      }
+      else
+      {
+        result = true;
+        if(overview_tile)
+        {
+          texture_id = overview_tile->texture_id;
+          u0 = (r32)inner_x0 / (r32)level_w;
+          u1 = (r32)inner_x1 / (r32)level_w;
+          v0 = (r32)inner_y0 / (r32)level_h;
+          v1 = (r32)inner_y1 / (r32)level_h;
+        }
+      }
+
+      if(texture_id)
+      {
+        // Only the image's own edges fade, the tiles overlap at the others.
+        r32 fade_x = (border_sampling && state->linear_sampling) ? 0.5f * mag * level_scale_x : 0.0f;
+        r32 fade_y = (border_sampling && state->linear_sampling) ? 0.5f * mag * level_scale_y : 0.0f;
+        set_render_texture(state, GL_TEXTURE_2D, texture_id);
+        draw_faded_quad(state, qx0, qy_bottom, qx1, qy_top, u0, v1, u1, v0,
+            (inner_x0 == 0) ? fade_x : 0.0f, (inner_y1 == level_h) ? fade_y : 0.0f,
+            (inner_x1 == level_w) ? fade_x : 0.0f, (inner_y0 == 0) ? fade_y : 0.0f);
+      }
+    }
   }
-  else if(state->lru_last == unload)
+
+  // The viewed image is never evicted as a whole, so its tiles that went out of view have to go instead.
+  if(state->shared.vram_bytes_used > state->shared.vram_bytes_limit)
   {
-    state->lru_last = unload->lru_prev;
+    for(i32 tile_idx = 0;
+        tile_idx < tiled->tile_count;
+        ++tile_idx)
+    {
+      img_tile_t* tile = &tiled->tiles[tile_idx];
+      if(tile->texture_id && tile->last_drawn_frame != state->frame_number)
+      {
+        free_tile_texture(state, tile);
+      }
+    }
   }
 
-  unload->lru_prev = 0;
-  unload->lru_next = 0;
-
-  // printf("Unloading entry %ld\n", unload - state->img_entries);
+  return result;
+}
 
-  if(unload->texture_id)
+// Uploads the rows of the image's preview that got decoded since the last frame.
+// The texture stays around until the image changes, so pass 0 once the full image is there.
+internal GLuint update_preview_texture(state_t* state, img_entry_t* img)
+{
+  preview_t* shown = &state->shown_preview;
+  i32 img_idx = img ? (i32)(img - state->img_entries) : -1;
+  if(state->preview_texture_id
+      && (!img || shown->img_idx != img_idx || shown->load_generation != img->load_generation))
   {
-    glDeleteTextures(1, &unload->texture_id);
-    unload->texture_id = 0;
+    flush_render_batch_using(state, state->preview_texture_id);
+    glDeleteTextures(1, &state->preview_texture_id);
+    state->preview_texture_id = 0;
   }
 
-  if(unload->pixels)
+  if(img)
   {
-    stbi_image_free(unload->pixels);
-    unload->pixels = 0;
-    __sync_fetch_and_sub(&state->shared.total_bytes_used, unload->bytes_used);
-  }
+    preview_t* preview = &state->shared.preview;
+    pthread_mutex_lock(&preview->mutex);
+    if(preview->img_idx == img_idx && preview->load_generation == img->load_generation && preview->row_count > 0)
+    {
+      if(state->preview_texture_id && (shown->pixels != preview->pixels || shown->row_count > preview->row_count))
+      {
+        // The image started loading over again.
+        flush_render_batch_using(state, state->preview_texture_id);
+        glDeleteTextures(1, &state->preview_texture_id);
+        state->preview_texture_id = 0;
+      }
 
-  // unload->w = 0;
-  // unload->h = 0;
+      if(!state->preview_texture_id)
+      {
+        shown->img_idx = preview->img_idx;
+        shown->load_generation = preview->load_generation;
+        shown->img_w = preview->img_w;
+        shown->img_h = preview->img_h;
+        shown->w = preview->w;
+        shown->h = preview->h;
+        shown->row_count = 0;
+        shown->pixels = preview->pixels;
+
+        glGenTextures(1, &state->preview_texture_id);
+        glBindTexture(GL_TEXTURE_2D, state->preview_texture_id);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        set_texture_sampling(state, GL_TEXTURE_2D, false);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, shown->w, shown->h, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+      }
 
-  // unload->bytes_used = 0;
-  // TODO: Make sure to update the remembered bytes_used on refresh,
-  //       if it gets used for loading prediction.
+      i32 new_row_count = preview->row_count - shown->row_count;
+      if(new_row_count > 0 && take_upload_budget(state, 4 * (i64)shown->w * new_row_count))
+      {
+        glBindTexture(GL_TEXTURE_2D, state->preview_texture_id);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, shown->row_count, shown->w, new_row_count, GL_RGBA, GL_UNSIGNED_BYTE,
+            preview->pixels + 4 * (u64)shown->row_count * shown->w);
+        shown->row_count = preview->row_count;
+      }
+    }
+    pthread_mutex_unlock(&preview->mutex);
+  }
 
-  __sync_synchronize();
-  unload->load_state = LOAD_STATE_UNLOADED;
+  return state->preview_texture_id;
 }
 
-internal b32 upload_img_texture(state_t* state, img_entry_t* img)
+// Returns -1 if there's no room for another array, and the least recently drawn thumbnails don't have slots either.
+internal i32 alloc_thumbnail_slot(state_t* state, img_entry_t* img)
 {
-  u64 nsecs_start = get_nanoseconds();
-  // i32 num_deletions = 0;
-  i32 num_uploads = 0;
-
-  b32 result = false;
+  if(!state->free_thumbnail_slot_count && state->thumbnail_program
+      && state->thumbnail_array_count < MAX_THUMBNAIL_ARRAY_COUNT)
+  {
+    GLuint array_id = 0;
+    glGenTextures(1, &array_id);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, array_id);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    i32 level_count = get_mip_level_count(THUMBNAIL_SIZE, THUMBNAIL_SIZE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, level_count - 1);
+    set_texture_sampling(state, GL_TEXTURE_2D_ARRAY, true);
+    for(i32 level = 0;
+        level < level_count;
+        ++level)
+    {
+      glTexImage3D(GL_TEXTURE_2D_ARRAY, level, GL_RGBA8, THUMBNAIL_SIZE >> level, THUMBNAIL_SIZE >> level,
+          THUMBNAIL_ARRAY_LAYER_COUNT, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+    }
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    i32 array_idx = state->thumbnail_array_count++;
+    state->thumbnail_arrays[array_idx] = array_id;
+    state->thumbnail_array_used_slot_counts[array_idx] = 0;
+    for(i32 layer = THUMBNAIL_ARRAY_LAYER_COUNT - 1;
+        layer >= 0;
+        --layer)
+    {
+      state->free_thumbnail_slots[state->free_thumbnail_slot_count++] = array_idx * THUMBNAIL_ARRAY_LAYER_COUNT + layer;
+    }
+  }
 
-  if(img->load_state == LOAD_STATE_LOADED_INTO_RAM)
+  img_entry_t* unload = state->thumbnail_lru_last;
+  while(!state->free_thumbnail_slot_count && unload)
   {
-    // if(!(img->flags & IMG_FLAG_FAILED_TO_LOAD))
-    if(!img->texture_id && img->pixels)
+    img_entry_t* next_unload = unload->thumbnail_lru_prev;
+    if(unload != img)
     {
-      glGenTextures(1, &img->texture_id);
+      unload_thumbnail(state, unload);
+    }
+    unload = next_unload;
+  }
 
-      glBindTexture(GL_TEXTURE_2D, img->texture_id);
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
-      if(state->linear_sampling)
-      {
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-      }
-      else
+  // The lowest free slot, so that the arrays at the end empty out and can be released.
+  i32 result = -1;
+  if(state->free_thumbnail_slot_count)
+  {
+    i32 lowest_idx = 0;
+    for(i32 free_idx = 1;
+        free_idx < state->free_thumbnail_slot_count;
+        ++free_idx)
+    {
+      if(state->free_thumbnail_slots[free_idx] < state->free_thumbnail_slots[lowest_idx])
       {
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        lowest_idx = free_idx;
       }
-      glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, img->w, img->h, 0, GL_RGBA, GL_UNSIGNED_BYTE, img->pixels);
-      ++num_uploads;
+    }
+    result = state->free_thumbnail_slots[lowest_idx];
+    state->free_thumbnail_slots[lowest_idx] = state->free_thumbnail_slots[--state->free_thumbnail_slot_count];
+    ++state->thumbnail_array_used_slot_counts[result / THUMBNAIL_ARRAY_LAYER_COUNT];
+  }
+  return result;
+}
 
-      // GLint tmp = 0;
-      // printf("VRAM used: approx. %.0f MiB\n", (r64)state->vram_bytes_used / (1024.0 * 1024.0));
+// For RGBA pixels that are followed by their mip levels, as filled in by make_mips.
+internal GLuint create_mipmapped_texture(state_t* state, i32 w, i32 h, u8* pixels)
+{
+  GLuint texture_id = 0;
+  glGenTextures(1, &texture_id);
 
-      // glGetIntegerv(GL_GPU_MEMORY_INFO_DEDICATED_VIDMEM_NVX, &tmp);
-      // printf("  GPU_MEMORY_INFO_DEDICATED_VIDMEM_NVX:         %d kiB\n", tmp);
+  glBindTexture(GL_TEXTURE_2D, texture_id);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, get_mip_level_count(w, h) - 1);
+  set_texture_sampling(state, GL_TEXTURE_2D, true);
+
+  i64 offset = 0;
+  i32 level = 0;
+  for(;;)
+  {
+    upload_texture_level(state, level, GL_RGBA, GL_RGBA, w, h, pixels, offset);
+    if(w == 1 && h == 1)
+    {
+      break;
+    }
+    offset += 4 * (i64)w * h;
+    w = max(1, w / 2);
+    h = max(1, h / 2);
+    ++level;
+  }
 
-      // glGetIntegerv(GL_GPU_MEMORY_INFO_TOTAL_AVAILABLE_MEMORY_NVX, &tmp);
-      // printf("  GPU_MEMORY_INFO_TOTAL_AVAILABLE_MEMORY_NVX:   %d kiB\n", tmp);
+  return texture_id;
+}
 
-      // glGetIntegerv(GL_GPU_MEMORY_INFO_CURRENT_AVAILABLE_VIDMEM_NVX, &tmp);
-      // printf("  GPU_MEMORY_INFO_CURRENT_AVAILABLE_VIDMEM_NVX: %d kiB\n", tmp);
+// Copies a w x h block of RGBA pixels, which are at offset into their buffer and in rows that are row_length wide,
+// to (x, y) in a level and layer of the bound thumbnail array.
+internal void upload_thumbnail_block(state_t* state, i32 level, i32 layer, i32 x, i32 y, i32 w, i32 h,
+    u8* pixels, i64 offset, i32 row_length)
+{
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, row_length);
+  i64 arena_offset = get_upload_arena_offset(&state->shared.pixel_pool, pixels);
+  if(arena_offset >= 0)
+  {
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, state->upload_arena_buffer);
+    glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, x, y, layer, w, h, 1, GL_RGBA, GL_UNSIGNED_BYTE,
+        (void*)(arena_offset + offset));
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  }
+  else
+  {
+    glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, x, y, layer, w, h, 1, GL_RGBA, GL_UNSIGNED_BYTE, pixels + offset);
+  }
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+}
 
-      // glGetIntegerv(GL_GPU_MEMORY_INFO_EVICTION_COUNT_NVX, &tmp);
-      // printf("  GPU_MEMORY_INFO_EVICTION_COUNT_NVX: %d\n", tmp);
+// Fills a slot with the thumbnail's mip levels, as made by make_mips.  Each level gets its last column and row
+// repeated next to it, so filtering at the edges doesn't pick up what an earlier thumbnail left in the slot.
+internal void upload_thumbnail_to_slot(state_t* state, i32 slot, i32 w, i32 h, u8* pixels)
+{
+  i32 layer = slot % THUMBNAIL_ARRAY_LAYER_COUNT;
+  GLuint array_id = state->thumbnail_arrays[slot / THUMBNAIL_ARRAY_LAYER_COUNT];
+  flush_render_batch_using(state, array_id);
+  glBindTexture(GL_TEXTURE_2D_ARRAY, array_id);
+
+  i64 offset = 0;
+  i32 level_count = get_mip_level_count(THUMBNAIL_SIZE, THUMBNAIL_SIZE);
+  for(i32 level = 0;
+      level < level_count;
+      ++level)
+  {
+    i32 slot_size = THUMBNAIL_SIZE >> level;
+    upload_thumbnail_block(state, level, layer, 0, 0, w, h, pixels, offset, w);
+    if(w < slot_size)
+    {
+      upload_thumbnail_block(state, level, layer, w, 0, 1, h, pixels, offset + 4 * (w - 1), w);
+    }
+    if(h < slot_size)
+    {
+      upload_thumbnail_block(state, level, layer, 0, h, w, 1, pixels, offset + 4 * (i64)w * (h - 1), w);
+    }
+    if(w < slot_size && h < slot_size)
+    {
+      upload_thumbnail_block(state, level, layer, w, h, 1, 1, pixels, offset + 4 * ((i64)w * h - 1), w);
+    }
 
-      // glGetIntegerv(GL_GPU_MEMORY_INFO_EVICTED_MEMORY_NVX, &tmp);
-      // printf("  GPU_MEMORY_INFO_EVICTED_MEMORY_NVX: %d kiB\n", tmp);
+    // Thumbnails that are smaller than the slot repeat their last level for the slot's remaining ones.
+    if(w > 1 || h > 1)
+    {
+      offset += 4 * (i64)w * h;
+      w = max(1, w / 2);
+      h = max(1, h / 2);
     }
   }
-  else
+
+  glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+}
+
+internal void push_thumbnail_quad(state_t* state, img_entry_t* img, r32 x0, r32 y0, r32 x1, r32 y1)
+{
+  if(state->thumbnail_quad_count == state->thumbnail_quad_capacity)
   {
-    result = true;
+    state->thumbnail_quad_capacity = max(64, 2 * state->thumbnail_quad_capacity);
+    state->thumbnail_quads = (thumbnail_quad_t*)realloc(state->thumbnail_quads,
+        state->thumbnail_quad_capacity * sizeof(thumbnail_quad_t));
+  }
+  thumbnail_quad_t* quad = &state->thumbnail_quads[state->thumbnail_quad_count++];
+  quad->x0 = x0;
+  quad->y0 = y0;
+  quad->x1 = x1;
+  quad->y1 = y1;
+  quad->u1 = 1.0f;
+  quad->v1 = 1.0f;
+  if(img->thumbnail_slot >= 0)
+  {
+    quad->u1 = (r32)img->thumbnail_w / (r32)THUMBNAIL_SIZE;
+    quad->v1 = (r32)img->thumbnail_h / (r32)THUMBNAIL_SIZE;
   }
+  quad->slot = img->thumbnail_slot;
+  quad->texture_id = img->thumbnail_texture_id;
+}
 
-  if(img->texture_id)
+// One batch per array that has thumbnails in view, and one per thumbnail that isn't in an array.
+internal void draw_thumbnail_quads(state_t* state)
+{
+  for(i32 quad_idx = 0;
+      quad_idx < state->thumbnail_quad_count;
+      ++quad_idx)
   {
-    if(!state->lru_first)
+    thumbnail_quad_t* quad = &state->thumbnail_quads[quad_idx];
+    if(quad->slot < 0)
     {
-      state->lru_first = img;
-      state->lru_last = img;
+      set_render_texture(state, GL_TEXTURE_2D, quad->texture_id);
+      push_render_quad(state, quad->x0, quad->y0, quad->x1, quad->y1, 0.0f, quad->v1, quad->u1, 0.0f, 0.0f);
     }
-    else
+  }
+
+  for(i32 array_idx = 0;
+      array_idx < state->thumbnail_array_count && state->thumbnail_quad_count > 0;
+      ++array_idx)
+  {
+    for(i32 quad_idx = 0;
+        quad_idx < state->thumbnail_quad_count;
+        ++quad_idx)
     {
-      if(img != state->lru_first)
+      thumbnail_quad_t* quad = &state->thumbnail_quads[quad_idx];
+      if(quad->slot >= 0 && quad->slot / THUMBNAIL_ARRAY_LAYER_COUNT == array_idx)
       {
-        if(img == state->lru_last)
-        {
-          state->lru_last = img->lru_prev;
-        }
-
-        if(img->lru_next)
-        {
-          img->lru_next->lru_prev = img->lru_prev;
-        }
-        if(img->lru_prev)
-        {
-          img->lru_prev->lru_next = img->lru_next;
-        }
-
-        state->lru_first->lru_prev = img;
-        img->lru_next = state->lru_first;
-        img->lru_prev = 0;
-        state->lru_first = img;
+        set_render_texture(state, GL_TEXTURE_2D_ARRAY, state->thumbnail_arrays[array_idx]);
+        push_render_quad(state, quad->x0, quad->y0, quad->x1, quad->y1, 0.0f, quad->v1, quad->u1, 0.0f,
+            (r32)(quad->slot % THUMBNAIL_ARRAY_LAYER_COUNT));
       }
     }
   }
+  state->thumbnail_quad_count = 0;
+}
 
-#if 0
+// Like upload_img_texture, but for the separate thumbnail tier with its own LRU chain.
+internal b32 upload_thumbnail_texture(state_t* state, img_entry_t* img)
+{
+  b32 result = false;
+
+  if(img->thumbnail_load_state == LOAD_STATE_LOADED_INTO_RAM)
   {
-    printf("LRU chain:");
-    img_entry_t* detected_last = 0;
-    for(img_entry_t* i = lru_first; i; i = i->lru_next)
+    if(!img->thumbnail_texture_id && img->thumbnail_pixels && !take_upload_budget(state, img->thumbnail_bytes_used))
     {
-      printf(" %u", i->texture_id);
-      detected_last = i;
+      result = true;
+    }
+    else if(!img->thumbnail_texture_id && img->thumbnail_pixels && !state->thumbnail_program)
+    {
+      img->thumbnail_texture_id = create_mipmapped_texture(state, img->thumbnail_w, img->thumbnail_h,
+          img->thumbnail_pixels);
+      img->thumbnail_slot = -1;
+      release_uploaded_pixels(state, img->thumbnail_pixels);
+      img->thumbnail_pixels = 0;
+    }
+    else if(!img->thumbnail_texture_id && img->thumbnail_pixels)
+    {
+      i32 slot = alloc_thumbnail_slot(state, img);
+      if(slot >= 0)
+      {
+        upload_thumbnail_to_slot(state, slot, img->thumbnail_w, img->thumbnail_h, img->thumbnail_pixels);
+        img->thumbnail_texture_id = state->thumbnail_arrays[slot / THUMBNAIL_ARRAY_LAYER_COUNT];
+        img->thumbnail_slot = slot;
+        release_uploaded_pixels(state, img->thumbnail_pixels);
+        img->thumbnail_pixels = 0;
+      }
     }
-    if(state->lru_last != detected_last) { printf(", WRONG last: %u", state->lru_last->texture_id); }
-    printf("\n");
   }
-#endif
+  else
+  {
+    result = true;
+  }
 
-#if 0
-  u64 nsecs_end = get_nanoseconds();
-  u64 nsecs_taken = nsecs_end - nsecs_start;
-  if(nsecs_taken > 1 * 1000 * 1000)
+  if(img->thumbnail_texture_id)
   {
-    printf("upload_img_texture took %.0f ms (%d deletions, %d uploads)\n",
-        1e-6 * (r64)nsecs_taken,
-        num_deletions,
-        num_uploads);
+    touch_thumbnail_lru(state, img);
   }
-#endif
 
   return result;
 }
@@ -1728,6 +5896,8 @@ internal void refresh_input_paths(state_t* state)
 
   char** paths = malloc_array(state->total_img_capacity, char*);
   i32 path_count = 0;
+  i32* changed_img_idxs = malloc_array(state->total_img_capacity, i32);
+  i32 changed_img_count = 0;
 
   for(i32 input_path_idx = 0;
       input_path_idx < state->input_path_count;
@@ -1858,12 +6028,15 @@ internal void refresh_input_paths(state_t* state)
         if(path_changed || file_may_have_changed)
         {
           unload_texture(state, img);
+          unload_thumbnail(state, img);
           img->bytes_used = 0;
+          img->channel_count = 0;
 
           // If this image is still being loaded, it should be re-triggered by the
           // code handling the loaded image, since load_generation will differ.
           ++img->load_generation;
           img->load_state = LOAD_STATE_UNLOADED;
+          changed_img_idxs[changed_img_count++] = img_idx;
         }
 
         if(!img->random_number)
@@ -1960,8 +6133,14 @@ internal void refresh_input_paths(state_t* state)
     img->flags &= ~IMG_FLAG_FILTERED;
   }
 
-  sem_post(&state->metadata_loader_semaphore);
-  state->all_metadata_loaded = false;
+  queue_metadata_loads(state, changed_img_idxs, changed_img_count);
+  free(changed_img_idxs);
+  if(changed_img_count > 0)
+  {
+    state->all_metadata_loaded = false;
+  }
+  // Removed files are already gone from the index lists, but not from the layout.
+  state->need_to_layout = true;
 
   // u64 nsecs_end = get_nanoseconds();
   // printf("refresh: %.6f s\n", 1e-9 * (r64)(nsecs_end - nsecs_start));
@@ -1973,6 +6152,174 @@ enum
 };
 typedef u32 draw_str_flags_t;
 
+// Multiplicative, so the upper bits are the well mixed ones.
+internal u32 hash_u32(u32 x)
+{
+  return x * 2654435761u;
+}
+
+internal i32 get_codepoint_glyph(state_t* state, u32 codepoint)
+{
+  u32 mask = state->codepoint_glyph_capacity - 1;
+  u32 slot_idx = hash_u32(codepoint) & mask;
+  while(state->codepoint_glyphs[slot_idx].codepoint != codepoint
+      && state->codepoint_glyphs[slot_idx].codepoint != CODEPOINT_NONE)
+  {
+    slot_idx = (slot_idx + 1) & mask;
+  }
+
+  codepoint_glyph_t* slot = &state->codepoint_glyphs[slot_idx];
+  if(slot->codepoint == CODEPOINT_NONE)
+  {
+    slot->codepoint = codepoint;
+    slot->glyph = stbtt_FindGlyphIndex(&state->font, codepoint);
+    i32 glyph = slot->glyph;
+
+    if(2 * ++state->codepoint_glyph_count > state->codepoint_glyph_capacity)
+    {
+      // Keep it at most half full.
+      codepoint_glyph_t* old_slots = state->codepoint_glyphs;
+      i32 old_capacity = state->codepoint_glyph_capacity;
+      state->codepoint_glyph_capacity *= 2;
+      state->codepoint_glyphs = malloc_array(state->codepoint_glyph_capacity, codepoint_glyph_t);
+      mask = state->codepoint_glyph_capacity - 1;
+      for_count(i, state->codepoint_glyph_capacity)
+      {
+        state->codepoint_glyphs[i].codepoint = CODEPOINT_NONE;
+      }
+      for_count(i, old_capacity)
+      {
+        if(old_slots[i].codepoint != CODEPOINT_NONE)
+        {
+          u32 new_idx = hash_u32(old_slots[i].codepoint) & mask;
+          while(state->codepoint_glyphs[new_idx].codepoint != CODEPOINT_NONE)
+          {
+            new_idx = (new_idx + 1) & mask;
+          }
+          state->codepoint_glyphs[new_idx] = old_slots[i];
+        }
+      }
+      free(old_slots);
+    }
+    return glyph;
+  }
+
+  return slot->glyph;
+}
+
+internal glyph_info_t* get_glyph_info(state_t* state, i32 glyph)
+{
+  glyph_info_t* info = &state->glyph_infos[glyph];
+  if(!info->known)
+  {
+    stbtt_GetGlyphHMetrics(&state->font, glyph, &info->x_advance, &info->left_side_bearing);
+    stbtt_GetGlyphBitmapBox(&state->font, glyph, state->stb_font_scale, state->stb_font_scale,
+        &info->box_x0, &info->box_y0, &info->box_x1, &info->box_y1);
+
+    // Without this extra padding, some of the antialiased edges get cut off slightly.
+    info->box_x1 += 1;
+    info->box_y1 += 1;
+
+    info->known = true;
+  }
+  return info;
+}
+
+internal i32 get_kerning(state_t* state, i32 first_glyph, i32 second_glyph)
+{
+  u32 glyph_pair = ((u32)first_glyph << 16) | (u32)second_glyph;
+  kerning_entry_t* entry = &state->kerning_cache[hash_u32(glyph_pair) >> (32 - KERNING_CACHE_SIZE_LOG2)];
+  if(entry->glyph_pair != glyph_pair)
+  {
+    entry->glyph_pair = glyph_pair;
+    entry->advance = stbtt_GetGlyphKernAdvance(&state->font, first_glyph, second_glyph);
+  }
+  return entry->advance;
+}
+
+// Puts the glyph into the least recently used cell after the fixed ones, unless it has a cell already.
+internal i32 get_glyph_char_idx(state_t* state, i32 glyph, glyph_info_t* info)
+{
+  if(info->char_idx < 0)
+  {
+    i32 custom_idx = 0;
+    for_count(i, state->custom_glyph_count)
+    {
+      if(state->custom_glyph_last_used[i] < state->custom_glyph_last_used[custom_idx])
+      {
+        custom_idx = i;
+      }
+    }
+
+    if(state->custom_glyphs[custom_idx] >= 0)
+    {
+      state->glyph_infos[state->custom_glyphs[custom_idx]].char_idx = -1;
+    }
+    state->custom_glyphs[custom_idx] = glyph;
+    info->char_idx = custom_idx + state->fixed_codepoint_range_length;
+
+    i32 row = info->char_idx / state->chars_per_font_row;
+    i32 col = info->char_idx % state->chars_per_font_row;
+
+    u8* texels_start = state->font_texels + row * state->font_char_h * state->font_texture_w + col * state->font_char_w;
+    for_count(j, state->font_char_h)
+    {
+      for_count(i, state->font_char_w)
+      {
+        texels_start[j * state->font_texture_w + i] = 0;
+      }
+    }
+    stbtt_MakeGlyphBitmap(&state->font, texels_start,
+        state->font_char_w, state->font_char_h, state->font_texture_w,
+        state->stb_font_scale, state->stb_font_scale, glyph);
+    // The glyph that was there before might still be waiting to get drawn.
+    flush_render_batch(state);
+    glBindTexture(GL_TEXTURE_2D, state->font_texture_id);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, state->font_texture_w);
+    glTexSubImage2D(GL_TEXTURE_2D, 0,
+        col * state->font_char_w, row * state->font_char_h, state->font_char_w, state->font_char_h,
+        GL_LUMINANCE, GL_UNSIGNED_BYTE, texels_start);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+  }
+
+  i32 custom_idx = info->char_idx - (i32)state->fixed_codepoint_range_length;
+  if(custom_idx >= 0)
+  {
+    state->custom_glyph_last_used[custom_idx] = ++state->glyph_use_count;
+  }
+  return info->char_idx;
+}
+
+// x is the pen position on the baseline at y.
+internal void push_glyph_quad(state_t* state, i32 glyph, glyph_info_t* info,
+    r32 x_scale, r32 y_scale, r32 x, r32 y)
+{
+  i32 char_idx = get_glyph_char_idx(state, glyph, info);
+  i32 ix0 = info->box_x0;
+  i32 iy0 = info->box_y0;
+  i32 ix1 = info->box_x1;
+  i32 iy1 = info->box_y1;
+
+  r32 x_units_scale = x_scale * state->stb_font_scale / state->font_char_w;
+  r32 x0 = x + x_units_scale * (r32)info->left_side_bearing;
+  r32 x1 = x0 + x_scale * (r32)(ix1 - ix0) / (r32)state->font_char_w;
+  r32 y1 = y - y_scale * (r32)iy0 / (r32)state->font_char_h;
+  r32 y0 = y1 - y_scale * (r32)(iy1 - iy0) / (r32)state->font_char_h;
+
+  r32 u0 = (r32)(char_idx % state->chars_per_font_row) / (r32)state->chars_per_font_row;
+  r32 u1 = u0 + (r32)(ix1 - ix0) / (r32)state->font_texture_w;
+  r32 v0 = (r32)(char_idx / state->chars_per_font_row) / (r32)state->chars_per_font_col;
+  r32 v1 = v0 + (r32)(iy1 - iy0) / (r32)state->font_texture_h;
+
+  if(!state->alpha_blend)
+  {
+    // Show the glyphs' boxes.
+    u0 = u1 = state->font_white_u;
+    v0 = v1 = state->font_white_v;
+  }
+  push_render_quad(state, x0, y0, x1, y1, u0, v1, u1, v0, 0.0f);
+}
+
 internal r32 draw_str_advanced(state_t* state, draw_str_flags_t flags,
     r32 x_scale_factor, r32 y_scale, r32 start_x, r32 y, str_t str, i32* last_glyph_ptr)
 {
@@ -1984,12 +6331,12 @@ internal r32 draw_str_advanced(state_t* state, draw_str_flags_t flags,
   {
     if(!measure_only)
     {
-      glBindTexture(GL_TEXTURE_2D, state->alpha_blend ? state->font_texture_id : 0);
-      glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-      glEnable(GL_BLEND);
+      set_render_texture(state, GL_TEXTURE_2D, state->font_texture_id);
+      set_render_blend(state, true);
     }
 
     r32 x_scale = x_scale_factor * y_scale;
+    r32 x_units_scale = x_scale * state->stb_font_scale / state->font_char_w;
 
     u8* str_end = str.data + str.size;
 
@@ -2000,92 +6347,20 @@ internal r32 draw_str_advanced(state_t* state, draw_str_flags_t flags,
       u32 codepoint = decode_utf8(&str_ptr, str_end);
       if(codepoint == '\t') { codepoint = ' '; }
 
-      i32 glyph = stbtt_FindGlyphIndex(&state->font, codepoint);
-
-      i32 x_advance, left_side_bearing;
-      stbtt_GetGlyphHMetrics(&state->font, glyph, &x_advance, &left_side_bearing);
+      i32 glyph = get_codepoint_glyph(state, codepoint);
+      glyph_info_t* info = get_glyph_info(state, glyph);
 
       if(last_glyph)
       {
-        x += x_scale * stbtt_GetGlyphKernAdvance(&state->font, last_glyph, glyph)
-          * state->stb_font_scale / state->font_char_w;
+        x += x_units_scale * get_kerning(state, last_glyph, glyph);
       }
 
       if(!measure_only)
       {
-        i32 char_idx = (i32)codepoint - (i32)state->fixed_codepoint_range_start;
-        if(char_idx < 0 || char_idx >= state->fixed_codepoint_range_length)
-        {
-          char_idx = 0;
-          for(i32 custom_idx = 0;
-              custom_idx < state->custom_glyph_count;
-              ++custom_idx)
-          {
-            if(state->custom_glyphs[custom_idx] == glyph)
-            {
-              char_idx = custom_idx + state->fixed_codepoint_range_length;
-              break;
-            }
-          }
-
-          if(!char_idx)
-          {
-            char_idx = state->next_custom_glyph_idx + state->fixed_codepoint_range_length;
-            state->custom_glyphs[state->next_custom_glyph_idx] = glyph;
-
-            i32 row = char_idx / state->chars_per_font_row;
-            i32 col = char_idx % state->chars_per_font_row;
-
-            // printf("uploading codepoint %d\n", codepoint);
-            // printf("  char_idx %d, row %d, col %d\n", char_idx, row, col);
-
-            u8* texels_start = state->font_texels + row * state->font_char_h * state->font_texture_w + col * state->font_char_w;
-            for_count(j, state->font_char_h)
-            {
-              for_count(i, state->font_char_w)
-              {
-                texels_start[j * state->font_texture_w + i] = 0;
-              }
-            }
-            stbtt_MakeGlyphBitmap(&state->font, texels_start,
-                state->font_char_w, state->font_char_h, state->font_texture_w,
-                state->stb_font_scale, state->stb_font_scale, glyph);
-            glPixelStorei(GL_UNPACK_ROW_LENGTH, state->font_texture_w);
-            glTexSubImage2D(GL_TEXTURE_2D, 0,
-                col * state->font_char_w, row * state->font_char_h, state->font_char_w, state->font_char_h,
-                GL_ALPHA, GL_UNSIGNED_BYTE, texels_start);
-            glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
-
-            state->next_custom_glyph_idx = (state->next_custom_glyph_idx + 1) % state->custom_glyph_count;
-          }
-        }
-
-        i32 ix0, iy0, ix1, iy1;
-        stbtt_GetGlyphBitmapBox(&state->font, glyph, state->stb_font_scale, state->stb_font_scale, &ix0, &iy0, &ix1, &iy1);
-
-        // Without this extra padding, some of the antialiased edges get cut off slightly.
-        ix1 += 1;
-        iy1 += 1;
-
-        r32 x0 = x + x_scale * (r32)left_side_bearing * state->stb_font_scale / state->font_char_w;
-        r32 x1 = x0 + x_scale * (r32)(ix1 - ix0) / (r32)state->font_char_w;
-        r32 y1 = y - y_scale * (r32)iy0 / (r32)state->font_char_h;
-        r32 y0 = y1 - y_scale * (r32)(iy1 - iy0) / (r32)state->font_char_h;
-
-        r32 u0 = (r32)(char_idx % state->chars_per_font_row) / (r32)state->chars_per_font_row;
-        r32 u1 = u0 + (r32)(ix1 - ix0) / (r32)state->font_texture_w;
-        r32 v0 = (r32)(char_idx / state->chars_per_font_row) / (r32)state->chars_per_font_col;
-        r32 v1 = v0 + (r32)(iy1 - iy0) / (r32)state->font_texture_h;
-
-        glBegin(GL_QUADS);
-        glTexCoord2f(u0, v1); glVertex2f(x0, y0);
-        glTexCoord2f(u1, v1); glVertex2f(x1, y0);
-        glTexCoord2f(u1, v0); glVertex2f(x1, y1);
-        glTexCoord2f(u0, v0); glVertex2f(x0, y1);
-        glEnd();
+        push_glyph_quad(state, glyph, info, x_scale, y_scale, x, y);
       }
 
-      x += x_scale * x_advance * state->stb_font_scale / state->font_char_w;
+      x += x_units_scale * info->x_advance;
       last_glyph = glyph;
     }
   }
@@ -2197,35 +6472,188 @@ internal str_t wrap_next_line(wrapped_text_ctx_t* ctx, r32 x)
         ctx->line_end_x = x;
       }
     }
-
-    result = str_from_span(line_start, line_end);
-    ctx->remaining_text = str_from_span(remainder_start, text_end);
+
+    result = str_from_span(line_start, line_end);
+    ctx->remaining_text = str_from_span(remainder_start, text_end);
+  }
+
+  return result;
+}
+
+internal b32 finish_wrapped_line(wrapped_text_ctx_t* ctx, r32* x, r32* y)
+{
+  if(!ctx->finished)
+  {
+    *x = ctx->x0;
+    *y -= ctx->fs;
+    ++ctx->line_idx;
+  }
+
+  return !ctx->finished;
+}
+
+internal void draw_wrapped_text(state_t* state,
+    r32 fs, r32 x0, r32 x1, r32* x, r32* y, str_t text)
+{
+  wrapped_text_ctx_t wrap_ctx = begin_wrapped_text(state, fs, x0, x1, text);
+  do
+  {
+    str_t line = wrap_next_line(&wrap_ctx, *x);
+    *x += draw_str(state, 0, fs, *x, *y, line);
+  } while(finish_wrapped_line(&wrap_ctx, x, y));
+}
+
+// Appends the glyphs like draw_str would place them, without drawing.
+internal r32 lay_out_str(state_t* state, text_layout_t* layout, r32 start_x, i32 line_idx, str_t str)
+{
+  r32 x = start_x;
+
+  if(state->font_texture_id)
+  {
+    r32 x_units_scale = layout->fs * state->stb_font_scale / state->font_char_w;
+    i32 last_glyph = 0;
+    u8* str_end = str.data + str.size;
+
+    for(u8* str_ptr = str.data;
+        str_ptr < str_end;
+       )
+    {
+      u32 codepoint = decode_utf8(&str_ptr, str_end);
+      if(codepoint == '\t') { codepoint = ' '; }
+
+      i32 glyph = get_codepoint_glyph(state, codepoint);
+      glyph_info_t* info = get_glyph_info(state, glyph);
+
+      if(last_glyph)
+      {
+        x += x_units_scale * get_kerning(state, last_glyph, glyph);
+      }
+
+      if(layout->glyph_count == layout->glyph_capacity)
+      {
+        layout->glyph_capacity = max(64, 2 * layout->glyph_capacity);
+        layout->glyphs = (laid_out_glyph_t*)realloc(layout->glyphs,
+            layout->glyph_capacity * sizeof(laid_out_glyph_t));
+      }
+      laid_out_glyph_t* laid_out_glyph = &layout->glyphs[layout->glyph_count++];
+      laid_out_glyph->glyph = glyph;
+      laid_out_glyph->line_idx = line_idx;
+      laid_out_glyph->x = x;
+
+      x += x_units_scale * info->x_advance;
+      last_glyph = glyph;
+    }
+  }
+
+  return x - start_x;
+}
+
+// Without wrapping, the text stays on one line like with draw_str,
+// otherwise it breaks like draw_wrapped_text with a box that is wrap_width wide.
+internal text_layout_t* get_text_layout(state_t* state,
+    r32 fs, b32 wrapped, r32 wrap_width, r32 start_x, str_t str)
+{
+  if(state->text_layout_metadata_reload_count != state->metadata_reload_count)
+  {
+    // Parameter strings may have been freed, so their addresses mean nothing now.
+    state->text_layout_metadata_reload_count = state->metadata_reload_count;
+    for_count(i, TEXT_LAYOUT_CACHE_SIZE)
+    {
+      state->text_layouts[i].last_used = 0;
+    }
+  }
+
+  u32 set_idx = hash_u32((u32)(uintptr_t)str.data ^ (u32)str.size) >> (32 - TEXT_LAYOUT_CACHE_SET_COUNT_LOG2);
+  text_layout_t* set = &state->text_layouts[set_idx * TEXT_LAYOUT_CACHE_WAY_COUNT];
+  text_layout_t* layout = 0;
+  text_layout_t* least_recently_used = &set[0];
+
+  for_count(way, TEXT_LAYOUT_CACHE_WAY_COUNT)
+  {
+    text_layout_t* candidate = &set[way];
+    if(candidate->last_used
+        && candidate->str_data == str.data
+        && candidate->str_size == str.size
+        && candidate->fs == fs
+        && candidate->wrapped == wrapped
+        && (!wrapped || candidate->wrap_width == wrap_width)
+        && candidate->start_x == start_x)
+    {
+      layout = candidate;
+      break;
+    }
+    if(candidate->last_used < least_recently_used->last_used)
+    {
+      least_recently_used = candidate;
+    }
+  }
+
+  if(!layout)
+  {
+    layout = least_recently_used;
+    layout->str_data = str.data;
+    layout->str_size = str.size;
+    layout->fs = fs;
+    layout->wrapped = wrapped;
+    layout->wrap_width = wrap_width;
+    layout->start_x = start_x;
+    layout->glyph_count = 0;
+
+    if(wrapped)
+    {
+      r32 x = start_x;
+      r32 y = 0;
+      wrapped_text_ctx_t wrap_ctx = begin_wrapped_text(state, fs, 0, wrap_width, str);
+      do
+      {
+        str_t line = wrap_next_line(&wrap_ctx, x);
+        x += lay_out_str(state, layout, x, wrap_ctx.line_idx, line);
+        layout->end_x = x;
+        layout->line_count = wrap_ctx.line_idx + 1;
+      } while(finish_wrapped_line(&wrap_ctx, &x, &y));
+    }
+    else
+    {
+      layout->end_x = start_x + lay_out_str(state, layout, start_x, 0, str);
+      layout->line_count = 1;
+    }
   }
 
-  return result;
+  layout->last_used = ++state->text_layout_use_count;
+  return layout;
 }
 
-internal b32 finish_wrapped_line(wrapped_text_ctx_t* ctx, r32* x, r32* y)
+// x0 is the left edge of the text box, and y the first line's baseline.
+internal void draw_text_layout(state_t* state, text_layout_t* layout, r32 x0, r32 y)
 {
-  if(!ctx->finished)
+  if(layout->glyph_count > 0)
   {
-    *x = ctx->x0;
-    *y -= ctx->fs;
-    ++ctx->line_idx;
-  }
+    set_render_texture(state, GL_TEXTURE_2D, state->font_texture_id);
+    set_render_blend(state, true);
 
-  return !ctx->finished;
+    for_count(i, layout->glyph_count)
+    {
+      laid_out_glyph_t* laid_out_glyph = &layout->glyphs[i];
+      r32 glyph_x = x0 + laid_out_glyph->x;
+      r32 glyph_y = y - layout->fs * laid_out_glyph->line_idx;
+
+      // Group labels can run far past the window, and long prompts below it.
+      if(glyph_x < state->win_w && glyph_y > -layout->fs && glyph_y < state->win_h + layout->fs)
+      {
+        push_glyph_quad(state, laid_out_glyph->glyph, get_glyph_info(state, laid_out_glyph->glyph),
+            layout->fs, layout->fs, glyph_x, glyph_y);
+      }
+    }
+  }
 }
 
-internal void draw_wrapped_text(state_t* state,
+internal void draw_cached_wrapped_text(state_t* state,
     r32 fs, r32 x0, r32 x1, r32* x, r32* y, str_t text)
 {
-  wrapped_text_ctx_t wrap_ctx = begin_wrapped_text(state, fs, x0, x1, text);
-  do
-  {
-    str_t line = wrap_next_line(&wrap_ctx, *x);
-    *x += draw_str(state, 0, fs, *x, *y, line);
-  } while(finish_wrapped_line(&wrap_ctx, x, y));
+  text_layout_t* layout = get_text_layout(state, fs, true, x1 - x0, *x - x0, text);
+  draw_text_layout(state, layout, x0, *y);
+  *x = x0 + layout->end_x;
+  *y -= fs * (layout->line_count - 1);
 }
 
 internal b32 sort_mode_needs_metadata(sort_mode_t mode)
@@ -2454,7 +6882,30 @@ int main(int argc, char** argv)
   state_t* state = malloc_struct(state_t);
   zero_struct(*state);
   state->loader_count = 7;
-  state->shared.total_bytes_limit = 1 * 1024 * 1024 * 1024LL;
+  state->metadata_loader_count = 8;
+  state->shared.ram_bytes_limit = 1 * 1024 * 1024 * 1024LL;
+  state->shared.vram_bytes_limit = 1 * 1024 * 1024 * 1024LL;
+  state->shared.thumbnail_bytes_limit = 512 * 1024 * 1024LL;
+
+  i64 thumbnail_cache_limit = 4 * 1024 * 1024 * 1024LL;
+  i64 metadata_index_limit = DEFAULT_METADATA_INDEX_MB * 1024 * 1024LL;
+  char* xdg_cache_home = getenv("XDG_CACHE_HOME");
+  char* default_thumbnail_cache_path = 0;
+  char* default_metadata_index_path = 0;
+  if(xdg_cache_home)
+  {
+    asprintf(&default_thumbnail_cache_path, "%s/i2x/thumbnails.bin", xdg_cache_home);
+    asprintf(&default_metadata_index_path, "%s/i2x/metadata.bin", xdg_cache_home);
+  }
+  else
+  {
+    char* home = getenv("HOME");
+    if(home)
+    {
+      asprintf(&default_thumbnail_cache_path, "%s/.cache/i2x/thumbnails.bin", home);
+      asprintf(&default_metadata_index_path, "%s/.cache/i2x/metadata.bin", home);
+    }
+  }
 
   char* xdg_state_home = getenv("XDG_STATE_HOME");
   char* default_search_history_path = 0;
@@ -2497,9 +6948,33 @@ int main(int argc, char** argv)
     printf("                     smooth scrolling and raw sub-pixel mouse motion,\n");
     printf("                     but can be glitchy.\n");
     printf("I2X_LOADER_THREADS:  The number of image-loader threads. Default: %d\n", state->loader_count);
+    printf("I2X_METADATA_THREADS: The number of threads that read the images' metadata.\n");
+    printf("                     Mostly waiting on the disk, so more can help on slow\n");
+    printf("                     network drives. Default: %d\n", state->metadata_loader_count);
+    printf("I2X_DISABLE_IO_URING: Reads image files with a pool of blocking threads\n");
+    printf("                     instead of io_uring.\n");
     printf("I2X_TARGET_VRAM_MB:  Video memory usage to target in MiB, very roughly.\n");
-    printf("                     Might use more than 2x this amount. Default: %ld\n",
-        state->shared.total_bytes_limit / (1024 * 1024));
+    printf("                     Might use more than this amount. Default: %ld\n",
+        state->shared.vram_bytes_limit / (1024 * 1024));
+    printf("I2X_TARGET_RAM_MB:   Like I2X_TARGET_VRAM_MB, but for the images that are decoded\n");
+    printf("                     and waiting to be shown. Default: %ld\n",
+        state->shared.ram_bytes_limit / (1024 * 1024));
+    printf("I2X_THUMBNAIL_VRAM_MB: Like I2X_TARGET_VRAM_MB, but for the separate budget of\n");
+    printf("                     downscaled thumbnails. Default: %ld\n",
+        state->shared.thumbnail_bytes_limit / (1024 * 1024));
+    printf("I2X_THUMBNAIL_CACHE_MB: Maximum size of the persistent thumbnail cache file in MiB.\n");
+    printf("                     Set to 0 to disable it. Default: %ld, stored at:\n",
+        thumbnail_cache_limit / (1024 * 1024));
+    printf("                     %s\n", default_thumbnail_cache_path);
+    printf("I2X_METADATA_INDEX_MB: Maximum size of the persistent index of parsed metadata in MiB,\n");
+    printf("                     which saves reading every file again for sorting on startup.\n");
+    printf("                     Set to 0 to disable it. Default: %ld, stored at:\n",
+        metadata_index_limit / (1024 * 1024));
+    printf("                     %s\n", default_metadata_index_path);
+    printf("I2X_DISABLE_HUGE_PAGES: Doesn't ask for transparent huge pages for image buffers.\n");
+    printf("I2X_UPLOAD_ARENA_MB: Size of the pixel buffer that images get decoded into,\n");
+    printf("                     for uploading them in the background. Set to 0 to disable it.\n");
+    printf("                     Default: %d\n", DEFAULT_UPLOAD_ARENA_MB);
     printf("I2X_TTF_PATH:        Use an external font file instead of the internal one.\n");
     printf("\n");
     printf("Example invocation:\n  I2X_DISABLE_XINPUT2=1 I2X_LOADER_THREADS=3 I2X_SORT_ORDER=time_desc %s\n", argv[0]);
@@ -2806,8 +7281,36 @@ int main(int argc, char** argv)
         state->filtered_img_idxs = malloc_array_zero(state->total_img_capacity, i32);
         state->prev_filtered_img_idxs = malloc_array_zero(state->total_img_capacity, i32);
 
-        sem_init(&state->metadata_loader_semaphore, 0, 0);
-        pthread_create(&state->metadata_loader_thread, 0, metadata_loader_fun, state);
+        {
+          char* thread_count_envvar = getenv("I2X_METADATA_THREADS");
+          if(thread_count_envvar)
+          {
+            state->metadata_loader_count = atoi(thread_count_envvar);
+            state->metadata_loader_count = clamp(1, MAX_THREAD_COUNT, state->metadata_loader_count);
+          }
+
+          char* metadata_index_mb_envvar = getenv("I2X_METADATA_INDEX_MB");
+          if(metadata_index_mb_envvar)
+          {
+            metadata_index_limit = max(0, (i64)atoi(metadata_index_mb_envvar) * 1024 * 1024);
+          }
+
+          if(metadata_index_limit > 0 && default_metadata_index_path)
+          {
+            create_parent_directories(default_metadata_index_path);
+            open_cache_file(&state->metadata_index, "Metadata index", default_metadata_index_path,
+                METADATA_INDEX_MAGIC, METADATA_INDEX_SLOT_COUNT, metadata_index_limit);
+          }
+
+          pthread_mutex_init(&state->metadata_mutex, 0);
+          pthread_cond_init(&state->metadata_cond, 0);
+          for(i32 metadata_loader_idx = 0;
+              metadata_loader_idx < state->metadata_loader_count;
+              ++metadata_loader_idx)
+          {
+            pthread_create(&state->metadata_loader_threads[metadata_loader_idx], 0, metadata_loader_fun, state);
+          }
+        }
 
         refresh_input_paths(state);
 
@@ -2823,18 +7326,7 @@ int main(int argc, char** argv)
               search_history_path = search_history_envvar;
             }
 
-            // Create parent directories first.
-            for(i32 char_idx = 0;
-                search_history_path[char_idx] != 0;
-                ++char_idx)
-            {
-              if(search_history_path[char_idx] == '/')
-              {
-                search_history_path[char_idx] = 0;
-                mkdir(search_history_path, 0700);
-                search_history_path[char_idx] = '/';
-              }
-            }
+            create_parent_directories(search_history_path);
 
             state->search_history_file = fopen(search_history_path, "a+b");
 
@@ -2888,9 +7380,10 @@ int main(int argc, char** argv)
 
         if(sort_mode_needs_metadata(state->sort_mode))
         {
-          while(state->metadata_loaded_count < state->total_img_count)
+          while(state->metadata_loaded_count < state->metadata_queued_count)
           {
-            usleep(100000);
+            // Short, since with the metadata index this is often done within a few frames.
+            usleep(5000);
           }
           state->all_metadata_loaded = true;
 
@@ -2932,6 +7425,12 @@ int main(int argc, char** argv)
         state->fixed_codepoint_range_length = 127 - state->fixed_codepoint_range_start;  // '~'
         state->custom_glyph_count = state->chars_per_font_row * state->chars_per_font_col - state->fixed_codepoint_range_length;
         state->custom_glyphs = malloc_array(state->custom_glyph_count, i32);
+        state->custom_glyph_last_used = malloc_array(state->custom_glyph_count, u64);
+        for_count(i, state->custom_glyph_count)
+        {
+          state->custom_glyphs[i] = -1;
+          state->custom_glyph_last_used[i] = 0;
+        }
 
         {
           u8* ttf_data = 0;
@@ -2951,10 +7450,24 @@ int main(int argc, char** argv)
 
           if(stbtt_InitFont(&state->font, ttf_data, stbtt_GetFontOffsetForIndex(ttf_data, 0)))
           {
-            i32 space_glyph = stbtt_FindGlyphIndex(&state->font, ' ');
-            for_count(i, state->custom_glyph_count)
+            state->glyph_infos = malloc_array(state->font.numGlyphs, glyph_info_t);
+            for_count(glyph, state->font.numGlyphs)
+            {
+              zero_struct(state->glyph_infos[glyph]);
+              state->glyph_infos[glyph].char_idx = -1;
+            }
+
+            state->codepoint_glyph_capacity = 256;
+            state->codepoint_glyphs = malloc_array(state->codepoint_glyph_capacity, codepoint_glyph_t);
+            for_count(i, state->codepoint_glyph_capacity)
             {
-              state->custom_glyphs[i] = space_glyph;
+              state->codepoint_glyphs[i].codepoint = CODEPOINT_NONE;
+            }
+
+            state->kerning_cache = malloc_array(KERNING_CACHE_SIZE, kerning_entry_t);
+            for_count(i, KERNING_CACHE_SIZE)
+            {
+              state->kerning_cache[i].glyph_pair = CODEPOINT_NONE;
             }
 
             state->font_texels = malloc_array(state->font_texture_w * state->font_texture_h, u8);
@@ -2975,6 +7488,7 @@ int main(int argc, char** argv)
               i32 col = char_idx % state->chars_per_font_row;
 
               i32 codepoint = state->fixed_codepoint_range_start + char_idx;
+              state->glyph_infos[get_codepoint_glyph(state, codepoint)].char_idx = char_idx;
 
               stbtt_MakeCodepointBitmap(&state->font,
                   state->font_texels + row * state->font_char_h * state->font_texture_w + col * state->font_char_w,
@@ -2982,14 +7496,22 @@ int main(int argc, char** argv)
                   state->stb_font_scale, state->stb_font_scale, codepoint);
             }
 
+            // The space's cell is otherwise empty, and sampling right at the texel's center doesn't blend in its neighbors.
+            i32 white_x = state->font_char_w / 2;
+            i32 white_y = state->font_char_h / 2;
+            state->font_texels[white_y * state->font_texture_w + white_x] = 255;
+            state->font_white_u = (white_x + 0.5f) / (r32)state->font_texture_w;
+            state->font_white_v = (white_y + 0.5f) / (r32)state->font_texture_h;
+
             glGenTextures(1, &state->font_texture_id);
             glBindTexture(GL_TEXTURE_2D, state->font_texture_id);
             glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
             glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
             glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
             glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA,
-                state->font_texture_w, state->font_texture_h, 0, GL_ALPHA, GL_UNSIGNED_BYTE, state->font_texels);
+            // Intensity spreads the coverage into all four channels, which makes it premultiplied white.
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_INTENSITY8,
+                state->font_texture_w, state->font_texture_h, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, state->font_texels);
           }
 
           if(!state->font_texture_id)
@@ -3017,24 +7539,209 @@ int main(int argc, char** argv)
           char* vram_target_mb_envvar = getenv("I2X_TARGET_VRAM_MB");
           if(vram_target_mb_envvar)
           {
-            state->shared.total_bytes_limit = (i64)atoi(vram_target_mb_envvar) * 1024 * 1024;
-            state->shared.total_bytes_limit = max(0, state->shared.total_bytes_limit);
-            printf("Targeting roughly %ld MiB of VRAM usage.\n", state->shared.total_bytes_limit / (1024 * 1024));
+            state->shared.vram_bytes_limit = (i64)atoi(vram_target_mb_envvar) * 1024 * 1024;
+            state->shared.vram_bytes_limit = max(0, state->shared.vram_bytes_limit);
+            printf("Targeting roughly %ld MiB of VRAM usage.\n", state->shared.vram_bytes_limit / (1024 * 1024));
+          }
+
+          char* ram_target_mb_envvar = getenv("I2X_TARGET_RAM_MB");
+          if(ram_target_mb_envvar)
+          {
+            state->shared.ram_bytes_limit = (i64)atoi(ram_target_mb_envvar) * 1024 * 1024;
+            state->shared.ram_bytes_limit = max(0, state->shared.ram_bytes_limit);
+            printf("Targeting roughly %ld MiB of RAM usage for decoded images.\n", state->shared.ram_bytes_limit / (1024 * 1024));
+          }
+
+          char* thumbnail_vram_mb_envvar = getenv("I2X_THUMBNAIL_VRAM_MB");
+          if(thumbnail_vram_mb_envvar)
+          {
+            state->shared.thumbnail_bytes_limit = (i64)atoi(thumbnail_vram_mb_envvar) * 1024 * 1024;
+            state->shared.thumbnail_bytes_limit = max(0, state->shared.thumbnail_bytes_limit);
+            printf("Targeting roughly %ld MiB of VRAM usage for thumbnails.\n", state->shared.thumbnail_bytes_limit / (1024 * 1024));
+          }
+        }
+
+        {
+          char* thumbnail_cache_mb_envvar = getenv("I2X_THUMBNAIL_CACHE_MB");
+          if(thumbnail_cache_mb_envvar)
+          {
+            thumbnail_cache_limit = max(0, (i64)atoi(thumbnail_cache_mb_envvar) * 1024 * 1024);
+          }
+
+          if(thumbnail_cache_limit > 0 && default_thumbnail_cache_path)
+          {
+            create_parent_directories(default_thumbnail_cache_path);
+            open_cache_file(&state->shared.thumbnail_cache, "Thumbnail cache", default_thumbnail_cache_path,
+                THUMBNAIL_CACHE_MAGIC, THUMBNAIL_CACHE_SLOT_COUNT, thumbnail_cache_limit);
           }
         }
 
-        state->shared.total_loader_count = state->loader_count;
         state->shared.img_entries = state->img_entries;
         state->shared.filtered_img_count = state->filtered_img_count;
         state->shared.filtered_img_idxs = state->filtered_img_idxs;
 
+        init_srgb_tables();
+        png_detect_cpu_features();
+        pthread_mutex_init(&state->shared.pixel_pool.mutex, 0);
+        state->shared.pixel_pool.use_huge_pages = !getenv("I2X_DISABLE_HUGE_PAGES");
+
+        {
+          i64 upload_arena_size = (i64)DEFAULT_UPLOAD_ARENA_MB * 1024 * 1024;
+          char* upload_arena_mb_envvar = getenv("I2X_UPLOAD_ARENA_MB");
+          if(upload_arena_mb_envvar)
+          {
+            upload_arena_size = max(0, (i64)atoi(upload_arena_mb_envvar) * 1024 * 1024);
+          }
+
+          char* gl_extensions = (char*)glGetString(GL_EXTENSIONS);
+          if(upload_arena_size > 0 && gl_extensions
+              && strstr(gl_extensions, "GL_ARB_buffer_storage") && strstr(gl_extensions, "GL_ARB_sync"))
+          {
+            // The loaders read the pixels back for premultiplying and thumbnails,
+            // so ask for memory that's cached on the CPU side.
+            GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glGenBuffers(1, &state->upload_arena_buffer);
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, state->upload_arena_buffer);
+            glBufferStorage(GL_PIXEL_UNPACK_BUFFER, upload_arena_size, 0, flags | GL_CLIENT_STORAGE_BIT);
+            u8* upload_arena = (u8*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, upload_arena_size, flags);
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+            if(upload_arena)
+            {
+              state->shared.pixel_pool.upload_arena = upload_arena;
+              state->shared.pixel_pool.upload_arena_size = upload_arena_size;
+            }
+            else
+            {
+              fprintf(stderr, "Could not map a pixel buffer for uploads, uploading textures directly.\n");
+              glDeleteBuffers(1, &state->upload_arena_buffer);
+              state->upload_arena_buffer = 0;
+            }
+          }
+        }
+
+        {
+          char* gl_extensions = (char*)glGetString(GL_EXTENSIONS);
+          GLint gl_major_version = 0;
+          GLint gl_minor_version = 0;
+          glGetIntegerv(GL_MAJOR_VERSION, &gl_major_version);
+          glGetIntegerv(GL_MINOR_VERSION, &gl_minor_version);
+
+          // The vertices come in through the fixed-function arrays, so that they work without a program as well.
+          char* vertex_source =
+            "#version 120\n"
+            "void main()\n"
+            "{\n"
+            "  gl_TexCoord[0] = gl_MultiTexCoord0;\n"
+            "  gl_FrontColor = gl_Color;\n"
+            "  gl_Position = ftransform();\n"
+            "}\n";
+          char* gl_version = (char*)glGetString(GL_VERSION);
+          if(gl_version && atoi(gl_version) >= 2)
+          {
+            state->render_program = compile_shader_program(vertex_source,
+                "#version 120\n"
+                "uniform sampler2D img;\n"
+                "void main()\n"
+                "{\n"
+                "  gl_FragColor = gl_Color * texture2D(img, gl_TexCoord[0].xy);\n"
+                "}\n");
+          }
+          init_renderer(state);
+
+          // Fixed-function texturing leaves the alpha of RG textures alone, swizzled or not.
+          state->has_texture_swizzle = state->render_program
+            && (gl_major_version > 3 || (gl_major_version == 3 && gl_minor_version >= 3)
+              || (gl_extensions && strstr(gl_extensions, "GL_ARB_texture_rg")
+                && (strstr(gl_extensions, "GL_ARB_texture_swizzle") || strstr(gl_extensions, "GL_EXT_texture_swizzle"))));
+
+          // Fixed-function texturing can't sample from array textures.
+          if(gl_major_version >= 3 || (gl_extensions && strstr(gl_extensions, "GL_EXT_texture_array")))
+          {
+            state->thumbnail_program = compile_shader_program(vertex_source,
+                "#version 120\n"
+                "#extension GL_EXT_texture_array : require\n"
+                "uniform sampler2DArray thumbnails;\n"
+                "void main()\n"
+                "{\n"
+                "  gl_FragColor = gl_Color * texture2DArray(thumbnails, gl_TexCoord[0].xyz);\n"
+                "}\n");
+          }
+          if(!state->thumbnail_program)
+          {
+            fprintf(stderr, "Array textures are not supported, so every thumbnail gets a texture of its own.\n");
+          }
+        }
+
+        {
+          // Bigger images get split into tiles, and so do those the GPU can't take in one piece.
+          GLint max_texture_size = 0;
+          glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_texture_size);
+          state->shared.tiled_img_min_size = TILED_IMG_MIN_SIZE;
+          if(max_texture_size > 0)
+          {
+            state->shared.tiled_img_min_size = min(TILED_IMG_MIN_SIZE, max_texture_size);
+            state->shared.max_texture_size = max_texture_size;
+          }
+        }
+
+        pthread_mutex_init(&state->shared.preview.mutex, 0);
+        state->shared.preview.img_idx = -1;
+
+        pthread_mutex_init(&state->shared.job_mutex, 0);
+        pthread_cond_init(&state->shared.job_cond, 0);
+        state->shared.full_resolution_load_secs = 0.05f;
+        state->shared.thumbnail_load_secs = 0.02f;
+        for_count(i, COMPLETION_QUEUE_SIZE) { state->shared.completions.cells[i].sequence = i; }
+        state->shared.completion_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(state->shared.completion_eventfd == -1)
+        {
+          fprintf(stderr, "Could not create eventfd.\n");
+          exit(1);
+        }
+
+        state->shared.readahead_limit = READAHEAD_FILES_PER_LOADER * state->loader_count;
+        state->shared.reads = malloc_array(state->shared.readahead_limit, read_load_t);
+        pthread_cond_init(&state->shared.read_cond, 0);
+
+        // One thread can keep all reads going at once through io_uring, otherwise it takes a pool of them.
+        state->shared.io_wake_eventfd = -1;
+        state->io_thread_count = state->loader_count;
+        void* (*io_fun)(void*) = blocking_io_fun;
+#if HAS_IO_URING
+        if(!getenv("I2X_DISABLE_IO_URING"))
+        {
+          // Room for every file being read, plus the wake-up poll.
+          if(open_io_ring(&state->shared.io_ring, state->shared.readahead_limit + 1))
+          {
+            state->shared.io_wake_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+          }
+          if(state->shared.io_wake_eventfd != -1)
+          {
+            state->io_thread_count = 1;
+            io_fun = io_uring_fun;
+          }
+          else
+          {
+            fprintf(stderr, "Could not set up io_uring, reading files with blocking threads.\n");
+          }
+        }
+#endif
+
+        for(i32 io_idx = 0;
+            io_idx < state->io_thread_count;
+            ++io_idx)
+        {
+          state->io_data[io_idx].thread_idx = io_idx + 1;
+          state->io_data[io_idx].shared = &state->shared;
+          pthread_create(&state->io_threads[io_idx], 0, io_fun, &state->io_data[io_idx]);
+        }
+
         for(i32 loader_idx = 0;
             loader_idx < state->loader_count;
             ++loader_idx)
         {
-          sem_init(&state->loader_semaphores[loader_idx], 0, 0);
           state->loader_data[loader_idx].thread_idx = loader_idx + 1;
-          state->loader_data[loader_idx].semaphore = &state->loader_semaphores[loader_idx];
           state->loader_data[loader_idx].shared = &state->shared;
           pthread_create(&state->loader_threads[loader_idx], 0, loader_fun, &state->loader_data[loader_idx]);
         }
@@ -3112,12 +7819,20 @@ int main(int argc, char** argv)
             i32 uploaded_count = 0;
             i32 deleted_count = 0;
 
+            // Only unload images that take up the kind of memory that's over the limit.
             img_entry_t* unload = state->lru_last;
-            while(state->shared.total_bytes_used > state->shared.total_bytes_limit
-                && unload)
+            for(;;)
             {
+              b32 ram_over_limit = (state->shared.ram_bytes_used > state->shared.ram_bytes_limit);
+              b32 vram_over_limit = (state->shared.vram_bytes_used > state->shared.vram_bytes_limit);
+              if(!unload || (!ram_over_limit && !vram_over_limit))
+              {
+                break;
+              }
+
               img_entry_t* next_unload = unload->lru_prev;
-              if(unload != get_filtered_img(state, state->viewing_filtered_img_idx))
+              if(unload != get_filtered_img(state, state->viewing_filtered_img_idx)
+                  && ((ram_over_limit && unload->pixels) || (vram_over_limit && (unload->texture_id || unload->tiled))))
               {
                 unload_texture(state, unload);
                 ++deleted_count;
@@ -3125,29 +7840,39 @@ int main(int argc, char** argv)
               unload = next_unload;
             }
 
-            while(shared->next_loaded_img_id > shared->next_finalized_img_id)
+            unload = state->thumbnail_lru_last;
+            while(state->shared.thumbnail_bytes_used > state->shared.thumbnail_bytes_limit
+                && unload)
             {
-              loaded_img_t* loaded_img =
-                &shared->loaded_imgs[shared->next_finalized_img_id % array_count(shared->loaded_imgs)];
+              img_entry_t* next_unload = unload->thumbnail_lru_prev;
+              unload_thumbnail(state, unload);
+              ++deleted_count;
+              unload = next_unload;
+            }
 
-              if(loaded_img->load_state != LOAD_STATE_LOADED_INTO_RAM)
-              {
-                // printf("Trying to upload loaded ID %ld (entry %d), but it's not ready yet.\n", shared->next_finalized_img_id, loaded_img->entry_idx);
-                break;
-              }
-              // printf("Uploading loaded ID %ld (entry %d).\n", shared->next_finalized_img_id, loaded_img->entry_idx);
+            free_finished_uploads(state);
+
+            u64 completion_count = 0;
+            ssize_t read_result = read(shared->completion_eventfd, &completion_count, sizeof(completion_count));
+            (void)read_result;
+
+            loaded_img_t completed_load;
+            while(pop_completed_load(&shared->completions, &completed_load))
+            {
+              loaded_img_t* loaded_img = &completed_load;
+              // printf("Finalizing load of entry %d.\n", loaded_img->entry_idx);
 
               img_entry_t* img_entry = &state->img_entries[loaded_img->entry_idx];
-              if(loaded_img->load_generation == img_entry->load_generation)
+              if(loaded_img->load_generation == img_entry->load_generation && !loaded_img->cancelled)
               {
-                unload_texture(state, img_entry);
-                img_entry->w = loaded_img->w;
-                img_entry->h = loaded_img->h;
-                img_entry->pixels = loaded_img->pixels;
-                img_entry->bytes_used = loaded_img->bytes_used;
-                img_entry->load_state = LOAD_STATE_LOADED_INTO_RAM;
-
-                if(!img_entry->pixels)
+                if(loaded_img->w || loaded_img->h)
+                {
+                  img_entry->w = loaded_img->w;
+                  img_entry->h = loaded_img->h;
+                }
+
+                // Also when only the thumbnail could be made, but the full image wouldn't fit anywhere.
+                if(!loaded_img->pixels && (loaded_img->full_resolution || !loaded_img->thumbnail_pixels))
                 {
                   img_entry->flags |= IMG_FLAG_FAILED_TO_LOAD;
                 }
@@ -3155,45 +7880,95 @@ int main(int argc, char** argv)
                 {
                   img_entry->flags &= ~IMG_FLAG_FAILED_TO_LOAD;
 
-                  assert(!img_entry->lru_prev);
-                  assert(!img_entry->lru_next);
+                  if(loaded_img->opaque) { img_entry->flags |= IMG_FLAG_OPAQUE; }
+                  else                   { img_entry->flags &= ~IMG_FLAG_OPAQUE; }
+                }
 
-                  // Insert at front of LRU chain so this image doesn't get immediately unloaded.
-                  if(!state->lru_first)
+                if(loaded_img->full_resolution)
+                {
+                  unload_texture(state, img_entry);
+                  img_entry->pixels = loaded_img->pixels;
+                  img_entry->channel_count = loaded_img->channel_count;
+                  img_entry->tiled = loaded_img->tiled;
+                  img_entry->bytes_used = loaded_img->bytes_used;
+                  img_entry->load_state = LOAD_STATE_LOADED_INTO_RAM;
+
+                  if(img_entry->pixels)
                   {
-                    state->lru_first = img_entry;
-                    state->lru_last = img_entry;
+                    assert(!img_entry->lru_prev);
+                    assert(!img_entry->lru_next);
+
+                    // Insert at front of LRU chain so this image doesn't get immediately unloaded.
+                    if(!state->lru_first)
+                    {
+                      state->lru_first = img_entry;
+                      state->lru_last = img_entry;
+                    }
+                    else
+                    {
+                      img_entry->lru_next = state->lru_first;
+                      state->lru_first->lru_prev = img_entry;
+                      state->lru_first = img_entry;
+                    }
                   }
-                  else
+                }
+                else if(!img_entry->pixels && !img_entry->texture_id)
+                {
+                  // Remember the size for predicting how much a full-resolution load would take.
+                  i32 channel_count = img_entry->channel_count ? img_entry->channel_count : 4;
+                  img_entry->bytes_used = channel_count * (i64)img_entry->w * (i64)img_entry->h;
+                }
+
+                if(loaded_img->has_thumbnail)
+                {
+                  unload_thumbnail(state, img_entry);
+                  img_entry->thumbnail_w = loaded_img->thumbnail_w;
+                  img_entry->thumbnail_h = loaded_img->thumbnail_h;
+                  img_entry->thumbnail_pixels = loaded_img->thumbnail_pixels;
+                  img_entry->thumbnail_bytes_used = loaded_img->thumbnail_bytes_used;
+                  img_entry->thumbnail_load_state = LOAD_STATE_LOADED_INTO_RAM;
+
+                  if(img_entry->thumbnail_pixels)
                   {
-                    img_entry->lru_next = state->lru_first;
-                    state->lru_first->lru_prev = img_entry;
-                    state->lru_first = img_entry;
+                    touch_thumbnail_lru(state, img_entry);
                   }
                 }
               }
               else
               {
+                if(loaded_img->tiled)
+                {
+                  free_tiled_img(state, loaded_img->tiled);
+                  loaded_img->tiled = 0;
+                }
                 if(loaded_img->pixels)
                 {
-                  stbi_image_free(loaded_img->pixels);
+                  free_pixel_buffer(&state->shared.pixel_pool, loaded_img->pixels);
                   loaded_img->pixels = 0;
-                  __sync_fetch_and_sub(&state->shared.total_bytes_used, loaded_img->bytes_used);
+                  __sync_fetch_and_sub(&state->shared.ram_bytes_used, loaded_img->bytes_used);
+                }
+                if(loaded_img->thumbnail_pixels)
+                {
+                  free_pixel_buffer(&state->shared.pixel_pool, loaded_img->thumbnail_pixels);
+                  loaded_img->thumbnail_pixels = 0;
+                  __sync_fetch_and_sub(&state->shared.thumbnail_bytes_used, loaded_img->thumbnail_bytes_used);
+                }
+                if(loaded_img->full_resolution)
+                {
+                  img_entry->load_state = LOAD_STATE_UNLOADED;
+                }
+                if(loaded_img->has_thumbnail)
+                {
+                  img_entry->thumbnail_load_state = LOAD_STATE_UNLOADED;
                 }
-                img_entry->load_state = LOAD_STATE_UNLOADED;
               }
-              __sync_synchronize();
-              loaded_img->load_state = LOAD_STATE_UNLOADED;
 
               ++uploaded_count;
-              ++shared->next_finalized_img_id;
             }
 
             if(uploaded_count || deleted_count)
             {
-              // TODO: Find something better for unblocking the threads which doesn't
-              //       keep going up like these semaphores.
-              for_count(i, state->loader_count) { sem_post(&state->loader_semaphores[i]); }
+              update_load_queue(state);
             }
           }
 
@@ -3208,7 +7983,14 @@ int main(int argc, char** argv)
           if(!state->vsync) { dirty = true; }
           if(!state->all_metadata_loaded)
           {
-            // printf("Loading metadata %d/%d\n", state->metadata_loaded_count, state->total_img_count);
+            // printf("Loading metadata %d/%d\n", state->metadata_loaded_count, state->metadata_queued_count);
+            dirty = true;
+          }
+          u32 metadata_reload_count = state->metadata_reload_count;
+          if(metadata_reload_count != state->handled_metadata_reload_count)
+          {
+            // Only when some image actually got new metadata since the last frame.
+            state->handled_metadata_reload_count = metadata_reload_count;
             dirty = true;
             state->search_changed = true;
             state->need_to_layout = true;
@@ -3219,7 +8001,7 @@ int main(int argc, char** argv)
               sort_triggered_by_incomplete_metadata = true;
             }
           }
-          state->all_metadata_loaded = (state->metadata_loaded_count >= state->total_img_count);
+          state->all_metadata_loaded = (state->metadata_loaded_count >= state->metadata_queued_count);
 
           if(state->inotify_fd != -1)
           {
@@ -4238,20 +9020,40 @@ int main(int argc, char** argv)
                     else if(keysym == 'n')
                     {
                       bflip(state->linear_sampling);
+                      for(i32 array_idx = 0;
+                          array_idx < state->thumbnail_array_count;
+                          ++array_idx)
+                      {
+                        glBindTexture(GL_TEXTURE_2D_ARRAY, state->thumbnail_arrays[array_idx]);
+                        set_texture_sampling(state, GL_TEXTURE_2D_ARRAY, true);
+                      }
+                      glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
                       for(i32 img_idx = 0;
                           img_idx < state->total_img_count;
                           ++img_idx)
                       {
-                        glBindTexture(GL_TEXTURE_2D, state->img_entries[img_idx].texture_id);
-                        if(state->linear_sampling)
+                        if(state->img_entries[img_idx].texture_id)
                         {
-                          glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-                          glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+                          glBindTexture(GL_TEXTURE_2D, state->img_entries[img_idx].texture_id);
+                          set_texture_sampling(state, GL_TEXTURE_2D, false);
                         }
-                        else
+                        if(state->img_entries[img_idx].thumbnail_texture_id
+                            && state->img_entries[img_idx].thumbnail_slot < 0)
                         {
-                          glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-                          glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+                          glBindTexture(GL_TEXTURE_2D, state->img_entries[img_idx].thumbnail_texture_id);
+                          set_texture_sampling(state, GL_TEXTURE_2D, true);
+                        }
+
+                        tiled_img_t* tiled = state->img_entries[img_idx].tiled;
+                        for(i32 tile_idx = 0;
+                            tiled && tile_idx < tiled->tile_count;
+                            ++tile_idx)
+                        {
+                          if(tiled->tiles[tile_idx].texture_id)
+                          {
+                            glBindTexture(GL_TEXTURE_2D, tiled->tiles[tile_idx].texture_id);
+                            set_texture_sampling(state, GL_TEXTURE_2D, false);
+                          }
                         }
                       }
                     }
@@ -5585,7 +10387,11 @@ _search_end_label:
               state->shared.first_visible_thumbnail_idx = first_visible_thumbnail_idx;
               state->shared.last_visible_thumbnail_idx = last_visible_thumbnail_idx;
               state->shared.filtered_img_count = state->filtered_img_count;
-              for_count(i, state->loader_count) { sem_post(&state->loader_semaphores[i]); }
+
+              prioritize_metadata(state, state->viewing_filtered_img_idx,
+                  first_visible_thumbnail_idx, last_visible_thumbnail_idx);
+
+              update_load_queue(state);
             }
 
             glViewport(0, 0, state->win_w, state->win_h);
@@ -5609,6 +10415,7 @@ _search_end_label:
               };
               glLoadMatrixf(matrix);
             }
+            begin_render_frame(state);
 
             r32 text_gray = bright_bg ? 0 : 1;
             r32 label_gray = bright_bg ? 0.3f : 0.7f;
@@ -5616,54 +10423,57 @@ _search_end_label:
             r32 background_gray = bright_bg ? 1 : 0;
 
             b32 still_loading = false;
+            state->uploaded_bytes_this_frame = 0;
+            ++state->frame_number;
 
             // Draw main image.
             {
               still_loading |= upload_img_texture(state, viewed_img);
 
-              glColor3f(1.0f, 1.0f, 1.0f);
+              set_render_color(state, 1.0f, 1.0f, 1.0f, 1.0f);
               GLuint texture_id = viewed_img->texture_id;
+              tiled_img_t* tiled = viewed_img->tiled;
               r32 tex_w = viewed_img->w;
               r32 tex_h = viewed_img->h;
+              GLuint preview_texture_id = update_preview_texture(state, (texture_id || tiled) ? 0 : viewed_img);
+              img_entry_t* thumbnail_img = 0;
+              if(!texture_id && !tiled)
+              {
+                // Show the thumbnail stretched out until the full resolution is available,
+                // with the rows that got decoded so far on top.
+                upload_thumbnail_texture(state, viewed_img);
+                if(viewed_img->thumbnail_texture_id)
+                {
+                  thumbnail_img = viewed_img;
+                }
+                if(preview_texture_id && (tex_w == 0 || tex_h == 0))
+                {
+                  tex_w = state->shown_preview.img_w;
+                  tex_h = state->shown_preview.img_h;
+                }
+              }
               if(viewed_img->flags & IMG_FLAG_FAILED_TO_LOAD)
               {
                 texture_id = 0;
+                tiled = 0;
+                preview_texture_id = 0;
+                thumbnail_img = 0;
               }
               if(state->debug_font_atlas)
               {
                 // FONT TEST
+                tiled = 0;
+                preview_texture_id = 0;
+                thumbnail_img = 0;
                 texture_id = state->font_texture_id;
                 tex_w = state->font_texture_w;
                 tex_h = state->font_texture_h;
               }
 
-              if(texture_id)
+              if(texture_id || tiled || preview_texture_id || thumbnail_img)
               {
-                if(state->alpha_blend)
-                {
-                  if(texture_id == state->font_texture_id)
-                  {
-                    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-                  }
-                  else
-                  {
-                    glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
-                  }
-                  glEnable(GL_BLEND);
-                }
-                else
-                {
-                  glDisable(GL_BLEND);
-                }
-
-                glBindTexture(GL_TEXTURE_2D, texture_id);
-
-                r32 u0 = 0.0f;
-                r32 v0 = 0.0f;
-                r32 u1 = 1.0f;
-                r32 v1 = 1.0f;
-
-                glScissor(image_region_x0, image_region_y0, image_region_w, image_region_h);
+                set_render_blend(state, state->alpha_blend);
+                set_render_scissor(state, image_region_x0, image_region_y0, image_region_w, image_region_h);
 
                 r32 mag = 1.0f;
                 if(!state->zoom_from_original_size && tex_w != 0 && tex_h != 0)
@@ -5691,52 +10501,59 @@ _search_end_label:
                   y0 = (r32)(i32)(y0 + 0.5f);
                 }
 
-                r32 x1 = x0 + mag * tex_w;
-                r32 y1 = y0 + mag * tex_h;
-
-                if(border_sampling)
+                if(tiled)
+                {
+                  still_loading |= draw_tiled_img(state, tiled, x0, y0, mag,
+                      image_region_x0, image_region_y0, image_region_w, image_region_h, border_sampling);
+                }
+                else
                 {
-                  r32 margin = max(1.0f, mag);
+                  r32 x1 = x0 + mag * tex_w;
+                  r32 y1 = y0 + mag * tex_h;
+                  // The width of half a texel, for fading out the edges.
+                  r32 fade = (border_sampling && state->linear_sampling) ? 0.5f * mag : 0.0f;
 
-                  u0 -= margin / (r32)(mag * tex_w);
-                  v0 -= margin / (r32)(mag * tex_h);
-                  u1 += margin / (r32)(mag * tex_w);
-                  v1 += margin / (r32)(mag * tex_h);
+                  if(texture_id)
+                  {
+                    set_render_texture(state, GL_TEXTURE_2D, texture_id);
+                    draw_faded_quad(state, x0, y0, x1, y1, 0.0f, 1.0f, 1.0f, 0.0f, fade, fade, fade, fade);
+                  }
+                  else if(thumbnail_img)
+                  {
+                    push_thumbnail_quad(state, thumbnail_img, x0, y0, x1, y1);
+                    draw_thumbnail_quads(state);
+                  }
 
-                  x0 -= margin;
-                  y0 -= margin;
-                  x1 += margin;
-                  y1 += margin;
+                  if(preview_texture_id)
+                  {
+                    // Down to the middle of the last row, so the rows below that aren't there yet don't get sampled.
+                    r32 preview_v1 = ((r32)state->shown_preview.row_count - 0.5f) / (r32)state->shown_preview.h;
+                    r32 preview_y0 = y1 - mag * tex_h * preview_v1;
+                    r32 preview_fade_x = fade * tex_w / (r32)state->shown_preview.w;
+                    r32 preview_fade_y = fade * tex_h / (r32)state->shown_preview.h;
+                    set_render_texture(state, GL_TEXTURE_2D, preview_texture_id);
+                    draw_faded_quad(state, x0, preview_y0, x1, y1, 0.0f, preview_v1, 1.0f, 0.0f,
+                        preview_fade_x, 0.0f, preview_fade_x, preview_fade_y);
+                  }
                 }
-
-                glBegin(GL_QUADS);
-                glTexCoord2f(u0, v1); glVertex2f(x0, y0);
-                glTexCoord2f(u1, v1); glVertex2f(x1, y0);
-                glTexCoord2f(u1, v0); glVertex2f(x1, y1);
-                glTexCoord2f(u0, v0); glVertex2f(x0, y1);
-                glEnd();
               }
 
               if(state->show_info == 1)
               {
-                glScissor(image_region_x0, 0, state->win_w - image_region_x0, info_height);
-                // glScissor(0, 0, state->win_w, state->win_h);
-                glColor3f(text_gray, text_gray, text_gray);
+                set_render_scissor(state, image_region_x0, 0, state->win_w - image_region_x0, info_height);
+                set_render_color(state, text_gray, text_gray, text_gray, 1.0f);
 
                 r32 x = image_region_x0 + 0.2f * fs;
                 r32 y = fs * (state->font_descent + 0.1f);
                 str_t str = viewed_img->parameter_strings[IMG_STR_POSITIVE_PROMPT];
-                draw_str(state, 0, fs, x, y, str);
+                draw_text_layout(state, get_text_layout(state, fs, false, 0, 0, str), x, y);
               }
               if(state->show_info == 2)
               {
-                glScissor(
+                set_render_scissor(state,
                     image_region_x0 + image_region_w, image_region_y0,
                     effective_info_panel_width, state->win_h);
-                // glScissor(0, 0, state->win_w, state->win_h);
 
-                glBindTexture(GL_TEXTURE_2D, 0);
-                glDisable(GL_BLEND);
                 r32 edge_gray = 0.0f;
                 if(interaction_eq(hovered_interaction, info_panel_resize_interaction))
                 {
@@ -5746,13 +10563,10 @@ _search_end_label:
                 {
                   edge_gray = bright_bg ? 0.4f : 0.6f;
                 }
-                glColor3f(edge_gray, edge_gray, edge_gray);
-                glBegin(GL_QUADS);
-                glVertex2f(state->win_w - effective_info_panel_width,     0);
-                glVertex2f(state->win_w - effective_info_panel_width + 1, 0);
-                glVertex2f(state->win_w - effective_info_panel_width + 1, state->win_h);
-                glVertex2f(state->win_w - effective_info_panel_width,     state->win_h);
-                glEnd();
+                set_render_color(state, edge_gray, edge_gray, edge_gray, 1.0f);
+                push_render_rect(state,
+                    state->win_w - effective_info_panel_width, 0,
+                    state->win_w - effective_info_panel_width + 1, state->win_h);
 
                 r32 x0 = state->win_w - effective_info_panel_width + 0.5f * fs;
                 r32 x1 = state->win_w - 0.2f * fs;
@@ -5770,10 +10584,18 @@ _search_end_label:
                 { \
                   y -= fs; \
                   x = x0; \
-                  glColor3f(label_gray, label_gray, label_gray); \
+                  set_render_color(state, label_gray, label_gray, label_gray, 1.0f); \
                   x += draw_str(state, 0, fs, x, y, str(label)); \
-                  glColor3f(text_gray, text_gray, text_gray); \
-                  draw_wrapped_text(state, fs, x_indented, x1, &x, &y, value); \
+                  set_render_color(state, text_gray, text_gray, text_gray, 1.0f); \
+                  if(value.data == tmp) \
+                  { \
+                    /* tmp gets rewritten, so its address can't key a cached layout. */ \
+                    draw_wrapped_text(state, fs, x_indented, x1, &x, &y, value); \
+                  } \
+                  else \
+                  { \
+                    draw_cached_wrapped_text(state, fs, x_indented, x1, &x, &y, value); \
+                  } \
                 }
 
                 if(state->filtered_img_count == state->sorted_img_count)
@@ -5821,8 +10643,7 @@ _search_end_label:
                 }
 
                 y -= fs;
-                if(viewed_img->metadata_generation != viewed_img->load_generation &&
-                    state->metadata_loaded_count <= viewing_img_idx)
+                if(viewed_img->metadata_generation != viewed_img->load_generation)
                 {
                   SHOW_LABEL_VALUE("Loading metadata...", str(" "));
                 }
@@ -5849,12 +10670,7 @@ _search_end_label:
 
             if(state->show_thumbnails)
             {
-              glScissor(0, 0, effective_thumbnail_panel_width, state->win_h);
-
-              glDisable(GL_BLEND);
-              glBindTexture(GL_TEXTURE_2D, 0);
-
-              glBegin(GL_QUADS);
+              set_render_scissor(state, 0, 0, effective_thumbnail_panel_width, state->win_h);
 
               // Scrollbar.
               i32 scrollbar_width = get_scrollbar_width(state);
@@ -5864,7 +10680,7 @@ _search_end_label:
                 {
                   scrollbar_edge_gray = bright_bg ? 0.3f : 0.7f;
                 }
-                glColor3f(scrollbar_edge_gray, scrollbar_edge_gray, scrollbar_edge_gray);
+                set_render_color(state, scrollbar_edge_gray, scrollbar_edge_gray, scrollbar_edge_gray, 1.0f);
 
                 r32 thumbnail_rows = get_thumbnail_rows(state);
                 r32 scrollbar_top_ratio = state->thumbnail_scroll_rows / (r32)thumbnail_rows;
@@ -5873,10 +10689,9 @@ _search_end_label:
                 i32 scrollbar_y1 = (i32)(state->win_h * (1 - scrollbar_top_ratio) + 0.5f);
                 i32 scrollbar_y0 = scrollbar_y1 - scrollbar_yrange;
 
-                glVertex2f(effective_thumbnail_panel_width - scrollbar_width, scrollbar_y0);
-                glVertex2f(effective_thumbnail_panel_width - 2, scrollbar_y0);
-                glVertex2f(effective_thumbnail_panel_width - 2, scrollbar_y1);
-                glVertex2f(effective_thumbnail_panel_width - scrollbar_width, scrollbar_y1);
+                push_render_rect(state,
+                    effective_thumbnail_panel_width - scrollbar_width, scrollbar_y0,
+                    effective_thumbnail_panel_width - 2, scrollbar_y1);
               }
 
               // Resizing bar.
@@ -5890,26 +10705,11 @@ _search_end_label:
                 thumbnail_panel_edge_gray = bright_bg ? 0.4f : 0.6f;
               }
 
-              glColor3f(thumbnail_panel_edge_gray, thumbnail_panel_edge_gray, thumbnail_panel_edge_gray);
-              glVertex2f(effective_thumbnail_panel_width - 2, 0);
-              glVertex2f(effective_thumbnail_panel_width - 1, 0);
-              glVertex2f(effective_thumbnail_panel_width - 1, state->win_h);
-              glVertex2f(effective_thumbnail_panel_width - 2, state->win_h);
-
-              glEnd();
-
-              if(state->alpha_blend)
-              {
-                glEnable(GL_BLEND);
-              }
-              else
-              {
-                glDisable(GL_BLEND);
-              }
-
-              glColor3f(1.0f, 1.0f, 1.0f);
+              set_render_color(state, thumbnail_panel_edge_gray, thumbnail_panel_edge_gray, thumbnail_panel_edge_gray, 1.0f);
+              push_render_rect(state, effective_thumbnail_panel_width - 2, 0, effective_thumbnail_panel_width - 1, state->win_h);
 
-              glScissor(0, 0, max(0, effective_thumbnail_panel_width - scrollbar_width), state->win_h);
+              i32 thumbnails_scissor_w = max(0, effective_thumbnail_panel_width - scrollbar_width);
+              set_render_scissor(state, 0, 0, thumbnails_scissor_w, state->win_h);
               hovered_thumbnail_idx = -1;
 
               // Traverse the thumbnails backwards to update the LRU chain
@@ -5919,7 +10719,7 @@ _search_end_label:
                   --filtered_idx)
               {
                 img_entry_t* img = get_filtered_img(state, filtered_idx);
-                still_loading |= upload_img_texture(state, img);
+                still_loading |= upload_thumbnail_texture(state, img);
 
                 r32 box_x0 = img->thumbnail_column * thumbnail_w;
                 r32 box_y1 = img->thumbnail_y + state->win_h + state->thumbnail_scroll_rows * thumbnail_h;
@@ -5931,7 +10731,10 @@ _search_end_label:
                 {
                   u8 tmp[256];
                   str_t labels[2] = {0};
+                  str_t label_prefixes[2] = {0};
                   i32 label_count = 1;
+                  // The metadata strings keep their layouts across frames, but tmp gets rewritten.
+                  b32 cache_label_layouts = true;
 
                   switch(state->group_mode)
                   {
@@ -5942,6 +10745,7 @@ _search_end_label:
                       labels[0].data = tmp;
                       labels[0].size = snprintf((char*)tmp, sizeof(tmp),
                           "%04d-%02d-%02d", t.tm_year + 1900, t.tm_mon + 1, t.tm_mday);
+                      cache_label_layouts = false;
                     } break;
 
                     case GROUP_MODE_PROMPT:
@@ -5950,9 +10754,8 @@ _search_end_label:
                       if(img->parameter_strings[IMG_STR_NEGATIVE_PROMPT].size > 0)
                       {
                         label_count = 2;
-                        labels[1].data = tmp;
-                        labels[1].size = snprintf((char*)tmp, sizeof(tmp),
-                            "- %.*s", PF_STR(img->parameter_strings[IMG_STR_NEGATIVE_PROMPT]));
+                        labels[1] = img->parameter_strings[IMG_STR_NEGATIVE_PROMPT];
+                        label_prefixes[1] = str("- ");
                       }
                     } break;
 
@@ -5962,6 +10765,22 @@ _search_end_label:
                     } break;
                   }
 
+                  text_layout_t* label_layouts[2] = {0};
+                  r32 label_widths[2] = {0};
+                  for_count(i, label_count)
+                  {
+                    label_widths[i] = draw_str(state, DRAW_STR_MEASURE_ONLY, fs, 0, 0, label_prefixes[i]);
+                    if(cache_label_layouts)
+                    {
+                      label_layouts[i] = get_text_layout(state, fs, false, 0, label_widths[i], labels[i]);
+                      label_widths[i] = label_layouts[i]->end_x;
+                    }
+                    else
+                    {
+                      label_widths[i] += draw_str(state, DRAW_STR_MEASURE_ONLY, fs, 0, 0, labels[i]);
+                    }
+                  }
+
                   r32 label_x0 = box_x0 + 0.15f * fs;
                   r32 label_y0 = box_y1;
                   r32 label_y1 = box_y1 + (label_count + 0.25f) * fs;
@@ -5970,35 +10789,37 @@ _search_end_label:
                       && prev_mouse_y >= label_y0
                       && prev_mouse_y < label_y1)
                   {
-                    glDisable(GL_SCISSOR_TEST);
+                    set_render_scissor(state, 0, 0, state->win_w, state->win_h);
 
                     r32 x1 = 0;
                     for_count(i, label_count)
                     {
-                      x1 = max(x1, draw_str(state, DRAW_STR_MEASURE_ONLY, fs, 0, 0, labels[i]) + 0.5f * fs);
+                      x1 = max(x1, label_widths[i] + 0.5f * fs);
                     }
 
-                    glBindTexture(GL_TEXTURE_2D, 0);
                     r32 g = bright_bg ? 0.9f : 0.1f;
-                    glColor3f(g, g, g);
-                    glBegin(GL_QUADS);
-                    glVertex2f(0, label_y0);
-                    glVertex2f(x1, label_y0);
-                    glVertex2f(x1, label_y1);
-                    glVertex2f(0, label_y1);
-                    glEnd();
+                    set_render_color(state, g, g, g, 1.0f);
+                    push_render_rect(state, 0, label_y0, x1, label_y1);
                   }
 
-                  glColor3f(text_gray, text_gray, text_gray);
+                  set_render_color(state, text_gray, text_gray, text_gray, 1.0f);
                   for_count(i, label_count)
                   {
                     r32 y = label_y0 + fs * ((label_count - i - 1) + 1.5f * state->font_descent);
                     // TODO: Wrap text if longer than window width.
                     // TODO: Highlight changes between previous and next groups.
-                    draw_str(state, 0, fs, label_x0, y, labels[i]);
+                    r32 x = label_x0 + draw_str(state, 0, fs, label_x0, y, label_prefixes[i]);
+                    if(label_layouts[i])
+                    {
+                      draw_text_layout(state, label_layouts[i], label_x0, y);
+                    }
+                    else
+                    {
+                      draw_str(state, 0, fs, x, y, labels[i]);
+                    }
                   }
 
-                  glEnable(GL_SCISSOR_TEST);
+                  set_render_scissor(state, 0, 0, thumbnails_scissor_w, state->win_h);
                 }
 
                 if(hovered_thumbnail_idx == -1 &&
@@ -6014,56 +10835,49 @@ _search_end_label:
 
                 if(filtered_idx == state->viewing_filtered_img_idx || filtered_idx == hovered_thumbnail_idx)
                 {
-                  glBindTexture(GL_TEXTURE_2D, 0);
-
                   b32 viewing_this = (filtered_idx == state->viewing_filtered_img_idx);
                   r32 gray = viewing_this ? (bright_bg ? 0.1f : 0.9f) : 0.5f;
 
                   // TODO: Clamp these adjusted coordinates to screen pixels
                   //       to make it look nicer at small sizes.
                   r32 corner = 0.2f * thumbnail_h;
-                  glColor3f(gray, gray, gray);
-                  glBegin(GL_TRIANGLE_FAN);
-                  glVertex2f(0.5f * (box_x0 + box_x1), 0.5f * (box_y0 + box_y1));
-                  glVertex2f(box_x0 + corner, box_y0);
-                  glVertex2f(box_x1 - corner, box_y0);
-                  glVertex2f(box_x1,          box_y0 + corner);
-                  glVertex2f(box_x1,          box_y1 - corner);
-                  glVertex2f(box_x1 - corner, box_y1);
-                  glVertex2f(box_x0 + corner, box_y1);
-                  glVertex2f(box_x0,          box_y1 - corner);
-                  glVertex2f(box_x0,          box_y0 + corner);
-                  glVertex2f(box_x0 + corner, box_y0);
-                  glEnd();
+                  set_render_color(state, gray, gray, gray, 1.0f);
+                  // An octagon, as a rectangle across the middle and two trapezoids.
+                  set_render_texture(state, GL_TEXTURE_2D, state->font_texture_id);
+                  r32 xs[3][4] = {
+                    {box_x0 + corner, box_x1 - corner, box_x1, box_x0},
+                    {box_x0, box_x1, box_x1, box_x0},
+                    {box_x0, box_x1, box_x1 - corner, box_x0 + corner},
+                  };
+                  r32 ys[4] = {box_y0, box_y0 + corner, box_y1 - corner, box_y1};
+                  for_count(part, 3)
+                  {
+                    render_vertex_t corners[4];
+                    for_count(i, 4)
+                    {
+                      corners[i].x = xs[part][i];
+                      corners[i].y = ys[part + i / 2];
+                      corners[i].u = state->font_white_u;
+                      corners[i].v = state->font_white_v;
+                      corners[i].layer = 0.0f;
+                      copy_bytes(4, state->render_color, corners[i].color);
+                    }
+                    push_render_quad_corners(state, corners);
+                  }
 
                   if(viewing_this)
                   {
                     r32 inset_x = 0.04f * thumbnail_w;
                     r32 inset_y = 0.04f * thumbnail_h;
-                    glColor3f(1 - gray, 1 - gray, 1 - gray);
-                    glBegin(GL_QUADS);
-                    glVertex2f(box_x0 + inset_x, box_y0 + inset_y);
-                    glVertex2f(box_x1 - inset_x, box_y0 + inset_y);
-                    glVertex2f(box_x1 - inset_x, box_y1 - inset_y);
-                    glVertex2f(box_x0 + inset_x, box_y1 - inset_y);
-                    glEnd();
+                    set_render_color(state, 1 - gray, 1 - gray, 1 - gray, 1.0f);
+                    push_render_rect(state, box_x0 + inset_x, box_y0 + inset_y, box_x1 - inset_x, box_y1 - inset_y);
                   }
                 }
 
-                GLuint texture_id = 0;
-                r32 tex_w = img->w;
-                r32 tex_h = img->h;
-                if(!(img->flags & IMG_FLAG_FAILED_TO_LOAD))
+                r32 tex_w = img->thumbnail_w;
+                r32 tex_h = img->thumbnail_h;
+                if(img->thumbnail_texture_id && !(img->flags & IMG_FLAG_FAILED_TO_LOAD))
                 {
-                  texture_id = img->texture_id;
-                }
-
-                if(texture_id)
-                {
-                  glBindTexture(GL_TEXTURE_2D, texture_id);
-                  glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
-                  glColor3f(1.0f, 1.0f, 1.0f);
-
                   r32 mag = 1.0f;
                   if(tex_w != 0 && tex_h != 0)
                   {
@@ -6080,17 +10894,7 @@ _search_end_label:
                   r32 x1 = x0 + mag * tex_w;
                   r32 y0 = y1 - mag * tex_h;
 
-                  r32 u0 = 0;
-                  r32 v0 = 0;
-                  r32 u1 = 1;
-                  r32 v1 = 1;
-
-                  glBegin(GL_QUADS);
-                  glTexCoord2f(u0, v1); glVertex2f(x0, y0);
-                  glTexCoord2f(u1, v1); glVertex2f(x1, y0);
-                  glTexCoord2f(u1, v0); glVertex2f(x1, y1);
-                  glTexCoord2f(u0, v0); glVertex2f(x0, y1);
-                  glEnd();
+                  push_thumbnail_quad(state, img, x0, y0, x1, y1);
                 }
                 else
                 {
@@ -6099,18 +10903,34 @@ _search_end_label:
                   r32 msg_scale = min(2 * fs, 0.9f * thumbnail_w / max(1.0f, unscaled_msg_width));
                   r32 x = 0.5f * (box_x0 + box_x1 - msg_scale * unscaled_msg_width);
                   r32 y = 0.5f * (box_y0 + box_y1 - msg_scale * state->font_ascent);
-                  glColor3f(text_gray, text_gray, text_gray);
+                  set_render_color(state, text_gray, text_gray, text_gray, 1.0f);
                   draw_str(state, 0, msg_scale, x, y, msg);
                 }
+              }
+
+              set_render_blend(state, state->alpha_blend);
+              set_render_color(state, 1.0f, 1.0f, 1.0f, 1.0f);
+              draw_thumbnail_quads(state);
+
+              // The tags go on top of the thumbnails.
+              for(i32 filtered_idx = last_visible_thumbnail_idx;
+                  filtered_idx >= first_visible_thumbnail_idx;
+                  --filtered_idx)
+              {
+                img_entry_t* img = get_filtered_img(state, filtered_idx);
+                r32 box_x0 = img->thumbnail_column * thumbnail_w;
+                r32 box_y1 = img->thumbnail_y + state->win_h + state->thumbnail_scroll_rows * thumbnail_h;
+                r32 box_x1 = box_x0 + thumbnail_w;
+                r32 box_y0 = box_y1 - thumbnail_h;
 
                 r32 tag_scale = min(2 * fs, 0.4f * min(thumbnail_w, thumbnail_h));
                 if(img->flags & IMG_FLAG_MARKED)
                 {
                   r32 x = lerp(box_x0, box_x1, 0.05f);
                   r32 y = lerp(box_y0, box_y1, 0.95f) - tag_scale * state->font_ascent;
-                  glColor3f(0, 0, 0);
+                  set_render_color(state, 0, 0, 0, 1.0f);
                   draw_str(state, 0, tag_scale, x + 0.05f * tag_scale, y - 0.05f * tag_scale, str("M"));
-                  glColor3f(0, 1, 0);
+                  set_render_color(state, 0, 1, 0, 1.0f);
                   draw_str(state, 0, tag_scale, x, y, str("M"));
                 }
                 if(img->parameter_strings[IMG_STR_ANNOTATION].size)
@@ -6118,9 +10938,9 @@ _search_end_label:
                   str_t s = str("A");
                   r32 x = lerp(box_x0, box_x1, 0.95f) - draw_str(state, DRAW_STR_MEASURE_ONLY, tag_scale, 0, 0, s);
                   r32 y = lerp(box_y0, box_y1, 0.95f) - tag_scale * state->font_ascent;
-                  glColor3f(0, 0, 0);
+                  set_render_color(state, 0, 0, 0, 1.0f);
                   draw_str(state, 0, tag_scale, x + 0.05f * tag_scale, y - 0.05f * tag_scale, s);
-                  glColor3f(0, 0.5f, 1);
+                  set_render_color(state, 0, 0.5f, 1, 1.0f);
                   draw_str(state, 0, tag_scale, x, y, s);
                 }
               }
@@ -6132,7 +10952,7 @@ _search_end_label:
               u8* selection_min = text.data + min(state->selection_start, state->selection_end);
               u8* selection_max = text.data + max(state->selection_start, state->selection_end);
 
-              glScissor(0, 0, state->win_w, state->win_h);
+              set_render_scissor(state, 0, 0, state->win_w, state->win_h);
               r32 min_box_width = 10 * fs;
               r32 x1 = state->win_w - 0.6f * fs;
               r32 x0 = max(0, min(image_region_x0 + 0.5f * fs, x1 - min_box_width));
@@ -6160,41 +10980,31 @@ _search_end_label:
                 r32 box_y1 = y1 + fs * (state->font_ascent + 0.2f);
 
                 r32 x_progress_split = box_x1;
-                if(state->metadata_loaded_count < state->total_img_count)
+                if(state->metadata_loaded_count < state->metadata_queued_count)
                 {
-                  r32 completion_ratio = (r32)state->metadata_loaded_count / (r32)state->total_img_count;
+                  r32 completion_ratio = (r32)state->metadata_loaded_count / (r32)state->metadata_queued_count;
                   x_progress_split = lerp(box_x0, box_x1, completion_ratio);
                 }
 
-                glBindTexture(GL_TEXTURE_2D, 0);
-                glDisable(GL_BLEND);
-                glBegin(GL_QUADS);
-                glColor3f(background_gray, background_gray, background_gray);
-                glVertex2f(box_x0, box_y0);
-                glVertex2f(x_progress_split, box_y0);
-                glVertex2f(x_progress_split, box_y1);
-                glVertex2f(box_x0, box_y1);
+                set_render_color(state, background_gray, background_gray, background_gray, 1.0f);
+                push_render_rect(state, box_x0, box_y0, x_progress_split, box_y1);
                 if(x_progress_split != box_x1)
                 {
-                  glColor3f(loading_gray, loading_gray, loading_gray);
-                  glVertex2f(x_progress_split, box_y0);
-                  glVertex2f(box_x1, box_y0);
-                  glVertex2f(box_x1, box_y1);
-                  glVertex2f(x_progress_split, box_y1);
+                  set_render_color(state, loading_gray, loading_gray, loading_gray, 1.0f);
+                  push_render_rect(state, x_progress_split, box_y0, box_x1, box_y1);
                 }
-                glEnd();
               }
 
               {
                 r32 x = x0;
                 r32 y = y1;
 
-                glColor3f(label_gray, label_gray, label_gray);
+                set_render_color(state, label_gray, label_gray, label_gray, 1.0f);
                 x += draw_str(state, 0, fs, x, y, label);
 
                 wrapped_text_ctx_t wrap_ctx = begin_wrapped_text(state, fs, x_indented, x1, text);
 
-                glColor3f(text_gray, text_gray, text_gray);
+                set_render_color(state, text_gray, text_gray, text_gray, 1.0f);
                 b32 cursor_found = false;
                 r32 cursor_x = x;
                 r32 cursor_y = y;
@@ -6228,16 +11038,9 @@ _search_end_label:
                   }
                   if(highlight_x0 != highlight_x1)
                   {
-                    glColor3f(highlight_gray, highlight_gray, highlight_gray);
-                    glBindTexture(GL_TEXTURE_2D, 0);
-                    glDisable(GL_BLEND);
-                    glBegin(GL_QUADS);
-                    glVertex2f(highlight_x0, y - fs * state->font_descent);
-                    glVertex2f(highlight_x1, y - fs * state->font_descent);
-                    glVertex2f(highlight_x1, y + fs * state->font_ascent);
-                    glVertex2f(highlight_x0, y + fs * state->font_ascent);
-                    glEnd();
-                    glColor3f(text_gray, text_gray, text_gray);
+                    set_render_color(state, highlight_gray, highlight_gray, highlight_gray, 1.0f);
+                    push_render_rect(state, highlight_x0, y - fs * state->font_descent, highlight_x1, y + fs * state->font_ascent);
+                    set_render_color(state, text_gray, text_gray, text_gray, 1.0f);
                   }
                   x += draw_str_advanced(state, 0, 1, fs, x, y, span_in_selection, &last_glyph);
 
@@ -6259,20 +11062,15 @@ _search_end_label:
                 } while(finish_wrapped_line(&wrap_ctx, &x, &y));
 
                 // Draw cursor.
-                glBindTexture(GL_TEXTURE_2D, 0);
-                glDisable(GL_BLEND);
-                glBegin(GL_QUADS);
-                glVertex2f(cursor_x - 0.5f, cursor_y - fs * state->font_descent);
-                glVertex2f(cursor_x + 0.5f, cursor_y - fs * state->font_descent);
-                glVertex2f(cursor_x + 0.5f, cursor_y + fs * state->font_ascent);
-                glVertex2f(cursor_x - 0.5f, cursor_y + fs * state->font_ascent);
-                glEnd();
+                push_render_rect(state,
+                    cursor_x - 0.5f, cursor_y - fs * state->font_descent,
+                    cursor_x + 0.5f, cursor_y + fs * state->font_ascent);
               }
             }
 
             if(state->sorting_modal)
             {
-              glScissor(0, 0, state->win_w, state->win_h);
+              set_render_scissor(state, 0, 0, state->win_w, state->win_h);
               r32 box_width = 36 * fs;
               r32 x1 = state->win_w - 0.6f * fs;
               r32 x0 = max(0, min(image_region_x0 + 0.5f * fs, x1 - box_width));
@@ -6289,22 +11087,15 @@ _search_end_label:
                 r32 box_y0 = y - fs * (state->font_descent + 2.2f);
                 r32 box_y1 = y1 + fs * (state->font_ascent + 0.2f);
 
-                glBindTexture(GL_TEXTURE_2D, 0);
-                glDisable(GL_BLEND);
-                glBegin(GL_QUADS);
-                glColor3f(background_gray, background_gray, background_gray);
-                glVertex2f(box_x0, box_y0);
-                glVertex2f(box_x1, box_y0);
-                glVertex2f(box_x1, box_y1);
-                glVertex2f(box_x0, box_y1);
-                glEnd();
+                set_render_color(state, background_gray, background_gray, background_gray, 1.0f);
+                push_render_rect(state, box_x0, box_y0, box_x1, box_y1);
               }
 
               {
                 r32 x = x0;
                 r32 y = y1;
 
-                glColor3f(label_gray, label_gray, label_gray);
+                set_render_color(state, label_gray, label_gray, label_gray, 1.0f);
                 x += draw_str(state, 0, fs, x, y, str("Sort by (hold Shift for descending):"));
 
                 y -= fs;
@@ -6314,11 +11105,11 @@ _search_end_label:
                   x += 0.3 * fs;
                   if(mode_idx == state->sort_mode)
                   {
-                    glColor3f(text_gray, text_gray, text_gray);
+                    set_render_color(state, text_gray, text_gray, text_gray, 1.0f);
                   }
                   else
                   {
-                    glColor3f(label_gray, label_gray, label_gray);
+                    set_render_color(state, label_gray, label_gray, label_gray, 1.0f);
                   }
                   x += draw_str(state, 0, fs, x, y, sort_mode_labels[mode_idx]);
                 }
@@ -6327,21 +11118,21 @@ _search_end_label:
                 x = x_indented;
                 if(!state->sort_descending)
                 {
-                  glColor3f(text_gray, text_gray, text_gray);
+                  set_render_color(state, text_gray, text_gray, text_gray, 1.0f);
                 }
                 else
                 {
-                  glColor3f(label_gray, label_gray, label_gray);
+                  set_render_color(state, label_gray, label_gray, label_gray, 1.0f);
                 }
                 x += draw_str(state, 0, fs, x, y, str("ascending"));
                 x += 0.3 * fs;
                 if(state->sort_descending)
                 {
-                  glColor3f(text_gray, text_gray, text_gray);
+                  set_render_color(state, text_gray, text_gray, text_gray, 1.0f);
                 }
                 else
                 {
-                  glColor3f(label_gray, label_gray, label_gray);
+                  set_render_color(state, label_gray, label_gray, label_gray, 1.0f);
                 }
                 x += draw_str(state, 0, fs, x, y, str("[d]escending"));
               }
@@ -6349,7 +11140,7 @@ _search_end_label:
 
             if(state->grouping_modal)
             {
-              glScissor(0, 0, state->win_w, state->win_h);
+              set_render_scissor(state, 0, 0, state->win_w, state->win_h);
               r32 box_width = 36 * fs;
               r32 x1 = state->win_w - 0.6f * fs;
               r32 x0 = max(0, min(image_region_x0 + 0.5f * fs, x1 - box_width));
@@ -6366,22 +11157,15 @@ _search_end_label:
                 r32 box_y0 = y - fs * (state->font_descent + 1.2f);
                 r32 box_y1 = y1 + fs * (state->font_ascent + 0.2f);
 
-                glBindTexture(GL_TEXTURE_2D, 0);
-                glDisable(GL_BLEND);
-                glBegin(GL_QUADS);
-                glColor3f(background_gray, background_gray, background_gray);
-                glVertex2f(box_x0, box_y0);
-                glVertex2f(box_x1, box_y0);
-                glVertex2f(box_x1, box_y1);
-                glVertex2f(box_x0, box_y1);
-                glEnd();
+                set_render_color(state, background_gray, background_gray, background_gray, 1.0f);
+                push_render_rect(state, box_x0, box_y0, box_x1, box_y1);
               }
 
               {
                 r32 x = x0;
                 r32 y = y1;
 
-                glColor3f(label_gray, label_gray, label_gray);
+                set_render_color(state, label_gray, label_gray, label_gray, 1.0f);
                 x += draw_str(state, 0, fs, x, y, str("Group by:"));
 
                 y -= fs;
@@ -6391,11 +11175,11 @@ _search_end_label:
                   x += 0.3 * fs;
                   if(mode_idx == state->group_mode)
                   {
-                    glColor3f(text_gray, text_gray, text_gray);
+                    set_render_color(state, text_gray, text_gray, text_gray, 1.0f);
                   }
                   else
                   {
-                    glColor3f(label_gray, label_gray, label_gray);
+                    set_render_color(state, label_gray, label_gray, label_gray, 1.0f);
                   }
                   x += draw_str(state, 0, fs, x, y, group_mode_labels[mode_idx]);
                 }
@@ -6410,19 +11194,11 @@ _search_end_label:
               r32 box_y0 = 0;
               r32 box_y1 = min(state->win_h, 34 * fs);
 
-              glScissor(box_x0, box_y0, box_x1 - box_x0, box_y1 - box_y0);
+              set_render_scissor(state, box_x0, box_y0, box_x1 - box_x0, box_y1 - box_y0);
 
-              glEnable(GL_BLEND);
-              glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-              glColor4f(background_gray, background_gray, background_gray, 0.85f);
-              glBindTexture(GL_TEXTURE_2D, 0);
-              glBegin(GL_QUADS);
-              glVertex2f(box_x0, box_y0);
-              glVertex2f(box_x1, box_y0);
-              glVertex2f(box_x1, box_y1);
-              glVertex2f(box_x0, box_y1);
-              glEnd();
-              glDisable(GL_BLEND);
+              set_render_blend(state, true);
+              set_render_color(state, background_gray, background_gray, background_gray, 0.85f);
+              push_render_rect(state, box_x0, box_y0, box_x1, box_y1);
 
               r32 x0 = box_x0 + 0.5f * fs;
               r32 x1 = box_x1 - 0.5f * fs;
@@ -6437,28 +11213,24 @@ _search_end_label:
 
                 if(active_tab)
                 {
-                  glColor3f(text_gray, text_gray, text_gray);
+                  set_render_color(state, text_gray, text_gray, text_gray, 1.0f);
                 }
                 else
                 {
-                  glColor3f(label_gray, label_gray, label_gray);
+                  set_render_color(state, label_gray, label_gray, label_gray, 1.0f);
                 }
 
                 x += draw_str(state, 0, fs, x, y, help_tab_labels[tab_idx]);
                 x += fs;
               }
 
-              glColor3f(label_gray, label_gray, label_gray);
+              set_render_color(state, label_gray, label_gray, label_gray, 1.0f);
               x += fs;
               x += draw_str(state, 0, fs, x, y, str("(Tab ↹ for next section, F1 to toggle this help.)"));
 
-              glBindTexture(GL_TEXTURE_2D, 0);
-              glBegin(GL_QUADS);
-              glVertex2f(box_x0, y - fs * (0.25f + state->font_descent) - 1);
-              glVertex2f(box_x1, y - fs * (0.25f + state->font_descent) - 1);
-              glVertex2f(box_x1, y - fs * (0.25f + state->font_descent));
-              glVertex2f(box_x0, y - fs * (0.25f + state->font_descent));
-              glEnd();
+              push_render_rect(state,
+                  box_x0, y - fs * (0.25f + state->font_descent) - 1,
+                  box_x1, y - fs * (0.25f + state->font_descent));
 
               x = x0;
               y -= 1.0f * fs;
@@ -6470,12 +11242,12 @@ _search_end_label:
                 y -= fs; \
                 x = x0; \
                 \
-                glColor3f(label_gray, label_gray, label_gray); \
+                set_render_color(state, label_gray, label_gray, label_gray, 1.0f); \
                 r32 label_width = draw_str(state, DRAW_STR_MEASURE_ONLY, fs, x, y, str(label)); \
                 x = x_column - label_width - 1.0f * fs; \
                 draw_str(state, 0, fs, x, y, str(label)); \
                 \
-                glColor3f(text_gray, text_gray, text_gray); \
+                set_render_color(state, text_gray, text_gray, text_gray, 1.0f); \
                 x = x_column; \
                 x += draw_str(state, 0, fs, x, y, str(binding)); \
               }
@@ -6521,7 +11293,7 @@ _search_end_label:
 
                 y -= fs;
                 x = x0;
-                glColor3f(text_gray, text_gray, text_gray);
+                set_render_color(state, text_gray, text_gray, text_gray, 1.0f);
                 draw_wrapped_text(state, fs, x0, x1, &x, &y, str(
                       "When the search box is open (Ctrl+F or /), images can be filtered by prompt and other metadata.\n"
                       "Everything is case-insensitive and mostly order-independent.\n"
@@ -6569,6 +11341,7 @@ _search_end_label:
             printf("%X\n", glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000));
 #endif
 
+            flush_render_batch(state);
             glXSwapBuffers(display, glx_window);
 
 #if 1
@@ -6599,12 +11372,13 @@ _search_end_label:
 #if 1
             struct pollfd poll_fds[] = {
               { .fd = ConnectionNumber(display), .events = POLLIN },
+              { .fd = state->shared.completion_eventfd, .events = POLLIN },
               { .fd = state->inotify_fd, .events = POLLIN },
             };
-            nfds_t poll_fd_count = 1;
+            nfds_t poll_fd_count = 2;
             if(state->inotify_fd != -1)
             {
-              poll_fd_count = 2;
+              poll_fd_count = 3;
             }
             // poll(poll_fds, poll_fd_count, 1000);
             poll(poll_fds, poll_fd_count, -1);
@@ -0,0 +1,931 @@
+// PNG decoder for what image generators write: 8-bit RGB or RGBA, not interlaced.
+// Everything else (palettes, grayscale, 16 bits, interlacing, tRNS, ...) is left to stb_image.
+// https://www.w3.org/TR/2003/REC-PNG-20031110/
+// https://www.rfc-editor.org/rfc/rfc1950 (zlib)
+// https://www.rfc-editor.org/rfc/rfc1951 (deflate)
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Set once by png_detect_cpu_features() before the loader threads start, and only read after that.
+static b32 png_has_avx2;
+static b32 png_has_ssse3;
+
+#define INFLATE_WINDOW_SIZE (32 * 1024)
+// Bytes that must be readable after the end of the compressed data.
+#define INFLATE_INPUT_PADDING 16
+// Bytes that may be scribbled over after the output limit, by copies that run in 8-byte steps.
+#define INFLATE_OUTPUT_PADDING 16
+#define INFLATE_FAST_BITS 10
+#define INFLATE_FAST_MASK ((1 << INFLATE_FAST_BITS) - 1)
+
+typedef struct
+{
+  // Indexed by the next INFLATE_FAST_BITS input bits.
+  // Holds the symbol in the low 16 bits and the code length above, or 0 for longer codes.
+  u32 fast[1 << INFLATE_FAST_BITS];
+
+  // Canonical decoding of the longer codes, as in stb_image.
+  u16 first_code[17];
+  u16 first_symbol[17];
+  u32 max_code[17];
+  u16 symbols[288];
+} inflate_huffman_t;
+
+enum
+{
+  INFLATE_BLOCK_HEADER = 0,
+  INFLATE_BLOCK_STORED,
+  INFLATE_BLOCK_HUFFMAN,
+  INFLATE_BLOCK_DONE,
+  INFLATE_BLOCK_ERROR,
+};
+
+// Inflates a zlib stream in pieces, so the caller can consume the output as it comes.
+typedef struct
+{
+  u8* in;
+  u8* in_end;
+  u64 bits;
+  i32 bit_count;
+  i32 overrun_count;
+
+  i32 block_mode;
+  b32 final_block;
+  u32 stored_remaining;
+  i32 match_remaining;
+  i32 match_distance;
+
+  inflate_huffman_t lengths;
+  inflate_huffman_t distances;
+} inflater_t;
+
+static u16 inflate_length_base[31] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258, 0, 0 };
+static u8 inflate_length_extra[31] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0, 0, 0 };
+static u16 inflate_distance_base[32] = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+  257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577, 0, 0 };
+static u8 inflate_distance_extra[32] = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13, 0, 0 };
+
+internal u32 bit_reverse_16(u32 x)
+{
+  x = ((x & 0xaaaa) >> 1) | ((x & 0x5555) << 1);
+  x = ((x & 0xcccc) >> 2) | ((x & 0x3333) << 2);
+  x = ((x & 0xf0f0) >> 4) | ((x & 0x0f0f) << 4);
+  x = ((x & 0xff00) >> 8) | ((x & 0x00ff) << 8);
+  return x;
+}
+
+internal b32 inflate_build_huffman(inflate_huffman_t* huff, u8* code_lengths, i32 symbol_count)
+{
+  b32 result = true;
+  i32 counts[17] = {0};
+  u32 next_code[16] = {0};
+
+  zero_struct(huff->fast);
+  for_count(i, symbol_count) { ++counts[code_lengths[i]]; }
+  counts[0] = 0;
+
+  u32 code = 0;
+  i32 symbol_idx = 0;
+  for(i32 length = 1; length < 16; ++length)
+  {
+    next_code[length] = code;
+    huff->first_code[length] = (u16)code;
+    huff->first_symbol[length] = (u16)symbol_idx;
+    code += counts[length];
+    if(counts[length] && code - 1 >= (1u << length))
+    {
+      // Over-subscribed.
+      result = false;
+    }
+    huff->max_code[length] = code << (16 - length);
+    code <<= 1;
+    symbol_idx += counts[length];
+  }
+  huff->max_code[16] = 0x10000;
+
+  if(result)
+  {
+    for_count(symbol, symbol_count)
+    {
+      i32 length = code_lengths[symbol];
+      if(length)
+      {
+        i32 canonical_idx = next_code[length] - huff->first_code[length] + huff->first_symbol[length];
+        huff->symbols[canonical_idx] = (u16)symbol;
+        if(length <= INFLATE_FAST_BITS)
+        {
+          for(u32 fast_idx = bit_reverse_16(next_code[length]) >> (16 - length);
+              fast_idx < (1 << INFLATE_FAST_BITS);
+              fast_idx += (1 << length))
+          {
+            huff->fast[fast_idx] = symbol | (length << 16);
+          }
+        }
+        ++next_code[length];
+      }
+    }
+  }
+
+  return result;
+}
+
+// Tops the bit buffer up to at least 56 bits with a single unaligned (little-endian) load.
+// Past the end of the input, zeros get fed in, and the stream is considered broken if it keeps asking for them.
+internal inline void inflate_refill(u8** in, u8* in_end, u64* bits, i32* bit_count, i32* overrun_count)
+{
+  if(*in <= in_end)
+  {
+    u64 next = 0;
+    memcpy(&next, *in, 8);
+    *bits |= next << *bit_count;
+    *in += (63 - *bit_count) >> 3;
+    *bit_count |= 56;
+  }
+  else
+  {
+    *bit_count = 63;
+    ++*overrun_count;
+  }
+}
+
+// Returns -1 for codes that aren't in the table.
+internal inline i32 inflate_decode_symbol(inflate_huffman_t* huff, u64* bits, i32* bit_count)
+{
+  i32 symbol = -1;
+  i32 length = 0;
+  u32 entry = huff->fast[*bits & INFLATE_FAST_MASK];
+  if(entry)
+  {
+    symbol = entry & 0xffff;
+    length = entry >> 16;
+  }
+  else
+  {
+    u32 k = bit_reverse_16((u32)*bits & 0xffff);
+    for(length = INFLATE_FAST_BITS + 1; k >= huff->max_code[length]; ++length) {}
+    if(length < 16)
+    {
+      symbol = huff->symbols[(k >> (16 - length)) - huff->first_code[length] + huff->first_symbol[length]];
+    }
+    else
+    {
+      length = 0;
+    }
+  }
+
+  *bits >>= length;
+  *bit_count -= length;
+  return symbol;
+}
+
+internal b32 inflate_begin(inflater_t* z, u8* data, u64 size)
+{
+  b32 result = false;
+  zero_struct(*z);
+
+  if(size >= 2)
+  {
+    u32 cmf = data[0];
+    u32 flg = data[1];
+    result = ((cmf & 0x0f) == 8          // Deflate.
+        && ((cmf << 8) | flg) % 31 == 0  // Header check.
+        && !(flg & 0x20));               // No preset dictionary.
+  }
+
+  if(result)
+  {
+    z->in = data + 2;
+    z->in_end = data + size;
+  }
+  else
+  {
+    z->block_mode = INFLATE_BLOCK_ERROR;
+  }
+
+  return result;
+}
+
+internal void inflate_read_block_header(inflater_t* z)
+{
+  inflate_refill(&z->in, z->in_end, &z->bits, &z->bit_count, &z->overrun_count);
+
+  z->final_block = z->bits & 1;
+  u32 block_type = (z->bits >> 1) & 3;
+  z->bits >>= 3;
+  z->bit_count -= 3;
+
+  if(block_type == 0)
+  {
+    // Stored block: Continue at the next byte boundary, reading directly from the input.
+    z->bits >>= (z->bit_count & 7);
+    z->bit_count &= ~7;
+    z->in -= z->bit_count >> 3;
+    z->bits = 0;
+    z->bit_count = 0;
+
+    if(z->in + 4 > z->in_end)
+    {
+      z->block_mode = INFLATE_BLOCK_ERROR;
+    }
+    else
+    {
+      u32 length = z->in[0] | (z->in[1] << 8);
+      u32 inverted_length = z->in[2] | (z->in[3] << 8);
+      z->in += 4;
+      z->stored_remaining = length;
+      z->block_mode = ((length ^ 0xffff) == inverted_length) ? INFLATE_BLOCK_STORED : INFLATE_BLOCK_ERROR;
+    }
+  }
+  else if(block_type == 1)
+  {
+    u8 code_lengths[288 + 32];
+    for_count(i, 144) { code_lengths[i] = 8; }
+    for(i32 i = 144; i < 256; ++i) { code_lengths[i] = 9; }
+    for(i32 i = 256; i < 280; ++i) { code_lengths[i] = 7; }
+    for(i32 i = 280; i < 288; ++i) { code_lengths[i] = 8; }
+    for(i32 i = 288; i < 288 + 32; ++i) { code_lengths[i] = 5; }
+
+    b32 ok = (inflate_build_huffman(&z->lengths, code_lengths, 288)
+        && inflate_build_huffman(&z->distances, code_lengths + 288, 32));
+    z->block_mode = ok ? INFLATE_BLOCK_HUFFMAN : INFLATE_BLOCK_ERROR;
+  }
+  else if(block_type == 2)
+  {
+    static u8 code_length_order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+    inflate_refill(&z->in, z->in_end, &z->bits, &z->bit_count, &z->overrun_count);
+    i32 length_count = 257 + (z->bits & 0x1f);
+    i32 distance_count = 1 + ((z->bits >> 5) & 0x1f);
+    i32 code_length_count = 4 + ((z->bits >> 10) & 0x0f);
+    z->bits >>= 14;
+    z->bit_count -= 14;
+
+    u8 code_length_lengths[19] = {0};
+    for_count(i, code_length_count)
+    {
+      if(z->bit_count < 3) { inflate_refill(&z->in, z->in_end, &z->bits, &z->bit_count, &z->overrun_count); }
+      code_length_lengths[code_length_order[i]] = z->bits & 7;
+      z->bits >>= 3;
+      z->bit_count -= 3;
+    }
+
+    // RFC 1951 has no more than 286 length and 30 distance codes, which code_lengths is sized for.
+    inflate_huffman_t* code_length_huff = &z->distances;  // Only needed until the real tables get built.
+    b32 ok = (length_count <= 286 && distance_count <= 30
+        && inflate_build_huffman(code_length_huff, code_length_lengths, 19));
+
+    u8 code_lengths[286 + 32] = {0};
+    i32 total_count = length_count + distance_count;
+    i32 filled_count = 0;
+    while(ok && filled_count < total_count)
+    {
+      inflate_refill(&z->in, z->in_end, &z->bits, &z->bit_count, &z->overrun_count);
+      i32 symbol = inflate_decode_symbol(code_length_huff, &z->bits, &z->bit_count);
+      i32 repeat_count = 0;
+      u8 repeat_value = 0;
+
+      if(symbol < 0)
+      {
+        ok = false;
+      }
+      else if(symbol < 16)
+      {
+        code_lengths[filled_count++] = (u8)symbol;
+      }
+      else if(symbol == 16)
+      {
+        ok = (filled_count > 0);
+        repeat_count = 3 + (z->bits & 3);
+        repeat_value = ok ? code_lengths[filled_count - 1] : 0;
+        z->bits >>= 2;
+        z->bit_count -= 2;
+      }
+      else if(symbol == 17)
+      {
+        repeat_count = 3 + (z->bits & 7);
+        z->bits >>= 3;
+        z->bit_count -= 3;
+      }
+      else
+      {
+        repeat_count = 11 + (z->bits & 0x7f);
+        z->bits >>= 7;
+        z->bit_count -= 7;
+      }
+
+      if(filled_count + repeat_count > total_count)
+      {
+        ok = false;
+      }
+      else
+      {
+        for_count(i, repeat_count) { code_lengths[filled_count++] = repeat_value; }
+      }
+
+      ok = ok && (z->overrun_count < 4);
+    }
+
+    ok = (ok
+        && code_lengths[256] != 0
+        && inflate_build_huffman(&z->lengths, code_lengths, length_count)
+        && inflate_build_huffman(&z->distances, code_lengths + length_count, distance_count));
+    z->block_mode = ok ? INFLATE_BLOCK_HUFFMAN : INFLATE_BLOCK_ERROR;
+  }
+  else
+  {
+    z->block_mode = INFLATE_BLOCK_ERROR;
+  }
+
+  if(z->overrun_count >= 4)
+  {
+    z->block_mode = INFLATE_BLOCK_ERROR;
+  }
+}
+
+// Copies a back-reference. Everything from out_pos up to INFLATE_OUTPUT_PADDING bytes after the copy may be overwritten.
+internal inline void inflate_copy_match(u8* out, u64 out_pos, i32 length, i32 distance)
+{
+  u8* dst = out + out_pos;
+  u8* src = dst - distance;
+  if(distance >= 8)
+  {
+    for(i32 i = 0; i < length; i += 8)
+    {
+      u64 chunk;
+      memcpy(&chunk, src + i, 8);
+      memcpy(dst + i, &chunk, 8);
+    }
+  }
+  else if(distance == 1)
+  {
+    memset(dst, *src, length);
+  }
+  else
+  {
+    for_count(i, length) { dst[i] = src[i]; }
+  }
+}
+
+// Inflates into out[out_pos, out_limit), where out[0, out_pos) holds what was inflated before, as far as
+// back-references can reach. Returns the new output position, which only falls short of out_limit at the end of
+// the stream or when the stream is broken (block_mode tells which).
+internal u64 inflate_produce(inflater_t* z, u8* out, u64 out_pos, u64 out_limit)
+{
+  while(out_pos < out_limit)
+  {
+    if(z->match_remaining)
+    {
+      i32 length = (i32)min((u64)z->match_remaining, out_limit - out_pos);
+      inflate_copy_match(out, out_pos, length, z->match_distance);
+      out_pos += length;
+      z->match_remaining -= length;
+    }
+    else if(z->block_mode == INFLATE_BLOCK_HEADER)
+    {
+      inflate_read_block_header(z);
+    }
+    else if(z->block_mode == INFLATE_BLOCK_STORED)
+    {
+      u64 length = min(min((u64)z->stored_remaining, out_limit - out_pos), (u64)(z->in_end - z->in));
+      if(length == 0 && z->stored_remaining)
+      {
+        z->block_mode = INFLATE_BLOCK_ERROR;
+      }
+      else
+      {
+        memcpy(out + out_pos, z->in, length);
+        z->in += length;
+        out_pos += length;
+        z->stored_remaining -= (u32)length;
+        if(z->stored_remaining == 0)
+        {
+          z->block_mode = z->final_block ? INFLATE_BLOCK_DONE : INFLATE_BLOCK_HEADER;
+        }
+      }
+    }
+    else if(z->block_mode == INFLATE_BLOCK_HUFFMAN)
+    {
+      // Hot loop, with the bit buffer in locals so that writing the output doesn't force it back to memory.
+      u8* in = z->in;
+      u8* in_end = z->in_end;
+      u64 bits = z->bits;
+      i32 bit_count = z->bit_count;
+      i32 overrun_count = z->overrun_count;
+      inflate_huffman_t* lengths = &z->lengths;
+      inflate_huffman_t* distances = &z->distances;
+
+      while(out_pos < out_limit)
+      {
+        // 56 bits are enough for the longest length code and distance code with their extra bits.
+        inflate_refill(&in, in_end, &bits, &bit_count, &overrun_count);
+        i32 symbol = inflate_decode_symbol(lengths, &bits, &bit_count);
+
+        if(symbol < 256)
+        {
+          if(symbol < 0 || overrun_count >= 4)
+          {
+            z->block_mode = INFLATE_BLOCK_ERROR;
+            break;
+          }
+          out[out_pos++] = (u8)symbol;
+        }
+        else if(symbol == 256)
+        {
+          z->block_mode = z->final_block ? INFLATE_BLOCK_DONE : INFLATE_BLOCK_HEADER;
+          break;
+        }
+        else
+        {
+          symbol -= 257;
+          i32 length = 0;
+          i32 distance = 0;
+          if(symbol < 29)
+          {
+            i32 extra = inflate_length_extra[symbol];
+            length = inflate_length_base[symbol] + (i32)(bits & ((1 << extra) - 1));
+            bits >>= extra;
+            bit_count -= extra;
+
+            i32 distance_symbol = inflate_decode_symbol(distances, &bits, &bit_count);
+            if(distance_symbol >= 0 && distance_symbol < 30)
+            {
+              extra = inflate_distance_extra[distance_symbol];
+              distance = inflate_distance_base[distance_symbol] + (i32)(bits & ((1 << extra) - 1));
+              bits >>= extra;
+              bit_count -= extra;
+            }
+          }
+
+          if(distance == 0 || (u64)distance > out_pos)
+          {
+            z->block_mode = INFLATE_BLOCK_ERROR;
+            break;
+          }
+
+          if(out_limit - out_pos >= (u64)length)
+          {
+            inflate_copy_match(out, out_pos, length, distance);
+            out_pos += length;
+          }
+          else
+          {
+            // Doesn't fit anymore; the rest gets copied on the next call.
+            z->match_remaining = length;
+            z->match_distance = distance;
+            break;
+          }
+        }
+      }
+
+      z->in = in;
+      z->bits = bits;
+      z->bit_count = bit_count;
+      z->overrun_count = overrun_count;
+    }
+    else
+    {
+      break;
+    }
+  }
+
+  return out_pos;
+}
+
+// Row filters (https://www.w3.org/TR/2003/REC-PNG-20031110/#9Filters).
+// Each one reads the filtered bytes from src and the previous unfiltered row from prev, and writes to dst.
+// bpp is the pixel size in bytes, 3 or 4. Rows must have 16 bytes of slack at the end.
+
+internal inline u8 png_paeth(i32 a, i32 b, i32 c)
+{
+  i32 p = a + b - c;
+  i32 pa = absolute(p - a);
+  i32 pb = absolute(p - b);
+  i32 pc = absolute(p - c);
+  return (u8)((pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c));
+}
+
+#if defined(__SSE2__)
+
+// Pixels are always moved as 4 bytes. With 3-byte pixels, the extra byte that gets stored is overwritten by the
+// next pixel, or lands in the slack at the end of the row.
+internal inline __m128i png_load_pixel(u8* p)
+{
+  u32 value;
+  memcpy(&value, p, 4);
+  return _mm_cvtsi32_si128((i32)value);
+}
+
+internal inline void png_store_pixel(u8* p, __m128i pixel)
+{
+  u32 value = (u32)_mm_cvtsi128_si32(pixel);
+  memcpy(p, &value, 4);
+}
+
+internal inline void png_unfilter_sub(u8* dst, u8* src, i32 row_bytes, i32 bpp)
+{
+  __m128i a = _mm_setzero_si128();
+  for(i32 i = 0; i < row_bytes; i += bpp)
+  {
+    a = _mm_add_epi8(a, png_load_pixel(src + i));
+    png_store_pixel(dst + i, a);
+  }
+}
+
+internal void png_unfilter_up_sse2(u8* dst, u8* src, u8* prev, i32 row_bytes)
+{
+  i32 i = 0;
+  for(; i + 16 <= row_bytes; i += 16)
+  {
+    __m128i x = _mm_loadu_si128((__m128i*)(src + i));
+    __m128i b = _mm_loadu_si128((__m128i*)(prev + i));
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_add_epi8(x, b));
+  }
+  for(; i < row_bytes; ++i) { dst[i] = src[i] + prev[i]; }
+}
+
+__attribute__((target("avx2")))
+internal void png_unfilter_up_avx2(u8* dst, u8* src, u8* prev, i32 row_bytes)
+{
+  i32 i = 0;
+  for(; i + 32 <= row_bytes; i += 32)
+  {
+    __m256i x = _mm256_loadu_si256((__m256i*)(src + i));
+    __m256i b = _mm256_loadu_si256((__m256i*)(prev + i));
+    _mm256_storeu_si256((__m256i*)(dst + i), _mm256_add_epi8(x, b));
+  }
+  for(; i < row_bytes; ++i) { dst[i] = src[i] + prev[i]; }
+}
+
+internal inline void png_unfilter_avg(u8* dst, u8* src, u8* prev, i32 row_bytes, i32 bpp)
+{
+  __m128i one = _mm_set1_epi8(1);
+  __m128i a = _mm_setzero_si128();
+  for(i32 i = 0; i < row_bytes; i += bpp)
+  {
+    __m128i b = png_load_pixel(prev + i);
+    // _mm_avg_epu8 rounds up, the filter rounds down.
+    __m128i average = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+    a = _mm_add_epi8(average, png_load_pixel(src + i));
+    png_store_pixel(dst + i, a);
+  }
+}
+
+internal inline __m128i png_abs_epi16(__m128i x)
+{
+  return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+internal inline __m128i png_select(__m128i mask, __m128i yes, __m128i no)
+{
+  return _mm_or_si128(_mm_and_si128(mask, yes), _mm_andnot_si128(mask, no));
+}
+
+internal inline void png_unfilter_paeth(u8* dst, u8* src, u8* prev, i32 row_bytes, i32 bpp)
+{
+  // Same as png_paeth, on 16-bit lanes.
+  __m128i zero = _mm_setzero_si128();
+  __m128i a = zero;
+  __m128i c = zero;
+  for(i32 i = 0; i < row_bytes; i += bpp)
+  {
+    __m128i b = _mm_unpacklo_epi8(png_load_pixel(prev + i), zero);
+    __m128i pa = _mm_sub_epi16(b, c);
+    __m128i pb = _mm_sub_epi16(a, c);
+    __m128i pc = _mm_add_epi16(pa, pb);
+    pa = png_abs_epi16(pa);
+    pb = png_abs_epi16(pb);
+    pc = png_abs_epi16(pc);
+    __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+    __m128i predicted = png_select(_mm_cmpeq_epi16(pa, smallest), a,
+        png_select(_mm_cmpeq_epi16(pb, smallest), b, c));
+
+    __m128i x = _mm_add_epi8(_mm_packus_epi16(predicted, predicted), png_load_pixel(src + i));
+    png_store_pixel(dst + i, x);
+    a = _mm_unpacklo_epi8(x, zero);
+    c = b;
+  }
+}
+
+#else
+
+internal inline void png_unfilter_sub(u8* dst, u8* src, i32 row_bytes, i32 bpp)
+{
+  for(i32 i = 0; i < bpp; ++i) { dst[i] = src[i]; }
+  for(i32 i = bpp; i < row_bytes; ++i) { dst[i] = src[i] + dst[i - bpp]; }
+}
+
+internal inline void png_unfilter_avg(u8* dst, u8* src, u8* prev, i32 row_bytes, i32 bpp)
+{
+  for(i32 i = 0; i < bpp; ++i) { dst[i] = src[i] + (prev[i] >> 1); }
+  for(i32 i = bpp; i < row_bytes; ++i) { dst[i] = src[i] + ((dst[i - bpp] + prev[i]) >> 1); }
+}
+
+internal inline void png_unfilter_paeth(u8* dst, u8* src, u8* prev, i32 row_bytes, i32 bpp)
+{
+  for(i32 i = 0; i < bpp; ++i) { dst[i] = src[i] + prev[i]; }
+  for(i32 i = bpp; i < row_bytes; ++i) { dst[i] = src[i] + png_paeth(dst[i - bpp], prev[i], prev[i - bpp]); }
+}
+
+#endif
+
+internal void png_detect_cpu_features()
+{
+#if defined(__SSE2__)
+  __builtin_cpu_init();
+  png_has_avx2 = __builtin_cpu_supports("avx2");
+  png_has_ssse3 = __builtin_cpu_supports("ssse3");
+#endif
+}
+
+internal void png_unfilter_up(u8* dst, u8* src, u8* prev, i32 row_bytes)
+{
+#if defined(__SSE2__)
+  if(png_has_avx2) { png_unfilter_up_avx2(dst, src, prev, row_bytes); }
+  else         { png_unfilter_up_sse2(dst, src, prev, row_bytes); }
+#else
+  for_count(i, row_bytes) { dst[i] = src[i] + prev[i]; }
+#endif
+}
+
+internal b32 png_unfilter_row(u8 filter_type, u8* dst, u8* src, u8* prev, i32 row_bytes, i32 bpp)
+{
+  b32 result = true;
+
+  // The branches with a constant bpp let the pixel loops get specialized.
+  if(filter_type == 0)
+  {
+    memcpy(dst, src, row_bytes);
+  }
+  else if(filter_type == 1)
+  {
+    if(bpp == 4) { png_unfilter_sub(dst, src, row_bytes, 4); }
+    else         { png_unfilter_sub(dst, src, row_bytes, 3); }
+  }
+  else if(filter_type == 2)
+  {
+    png_unfilter_up(dst, src, prev, row_bytes);
+  }
+  else if(filter_type == 3)
+  {
+    if(bpp == 4) { png_unfilter_avg(dst, src, prev, row_bytes, 4); }
+    else         { png_unfilter_avg(dst, src, prev, row_bytes, 3); }
+  }
+  else if(filter_type == 4)
+  {
+    if(bpp == 4) { png_unfilter_paeth(dst, src, prev, row_bytes, 4); }
+    else         { png_unfilter_paeth(dst, src, prev, row_bytes, 3); }
+  }
+  else
+  {
+    result = false;
+  }
+
+  return result;
+}
+
+#if defined(__SSE2__)
+__attribute__((target("ssse3")))
+internal void png_rgb_to_rgba_ssse3(u8* dst, u8* src, i32 pixel_count)
+{
+  __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+  __m128i opaque = _mm_set1_epi32((i32)0xff000000);
+  i32 i = 0;
+  // Reads 16 bytes for every 12 used, so it relies on the slack at the end of the source row.
+  for(; i + 4 <= pixel_count; i += 4)
+  {
+    __m128i rgb = _mm_loadu_si128((__m128i*)(src + 3 * i));
+    _mm_storeu_si128((__m128i*)(dst + 4 * i), _mm_or_si128(_mm_shuffle_epi8(rgb, shuffle), opaque));
+  }
+  for(; i < pixel_count; ++i)
+  {
+    dst[4*i + 0] = src[3*i + 0];
+    dst[4*i + 1] = src[3*i + 1];
+    dst[4*i + 2] = src[3*i + 2];
+    dst[4*i + 3] = 255;
+  }
+}
+#endif
+
+internal void png_rgb_to_rgba(u8* dst, u8* src, i32 pixel_count)
+{
+#if defined(__SSE2__)
+  if(png_has_ssse3)
+  {
+    png_rgb_to_rgba_ssse3(dst, src, pixel_count);
+    return;
+  }
+#endif
+
+  for_count(i, pixel_count)
+  {
+    dst[4*i + 0] = src[3*i + 0];
+    dst[4*i + 1] = src[3*i + 1];
+    dst[4*i + 2] = src[3*i + 2];
+    dst[4*i + 3] = 255;
+  }
+}
+
+typedef struct
+{
+  i32 w;
+  i32 h;
+  i32 channel_count;  // In the file; rows always come out as RGBA.
+  i32 next_row;
+  b32 failed;
+
+  u8* compressed;  // All IDAT chunks, concatenated.
+  inflater_t inflater;
+
+  // Inflated, still filtered rows, behind the last 32 KiB of output that back-references can reach.
+  u8* window;
+  u64 window_capacity;
+  u64 window_read_pos;
+  u64 window_write_pos;
+
+  // Unfiltered rows in the file's channel layout.
+  u8* row;
+  u8* prev_row;
+} png_decoder_t;
+
+internal u32 png_read_u32(u8* p)
+{
+  return ((u32)p[0] << 24) | ((u32)p[1] << 16) | ((u32)p[2] << 8) | (u32)p[3];
+}
+
+internal void png_end(png_decoder_t* png)
+{
+  free(png->compressed);
+  free(png->window);
+  free(png->row);
+  free(png->prev_row);
+  zero_struct(*png);
+}
+
+// Reads the header and gathers the image data. Returns false if the file is broken or not in a format that
+// png_decode_rows handles; the decoder must be ended either way.
+internal b32 png_begin(png_decoder_t* png, u8* data, u64 size)
+{
+  b32 result = false;
+  zero_struct(*png);
+
+  u8 signature[8] = { 0x89, 'P', 'N', 'G', 0x0d, 0x0a, 0x1a, 0x0a };
+  if(size >= 8 + 8 + 13 && bytes_eq(8, data, signature))
+  {
+    u8* file_end = data + size;
+    u64 compressed_size = 0;
+    b32 bad = false;
+    b32 seen_header = false;
+
+    // First pass: Check the header and chunks, and add up the image data size.
+    for(u8* ptr = data + 8; !bad && ptr + 8 <= file_end;)
+    {
+      u32 chunk_size = png_read_u32(ptr);
+      u8* chunk_type = ptr + 4;
+      u8* chunk_data = ptr + 8;
+      if(chunk_size > (u64)(file_end - chunk_data))
+      {
+        // Truncated; decode what's there.
+        chunk_size = (u32)(file_end - chunk_data);
+      }
+
+      if(!seen_header)
+      {
+        bad = !bytes_eq(4, chunk_type, "IHDR") || chunk_size < 13;
+        if(!bad)
+        {
+          seen_header = true;
+          u32 w = png_read_u32(chunk_data);
+          u32 h = png_read_u32(chunk_data + 4);
+          u8 bit_depth = chunk_data[8];
+          u8 color_type = chunk_data[9];
+          u8 compression = chunk_data[10];
+          u8 filter = chunk_data[11];
+          u8 interlace = chunk_data[12];
+
+          bad = (w == 0 || h == 0 || w > (1 << 24) || h > (1 << 24) || (u64)w * h >= (1 << 29)
+              || bit_depth != 8 || (color_type != 2 && color_type != 6)
+              || compression != 0 || filter != 0 || interlace != 0);
+          png->w = (i32)w;
+          png->h = (i32)h;
+          png->channel_count = (color_type == 6) ? 4 : 3;
+        }
+      }
+      else if(bytes_eq(4, chunk_type, "IDAT"))
+      {
+        compressed_size += chunk_size;
+      }
+      else if(bytes_eq(4, chunk_type, "IEND"))
+      {
+        break;
+      }
+      else if(bytes_eq(4, chunk_type, "tRNS") || bytes_eq(4, chunk_type, "CgBI"))
+      {
+        // Transparency keys and Apple's PNG variant are left to stb_image.
+        bad = true;
+      }
+
+      ptr = chunk_data + chunk_size + 4;
+    }
+
+    if(!bad && seen_header && compressed_size > 0)
+    {
+      png->compressed = malloc_array(compressed_size + INFLATE_INPUT_PADDING, u8);
+      u64 filtered_row_size = (u64)png->w * png->channel_count + 1;
+      png->window_capacity = INFLATE_WINDOW_SIZE + max(4 * filtered_row_size, 256 * 1024);
+      png->window = malloc_array(png->window_capacity + INFLATE_OUTPUT_PADDING, u8);
+      png->row = malloc_array(filtered_row_size + 16, u8);
+      png->prev_row = malloc_array_zero(filtered_row_size + 16, u8);
+
+      if(png->compressed && png->window && png->row && png->prev_row)
+      {
+        // Second pass: Gather the image data, so that the inflater can refill without looking for chunk boundaries.
+        u8* compressed_end = png->compressed;
+        for(u8* ptr = data + 8; ptr + 8 <= file_end;)
+        {
+          u32 chunk_size = min(png_read_u32(ptr), (u32)(file_end - (ptr + 8)));
+          if(bytes_eq(4, ptr + 4, "IDAT"))
+          {
+            memcpy(compressed_end, ptr + 8, chunk_size);
+            compressed_end += chunk_size;
+          }
+          else if(bytes_eq(4, ptr + 4, "IEND"))
+          {
+            break;
+          }
+          ptr += 8 + chunk_size + 4;
+        }
+        zero_bytes(INFLATE_INPUT_PADDING, compressed_end);
+
+        result = inflate_begin(&png->inflater, png->compressed, compressed_size);
+      }
+    }
+  }
+
+  png->failed = !result;
+  return result;
+}
+
+// Decodes the next row_count rows as RGBA into out, which gets rows of 4*w bytes.
+// Returns how many rows were decoded, which is less than asked for at the end of the image or if it's broken.
+internal i32 png_decode_rows(png_decoder_t* png, u8* out, i32 row_count)
+{
+  i32 rows_done = 0;
+  i32 row_bytes = png->w * png->channel_count;
+  u64 filtered_row_size = (u64)row_bytes + 1;
+
+  while(!png->failed && rows_done < row_count && png->next_row < png->h)
+  {
+    if(png->window_write_pos - png->window_read_pos < filtered_row_size)
+    {
+      if(png->window_capacity - png->window_write_pos < filtered_row_size)
+      {
+        // Slide down what's unread and what back-references can still reach.
+        u64 keep_from = png->window_write_pos - min(png->window_write_pos, (u64)INFLATE_WINDOW_SIZE);
+        keep_from = min(keep_from, png->window_read_pos);
+        memmove(png->window, png->window + keep_from, png->window_write_pos - keep_from);
+        png->window_read_pos -= keep_from;
+        png->window_write_pos -= keep_from;
+      }
+
+      u64 write_pos = inflate_produce(&png->inflater, png->window, png->window_write_pos, png->window_capacity);
+      if(write_pos == png->window_write_pos)
+      {
+        // The stream ended early or is broken.
+        png->failed = true;
+      }
+      png->window_write_pos = write_pos;
+    }
+    else
+    {
+      u8* filtered = png->window + png->window_read_pos;
+      if(!png_unfilter_row(filtered[0], png->row, filtered + 1, png->prev_row, row_bytes, png->channel_count))
+      {
+        png->failed = true;
+      }
+      else
+      {
+        u8* out_row = out + (u64)rows_done * png->w * 4;
+        if(png->channel_count == 4) { memcpy(out_row, png->row, row_bytes); }
+        else                        { png_rgb_to_rgba(out_row, png->row, png->w); }
+
+        u8* swap = png->row;
+        png->row = png->prev_row;
+        png->prev_row = swap;
+        png->window_read_pos += filtered_row_size;
+        ++png->next_row;
+        ++rows_done;
+      }
+    }
+  }
+
+  return rows_done;
+}